@@ -0,0 +1,140 @@
+// Copyright: 2021 Twinleaf LLC
+// License: MIT
+
+// Micro-benchmark for the number formatting used by tio-logparse.
+// For each TL_DATA_TYPE, formats a block of random raw values repeatedly
+// and reports values/sec, for the libc snprintf path tio-logparse used to
+// take and for the routines in tio-format.h.
+
+#include "tio/data.h"
+#include "tio-format.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include <random>
+#include <vector>
+
+#define N_VALUES 4096
+#define MIN_SECONDS 0.5
+
+struct bench_type {
+  const char *name;
+  uint8_t tio_type;
+};
+
+static const bench_type types[] = {
+  { "u8",  TL_DATA_TYPE_UINT8 },
+  { "i8",  TL_DATA_TYPE_INT8 },
+  { "u16", TL_DATA_TYPE_UINT16 },
+  { "i16", TL_DATA_TYPE_INT16 },
+  { "u24", TL_DATA_TYPE_UINT24 },
+  { "i24", TL_DATA_TYPE_INT24 },
+  { "u32", TL_DATA_TYPE_UINT32 },
+  { "i32", TL_DATA_TYPE_INT32 },
+  { "u64", TL_DATA_TYPE_UINT64 },
+  { "i64", TL_DATA_TYPE_INT64 },
+  { "f32", TL_DATA_TYPE_FLOAT32 },
+  { "f64", TL_DATA_TYPE_FLOAT64 },
+};
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// The formatting tio-logparse did before tio-format.h
+static char *format_snprintf(char *p, const uint8_t *raw, uint8_t tio_type)
+{
+  if (tio_type == TL_DATA_TYPE_FLOAT32) {
+    float val;
+    memcpy(&val, raw, sizeof(val));
+    return p + snprintf(p, FORMAT_MAX_CHARS, "%f", val);
+  } else if (tio_type == TL_DATA_TYPE_FLOAT64) {
+    double val;
+    memcpy(&val, raw, sizeof(val));
+    return p + snprintf(p, FORMAT_MAX_CHARS, "%f", val);
+  }
+  size_t size = tio_type >> 4;
+  uint64_t val = 0;
+  memcpy(&val, raw, size);
+  if (tio_type & 1) {
+    unsigned shift = (sizeof(val) - size) * 8;
+    return p + snprintf(p, FORMAT_MAX_CHARS, "%" PRId64,
+                        int64_t(val << shift) >> shift);
+  }
+  return p + snprintf(p, FORMAT_MAX_CHARS, "%" PRIu64, val);
+}
+
+// Random raw values with sensor-like magnitudes
+static std::vector<uint8_t> make_values(uint8_t tio_type, std::mt19937_64 &rng)
+{
+  size_t size = tl_data_type_size(tio_type);
+  std::vector<uint8_t> raw(N_VALUES * size);
+  std::normal_distribution<double> dist(0.0, 1000.0);
+  for (size_t i = 0; i < N_VALUES; i++) {
+    if (tio_type == TL_DATA_TYPE_FLOAT32) {
+      float val = float(dist(rng));
+      memcpy(&raw[i * size], &val, size);
+    } else if (tio_type == TL_DATA_TYPE_FLOAT64) {
+      double val = dist(rng);
+      memcpy(&raw[i * size], &val, size);
+    } else {
+      uint64_t val = rng();
+      memcpy(&raw[i * size], &val, size);
+    }
+  }
+  return raw;
+}
+
+template<typename F>
+static double values_per_sec(const std::vector<uint8_t> &raw,
+                             uint8_t tio_type, F format)
+{
+  size_t size = tl_data_type_size(tio_type);
+  static char out[N_VALUES * (FORMAT_MAX_CHARS + 1)];
+  size_t n = 0;
+  size_t checksum = 0;
+  double start = now();
+  double elapsed;
+  do {
+    char *p = out;
+    for (size_t i = 0; i < N_VALUES; i++) {
+      p = format(p, &raw[i * size], tio_type);
+      *p++ = '\t';
+    }
+    checksum += p - out;
+    n += N_VALUES;
+    elapsed = now() - start;
+  } while (elapsed < MIN_SECONDS);
+  if (checksum == 0)
+    fprintf(stderr, "empty output\n");
+  return n / elapsed;
+}
+
+int main()
+{
+  std::mt19937_64 rng(1);
+
+  printf("%-5s %15s %15s %15s %8s\n",
+         "type", "snprintf", "fixed", "shortest", "speedup");
+  for (const bench_type &bt: types) {
+    std::vector<uint8_t> raw = make_values(bt.tio_type, rng);
+    double libc = values_per_sec(raw, bt.tio_type, format_snprintf);
+    double fixed = values_per_sec(raw, bt.tio_type,
+      [](char *p, const uint8_t *v, uint8_t t) {
+        return format_value(p, v, t, false); });
+    double shortest = values_per_sec(raw, bt.tio_type,
+      [](char *p, const uint8_t *v, uint8_t t) {
+        return format_value(p, v, t, true); });
+    printf("%-5s %15.0f %15.0f %15.0f %7.1fx\n",
+           bt.name, libc, fixed, shortest, fixed / libc);
+  }
+
+  return 0;
+}
@@ -0,0 +1,293 @@
+// Copyright: 2021 Twinleaf LLC
+// License: MIT
+
+// Typed access and number formatting for the table generating tools.
+//
+// tio_type<TL_DATA_TYPE_x> gives the native C++ type holding values of a
+// TIO data type, and decode_raw<>() reads one from packet data. 24 bit
+// types are widened to 32 bits. with_tio_type() turns a runtime type code
+// into a compile time one, so that code working on many values of the
+// same type is instantiated once per type instead of switching per value.
+//
+// All the formatting functions write straight into a caller provided
+// buffer and return the pointer past the last character written; there is
+// no terminating NUL. The caller guarantees there are at least
+// FORMAT_MAX_CHARS available.
+//
+// format_fixed() produces exactly the same text as printf("%.*f"), but
+// without going through the locale and stdio machinery: the value is scaled
+// and rounded (half to even) exactly in 128 bit integer arithmetic, and the
+// digits are written from a two digit lookup table. Values whose scaled
+// representation does not fit in 64 bits, infinities and NaN fall back to
+// snprintf.
+
+#ifndef TIO_FORMAT_H
+#define TIO_FORMAT_H
+
+#include "tio/data.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <charconv>
+#include <type_traits>
+#include <vector>
+
+// Longest text produced for a single value: %f of DBL_MAX is 317 chars.
+#define FORMAT_MAX_CHARS 328
+
+static const char format_digit_pairs[201] =
+  "00010203040506070809101112131415161718192021222324252627282930313233343536"
+  "37383940414243444546474849505152535455565758596061626364656667686970717273"
+  "7475767778798081828384858687888990919293949596979899";
+
+static const uint64_t format_pow10[] = {
+  1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull,
+  10000000ull, 100000000ull, 1000000000ull,
+};
+
+inline char *format_uint(char *p, uint64_t val)
+{
+  char buf[20];
+  char *end = buf + sizeof(buf);
+  char *q = end;
+  while (val >= 100) {
+    unsigned i = (val % 100) * 2;
+    val /= 100;
+    *--q = format_digit_pairs[i + 1];
+    *--q = format_digit_pairs[i];
+  }
+  if (val >= 10) {
+    *--q = format_digit_pairs[val * 2 + 1];
+    *--q = format_digit_pairs[val * 2];
+  } else {
+    *--q = char('0' + val);
+  }
+  memcpy(p, q, end - q);
+  return p + (end - q);
+}
+
+inline char *format_int(char *p, int64_t val)
+{
+  uint64_t uval = uint64_t(val);
+  if (val < 0) {
+    *p++ = '-';
+    uval = ~uval + 1;
+  }
+  return format_uint(p, uval);
+}
+
+// Write 'val' as exactly 'digits' decimal digits, zero padded
+inline char *format_uint_padded(char *p, uint64_t val, unsigned digits)
+{
+  for (unsigned i = digits; i > 1; i -= 2) {
+    unsigned d = (val % 100) * 2;
+    val /= 100;
+    p[i - 1] = format_digit_pairs[d + 1];
+    p[i - 2] = format_digit_pairs[d];
+  }
+  if (digits & 1)
+    p[0] = char('0' + val % 10);
+  return p + digits;
+}
+
+// Same output as printf("%.*f", decimals, val), for decimals <= 9
+inline char *format_fixed(char *p, double val, unsigned decimals)
+{
+  uint64_t bits;
+  memcpy(&bits, &val, sizeof(bits));
+  int biased_exp = int((bits >> 52) & 0x7FF);
+  uint64_t mantissa = bits & ((1ull << 52) - 1);
+
+  // val = mantissa * 2^exp exactly
+  int exp = -1074;
+  if (biased_exp != 0) {
+    mantissa |= 1ull << 52;
+    exp = biased_exp - 1075;
+  }
+
+  bool fast = (biased_exp != 0x7FF) && (decimals < 10);
+  uint64_t scaled = 0;
+  if (fast) {
+    // round(val * 10^decimals), half to even like glibc
+    unsigned __int128 prod =
+      (unsigned __int128)mantissa * format_pow10[decimals];
+    if (exp >= 0) {
+      if ((exp > 63) || ((prod >> (64 - exp)) != 0))
+        fast = false;
+      else
+        scaled = uint64_t(prod << exp);
+    } else if (exp > -120) {
+      unsigned shift = unsigned(-exp);
+      unsigned __int128 one = 1;
+      unsigned __int128 q = prod >> shift;
+      unsigned __int128 rem = prod & ((one << shift) - 1);
+      unsigned __int128 half = one << (shift - 1);
+      if ((rem > half) || ((rem == half) && (q & 1)))
+        q++;
+      if ((q >> 64) != 0)
+        fast = false;
+      else
+        scaled = uint64_t(q);
+    }
+    // else: |val * 10^decimals| < 2^-30, so it rounds to zero
+  }
+
+  if (!fast)
+    return p + snprintf(p, FORMAT_MAX_CHARS, "%.*f", int(decimals), val);
+
+  if (bits >> 63)
+    *p++ = '-';
+  p = format_uint(p, scaled / format_pow10[decimals]);
+  if (decimals) {
+    *p++ = '.';
+    p = format_uint_padded(p, scaled % format_pow10[decimals], decimals);
+  }
+  return p;
+}
+
+// Shortest text that reads back to the same value
+template<typename T>
+inline char *format_shortest(char *p, T val)
+{
+#if defined(__cpp_lib_to_chars)
+  return std::to_chars(p, p + FORMAT_MAX_CHARS, val).ptr;
+#else
+  return p + snprintf(p, FORMAT_MAX_CHARS, "%.*g",
+                      (sizeof(T) == sizeof(float)) ? 9 : 17, double(val));
+#endif
+}
+
+template<uint8_t TIO_TYPE> struct tio_type;
+template<> struct tio_type<TL_DATA_TYPE_UINT8>   { using native = uint8_t; };
+template<> struct tio_type<TL_DATA_TYPE_INT8>    { using native = int8_t; };
+template<> struct tio_type<TL_DATA_TYPE_UINT16>  { using native = uint16_t; };
+template<> struct tio_type<TL_DATA_TYPE_INT16>   { using native = int16_t; };
+template<> struct tio_type<TL_DATA_TYPE_UINT24>  { using native = uint32_t; };
+template<> struct tio_type<TL_DATA_TYPE_INT24>   { using native = int32_t; };
+template<> struct tio_type<TL_DATA_TYPE_UINT32>  { using native = uint32_t; };
+template<> struct tio_type<TL_DATA_TYPE_INT32>   { using native = int32_t; };
+template<> struct tio_type<TL_DATA_TYPE_UINT64>  { using native = uint64_t; };
+template<> struct tio_type<TL_DATA_TYPE_INT64>   { using native = int64_t; };
+template<> struct tio_type<TL_DATA_TYPE_FLOAT32> { using native = float; };
+template<> struct tio_type<TL_DATA_TYPE_FLOAT64> { using native = double; };
+
+// Read a raw (little endian, possibly unaligned) value
+template<uint8_t TIO_TYPE>
+inline typename tio_type<TIO_TYPE>::native decode_raw(const uint8_t *raw)
+{
+  using T = typename tio_type<TIO_TYPE>::native;
+  if constexpr ((TIO_TYPE >> 4) == 3) {
+    uint32_t val =
+      raw[0] | (uint32_t(raw[1]) << 8) | (uint32_t(raw[2]) << 16);
+    if constexpr (std::is_signed<T>::value)
+      return T(val << 8) >> 8;
+    else
+      return val;
+  } else {
+    T val;
+    memcpy(&val, raw, sizeof(val));
+    return val;
+  }
+}
+
+// Call f(std::integral_constant<uint8_t, TL_DATA_TYPE_x>()) for the runtime
+// type code; returns false for types that are not supported.
+template<typename F>
+inline bool with_tio_type(uint8_t tio_type, F &&f)
+{
+#define TIO_TYPE_CASE(t)                                \
+  case t: f(std::integral_constant<uint8_t, t>()); return true;
+  switch (tio_type) {
+    TIO_TYPE_CASE(TL_DATA_TYPE_UINT8)
+    TIO_TYPE_CASE(TL_DATA_TYPE_INT8)
+    TIO_TYPE_CASE(TL_DATA_TYPE_UINT16)
+    TIO_TYPE_CASE(TL_DATA_TYPE_INT16)
+    TIO_TYPE_CASE(TL_DATA_TYPE_UINT24)
+    TIO_TYPE_CASE(TL_DATA_TYPE_INT24)
+    TIO_TYPE_CASE(TL_DATA_TYPE_UINT32)
+    TIO_TYPE_CASE(TL_DATA_TYPE_INT32)
+    TIO_TYPE_CASE(TL_DATA_TYPE_UINT64)
+    TIO_TYPE_CASE(TL_DATA_TYPE_INT64)
+    TIO_TYPE_CASE(TL_DATA_TYPE_FLOAT32)
+    TIO_TYPE_CASE(TL_DATA_TYPE_FLOAT64)
+  }
+#undef TIO_TYPE_CASE
+  return false;
+}
+
+inline size_t tio_type_native_size(uint8_t tio_type)
+{
+  size_t size = 0;
+  with_tio_type(tio_type, [&](auto t) {
+    size = sizeof(typename tio_type<decltype(t)::value>::native);
+  });
+  return size;
+}
+
+// Format a native value. Floating point values use 'decimals' fixed digits
+// like %f, or the shortest round trip representation when 'shortest' is set.
+template<typename T>
+inline char *format_native(char *p, T val, bool shortest = false,
+                           unsigned decimals = 6)
+{
+  if constexpr (std::is_floating_point<T>::value) {
+    return shortest ? format_shortest(p, val) :
+      format_fixed(p, val, decimals);
+  } else if constexpr (std::is_signed<T>::value) {
+    (void) shortest; (void) decimals;
+    return format_int(p, val);
+  } else {
+    (void) shortest; (void) decimals;
+    return format_uint(p, val);
+  }
+}
+
+// Format a single raw value of the given TL_DATA_TYPE
+inline char *format_value(char *p, const uint8_t *raw, uint8_t tio_type,
+                          bool shortest = false, unsigned decimals = 6)
+{
+  char *end = p;
+  if (!with_tio_type(tio_type, [&](auto t) {
+        end = format_native(p, decode_raw<decltype(t)::value>(raw),
+                            shortest, decimals);
+      }))
+    throw "Unexpected type";
+  return end;
+}
+
+// Output buffer flushed to a FILE in large blocks.
+struct output_buffer {
+  output_buffer(): fp(nullptr), pos(0) {}
+
+  void open(FILE *f, size_t size) {
+    fp = f;
+    buf.resize(size);
+    pos = 0;
+  }
+
+  // Get a pointer to write at least n characters at
+  char *reserve(size_t n) {
+    if ((pos + n) > buf.size()) {
+      flush();
+      if (n > buf.size())
+        buf.resize(n);
+    }
+    return buf.data() + pos;
+  }
+
+  void commit(char *end) { pos = end - buf.data(); }
+
+  void flush() {
+    if (pos && fp)
+      fwrite(buf.data(), 1, pos, fp);
+    pos = 0;
+  }
+
+  FILE *fp;
+  size_t pos;
+  std::vector<char> buf;
+};
+
+#endif // TIO_FORMAT_H
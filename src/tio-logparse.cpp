@@ -12,84 +12,582 @@
 // merge data from separate timebases).
 // A row merger has a sequence of pointers tio_streams in the order they will
 // appear in the output file, and each tio_stream points back to the
-// row merger processing its data.
+// row merger processing its data. Both maps are in a tio_converter.
 //
-// Packets are read in and metadata is processed, samples are stored in a
-// queue, and the rest is discarded, until the queue accumulated
-// INITAL_QUEUE samples. At this point, the metadata received so far is
-// used to generate the columns that will be in the output tables, and
-// samples are processed, starting from the queued samples and then reading
-// them from the input file.
+// Regular files are memory mapped and packets are parsed in place. A first
+// pass over the packet headers collects all the metadata, with the offset
+// where it was found. The metadata is used to generate the columns that
+// will be in the output tables, and the second pass processes the samples.
+// A stream's samples before its metadata are discarded. The second pass
+// also records checkpoints of the sample numbers of all the streams, which
+// are saved next to the input in a .tioidx file with the metadata; later
+// conversions load it instead of doing the first pass, and use the
+// checkpoints to only read the part of the file with a time range. Without
+// the index, that part is found with binary searches over the file.
+// Other inputs (e.g. pipes) can only be read once: packets are read in and
+// metadata is processed, samples are stored in a queue, and the rest is
+// discarded, until the queue accumulated INITAL_QUEUE samples. At this
+// point, the metadata received so far is used to generate the columns, and
+// samples are processed, starting from the queued samples.
+//
+// With --follow, the input is read the same way, but the end of a regular
+// file is waited on as tio-record appends to it, and a tcp:// URL can be
+// given instead of a file. The scan for metadata is limited to FOLLOW_SCAN
+// seconds, and the rows written out are flushed to the output files every
+// FOLLOW_SYNC seconds, until the conversion is interrupted.
 //
 // Each row merger keeps track of the earliest time of any sample of the
 // contained tio_streams, and the processed samples are kept in the streams,
 // until a sample is processed for a stream in the merger whose time
-// exceeds the earliest time by DELTA_T. When that happens, all the stream
-// samples with time within EPSILON of the earliest time are merged in
-// a row and outputted to the file. Once all the data is read, the remaining
-// samples in the streams are merged and written out.
+// exceeds the earliest time by delta_t (-w). When that happens, all the
+// stream samples with time within epsilon (-e) of the earliest time are
+// merged in a row and outputted to the file. Once all the data is read, the
+// remaining samples in the streams are merged and written out. The earliest
+// sample of each stream is kept in a min-heap, so finding the streams in a
+// row costs O(log streams) for each of them. With -a, the reorder window of
+// each row merger starts small and grows with the lateness of the samples,
+// up to delta_t. Samples that arrive after their row was written out, which
+// happens with -a until the window has grown enough, are ignored and
+// counted, so that rows stay in time order.
+//
+// Note: each stream holds its pending samples in a sample_window, a ring
+// indexed by the 64 bit sample number that stores the decoded values in
+// one contiguous array per column. This way this program can reorder out of
+// order samples within delta_t, memory is bounded by the window size, and
+// values are only formatted when a row is written out.
 //
-// Note: samples are held in an ordered map in the streams, so this program
-// can reorder out of order samples with a window of DELTA_T.
+// The columns of a stream are compiled into column_runs (consecutive columns
+// sharing type and period); decoding and formatting are templates
+// instantiated for each TL_DATA_TYPE and dispatched once per run.
+//
+// With -j, the conversion runs on several threads. A memory mapped file is
+// split into segments at packet boundaries: a first pass over the packet
+// headers records where each segment starts, the 64 bit sample number of
+// every stream at that point, and for each timebase a time boundary between
+// consecutive segments. Each segment is converted by its own tio_converter,
+// writing only the rows within its time boundaries to a part file, and the
+// parts are appended in order to the output at the end. Other inputs are
+// read by the main thread, which hands the samples of each timebase to a
+// worker thread doing the merging, formatting and writing, through a
+// lock-free single producer single consumer queue.
 
 #include "tio/data.h"
 #include "tio/io.h"
+#include "tio-format.h"
 
 #include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <cmath>
 #include <inttypes.h>
 
+#include <algorithm>
+
 #include <string>
 #include <sstream>
 #include <map>
 #include <vector>
 #include <deque>
-#include <functional>
+#include <memory>
+#include <atomic>
+#include <thread>
 
-std::string bin2string(uint8_t **pdataptr, uint8_t tio_type);
+bool shortest_floats = false;
+
+// Samples of a timebase are out of order by less than delta_t seconds, and
+// samples within epsilon seconds of each other are in the same row.
+double delta_t = 5.0;
+double epsilon = 1e-5;
+bool adaptive_window = false;
+
+#define MIN_WINDOW    0.01 // adaptive window of a row merger at the start
+#define WINDOW_MARGIN  2.0 // adaptive window over the lateness seen
 
 struct column {
   column(const std::string &name, const std::string &desc,
-         uint8_t tio_type, uint32_t period):
-    name(name), desc(desc), period(period) {
-    parser = [tio_type] (uint8_t **pdataptr) {
-      return bin2string(pdataptr, tio_type);
-    };
-  }
+         const std::string &units, uint8_t tio_type, uint32_t period):
+    name(name), desc(desc), units(units), tio_type(tio_type),
+    period(period) {}
   std::string name;
   std::string desc;
-  using dataparser = std::function<std::string(uint8_t**)>;
-  dataparser parser;
+  std::string units;
+  uint8_t tio_type;
   uint32_t period;
 };
 
+// A run of consecutive columns with the same type and period. A stream's
+// columns are compiled into a short list of runs, and both decoding packets
+// and formatting rows loop over the runs with a typed inner loop, so there
+// is one type dispatch per run rather than one per value.
+struct column_run {
+  uint8_t tio_type;
+  uint32_t period;
+  size_t n_columns;
+  size_t raw_size;    // bytes of packet data for one value
+  size_t native_size; // bytes of a decoded value
+  size_t offset;      // start of the first column's array in the window
+  size_t stride;      // distance between the arrays of consecutive columns
+
+  bool present(uint64_t sample) const {
+    return (period == 1) || ((sample % period) == 0);
+  }
+};
+
+// Reorder window for the samples of a stream that were not written out yet.
+// Samples live in slot (sample_number & mask), and each column has its own
+// contiguous array of decoded values. 'first' is always either an occupied
+// slot or equal to 'end' when the window is empty.
+struct sample_window {
+  sample_window(): first(0), end(0), mask(0) {}
+
+  void init(std::vector<column_run> &runs, size_t min_capacity) {
+    size_t capacity = 1;
+    while (capacity < min_capacity)
+      capacity <<= 1;
+    mask = capacity - 1;
+    size_t size = 0;
+    for (column_run &run: runs) {
+      run.offset = size;
+      run.stride = run.native_size * capacity;
+      size += run.stride * run.n_columns;
+    }
+    tags.assign(capacity, EMPTY);
+    data.resize(size);
+  }
+
+  bool empty() const { return first == end; }
+
+  // Whether 'sample' can be stored without overwriting pending samples
+  bool fits(uint64_t sample) const {
+    if (empty())
+      return true;
+    uint64_t lo = std::min(first, sample);
+    uint64_t hi = std::max(end, sample + 1);
+    return (hi - lo) <= (mask + 1);
+  }
+
+  // Claim the slot for a sample, return false if it was already there.
+  bool insert(uint64_t sample) {
+    if (empty()) {
+      first = sample;
+      end = sample + 1;
+    } else if (sample < first) {
+      first = sample;
+    } else if (sample >= end) {
+      end = sample + 1;
+    }
+    uint64_t &tag = tags[sample & mask];
+    bool is_new = (tag != sample);
+    tag = sample;
+    return is_new;
+  }
+
+  // Release the first sample and advance to the next pending one
+  void pop() {
+    tags[first & mask] = EMPTY;
+    while ((++first != end) && (tags[first & mask] != first));
+  }
+
+  // Location of the value of the first column of a run for a sample
+  uint8_t *run_data(const column_run &run, uint64_t sample) {
+    return &data[run.offset + (sample & mask) * run.native_size];
+  }
+
+  static constexpr uint64_t EMPTY = UINT64_MAX;
+  uint64_t first;
+  uint64_t end;
+  uint64_t mask;
+  std::vector<uint64_t> tags;
+  std::vector<uint8_t> data;
+};
+
+template<uint8_t TIO_TYPE>
+inline void decode_run(const column_run &run, const uint8_t *raw,
+                       uint8_t *dest)
+{
+  using T = typename tio_type<TIO_TYPE>::native;
+  constexpr size_t raw_size = TIO_TYPE >> 4;
+  for (size_t i = 0; i < run.n_columns; i++) {
+    T val = decode_raw<TIO_TYPE>(raw + i * raw_size);
+    memcpy(dest + i * run.stride, &val, sizeof(val));
+  }
+}
+
+template<uint8_t TIO_TYPE>
+inline char *format_run(char *p, const column_run &run, const uint8_t *src)
+{
+  using T = typename tio_type<TIO_TYPE>::native;
+  for (size_t i = 0; i < run.n_columns; i++) {
+    T val;
+    memcpy(&val, src + i * run.stride, sizeof(val));
+    *p++ = '\t';
+    p = format_native(p, val, shortest_floats);
+  }
+  return p;
+}
+
 struct tio_row_merger;
 
 struct tio_stream {
-  tio_stream(): is_good(false) {}
+  tio_stream(): is_good(false), index(0), valid_from(0), first_column(0),
+                in_row(false) {}
 
   tl_stream_info info;
   bool is_good;
+  std::string name;    // node path and stream id, for messages
+  size_t index;        // in the converter's list of streams
+  size_t valid_from;   // input offset of the metadata, data before is ignored
   tio_row_merger *merger;
+  size_t first_column; // of this stream in the merger's table, after 't'
+  bool in_row;         // while the merger writes a row
   std::vector<tl_stream_component_info> components;
   uint64_t sps;
   double sample_time;
   double start_time;
   std::vector<column> columns;
-  std::map<double, std::vector<std::string>> samples;
+  std::vector<column_run> runs;
+  sample_window window;
+
+  double time(uint64_t sample) const {
+    uint64_t secs = sample / sps;
+    return (sample - secs * sps) * sample_time + secs + start_time;
+  }
+
+  // Determine the full 64 bit sample number of a packet, as the one closest
+  // to the latest sample number seen.
+  uint64_t nearest_sample(uint32_t start_sample) const {
+    int32_t delta = int32_t(start_sample - uint32_t(info.sample_number));
+    if ((delta < 0) && (uint64_t(-int64_t(delta)) > info.sample_number))
+      return info.sample_number + uint32_t(delta);
+    return info.sample_number + delta;
+  }
+  // Same, and make it the latest
+  uint64_t unwrap(uint32_t start_sample) {
+    info.sample_number = nearest_sample(start_sample);
+    return info.sample_number;
+  }
+
+  // Group the columns into runs. Fails if a column type is unsupported.
+  bool compile_runs() {
+    runs.clear();
+    for (const column &c: columns) {
+      size_t native_size = tio_type_native_size(c.tio_type);
+      if (native_size == 0)
+        return false;
+      if (!runs.empty() && (runs.back().tio_type == c.tio_type) &&
+          (runs.back().period == c.period)) {
+        runs.back().n_columns++;
+      } else {
+        column_run run;
+        run.tio_type = c.tio_type;
+        run.period = c.period;
+        run.n_columns = 1;
+        run.raw_size = tl_data_type_size(c.tio_type);
+        run.native_size = native_size;
+        run.offset = run.stride = 0;
+        runs.push_back(run);
+      }
+    }
+    return true;
+  }
+
+  // Bytes of packet data holding a sample
+  size_t data_size(uint64_t sample) const {
+    size_t size = 0;
+    for (const column_run &run: runs)
+      if (run.present(sample))
+        size += run.raw_size * run.n_columns;
+    return size;
+  }
+
+  // Decode a packet's data into the window slot of a sample
+  void decode(uint64_t sample, const uint8_t *raw) {
+    for (const column_run &run: runs) {
+      if (!run.present(sample))
+        continue;
+      uint8_t *dest = window.run_data(run, sample);
+      with_tio_type(run.tio_type, [&](auto t) {
+        decode_run<decltype(t)::value>(run, raw, dest);
+      });
+      raw += run.raw_size * run.n_columns;
+    }
+  }
+
+  // Format the row cells of a sample in the window
+  char *format(char *p, uint64_t sample) {
+    for (const column_run &run: runs) {
+      if (!run.present(sample)) {
+        memset(p, '\t', run.n_columns);
+        p += run.n_columns;
+        continue;
+      }
+      const uint8_t *src = window.run_data(run, sample);
+      with_tio_type(run.tio_type, [&](auto t) {
+        p = format_run<decltype(t)::value>(p, run, src);
+      });
+    }
+    return p;
+  }
+};
+
+#define OUTPUT_TSV 0
+#define OUTPUT_NPY 1
+
+int output_format = OUTPUT_TSV;
+
+// Text table: a header line with the column names and a tab separated
+// line per row.
+struct tsv_table {
+  tsv_table(): fp(nullptr), max_row_size(0), p(nullptr) {}
+
+  bool open(const std::string &path, const std::vector<tio_stream*> &streams,
+            bool header = true);
+  void sync() {
+    out.flush();
+    fflush(fp);
+  }
+  void close();
+  bool append_part(tsv_table &part);
+
+  void begin_row(double t) {
+    p = out.reserve(max_row_size);
+    p = format_fixed(p, t, 6);
+  }
+  void cells(tio_stream &stream, uint64_t sample) {
+    p = stream.format(p, sample);
+  }
+  void empty_cells(const tio_stream &stream) {
+    memset(p, '\t', stream.columns.size());
+    p += stream.columns.size();
+  }
+  void end_row() {
+    *p++ = '\n';
+    out.commit(p);
+  }
+
+  std::string path;
+  FILE *fp;
+  output_buffer out;
+  size_t max_row_size;
+  char *p;
+};
+
+// A single .npy file holding a 1-D array. The header is written with room
+// for any row count, and rewritten with the actual count when closing.
+struct npy_file {
+  npy_file(): fp(nullptr) {}
+
+  bool open(const std::string &path, const std::string &dtype);
+  bool sync(size_t rows);
+  bool close(size_t rows);
+
+  void append(const void *val, size_t size) {
+    char *p = out.reserve(size);
+    memcpy(p, val, size);
+    out.commit(p + size);
+  }
+
+  std::string path;
+  std::string dtype;
+  FILE *fp;
+  output_buffer out;
+};
+
+struct npy_column {
+  npy_column(): size(0), has_mask(false) {}
+  npy_file data;
+  npy_file mask;      // 1 where there is a value, only for integer columns
+  size_t size;
+  bool has_mask;
+  uint8_t missing[8]; // value stored for empty cells: NaN or zero
+};
+
+// Binary columnar table: a directory with one native typed .npy file per
+// column, t.npy with the float64 timestamps, and table.json describing
+// names, units, types and files. Empty cells are NaN for floating point
+// columns; integer columns get a uint8 mask file alongside.
+struct npy_table {
+  npy_table(): rows(0) {}
+
+  bool open(const std::string &dir, const std::string &tbid,
+            const std::vector<tio_stream*> &streams,
+            const std::string &part = "");
+  bool sync();
+  bool close();
+  bool append_part(npy_table &part);
+  bool write_json();
+
+  void begin_row(double t) {
+    columns[0].data.append(&t, sizeof(t));
+  }
+  void cells(tio_stream &stream, uint64_t sample);
+  void empty_cells(const tio_stream &stream) {
+    for (size_t i = 0; i < stream.columns.size(); i++)
+      append_missing(columns[1 + stream.first_column + i]);
+  }
+  void end_row() {
+    rows++;
+  }
+
+  template<typename T>
+  void append(npy_column &col, T val) {
+    col.data.append(&val, sizeof(val));
+    if (col.has_mask) {
+      uint8_t one = 1;
+      col.mask.append(&one, 1);
+    }
+  }
+  void append_missing(npy_column &col) {
+    col.data.append(col.missing, col.size);
+    if (col.has_mask) {
+      uint8_t zero = 0;
+      col.mask.append(&zero, 1);
+    }
+  }
+
+  template<uint8_t TIO_TYPE>
+  void append_run(size_t col, const column_run &run, const uint8_t *src) {
+    using T = typename tio_type<TIO_TYPE>::native;
+    for (size_t i = 0; i < run.n_columns; i++) {
+      T val;
+      memcpy(&val, src + i * run.stride, sizeof(val));
+      append(columns[col + i], val);
+    }
+  }
+
+  std::string dir;
+  std::string part;   // suffix of the file names of a part of the table
+  std::string json;
+  size_t rows;
+  std::vector<npy_column> columns;
+};
+
+// Sample handed from the packet scanner to a merger's worker thread. 'data'
+// points into the memory mapped input, or to 'copy' for other inputs.
+struct queued_sample {
+  tio_stream *stream;  // nullptr marks the end of the input
+  uint64_t sample;
+  const uint8_t *data;
+  size_t size;
+  uint8_t copy[sizeof(tl_packet)];
+};
+
+// Lock-free ring for a single producer and a single consumer. The producer
+// fills the slot returned by claim() and publishes it with push(), the
+// consumer reads front() and releases it with pop(). Both wait when the
+// ring is full or empty, first yielding and then sleeping.
+template<typename T>
+struct spsc_queue {
+  spsc_queue(size_t capacity):
+    slots(capacity), mask(capacity - 1), head(0), tail(0) {}
+
+  T &claim() {
+    size_t h = head.load(std::memory_order_relaxed);
+    for (unsigned spins = 0;
+         (h - tail.load(std::memory_order_acquire)) > mask; )
+      backoff(spins);
+    return slots[h & mask];
+  }
+  void push() {
+    head.store(head.load(std::memory_order_relaxed) + 1,
+               std::memory_order_release);
+  }
+
+  T &front() {
+    size_t t = tail.load(std::memory_order_relaxed);
+    for (unsigned spins = 0; head.load(std::memory_order_acquire) == t; )
+      backoff(spins);
+    return slots[t & mask];
+  }
+  void pop() {
+    tail.store(tail.load(std::memory_order_relaxed) + 1,
+               std::memory_order_release);
+  }
+
+  static void backoff(unsigned &spins) {
+    if (++spins < 64)
+      std::this_thread::yield();
+    else
+      usleep(50);
+  }
+
+  std::vector<T> slots;
+  size_t mask;
+  alignas(64) std::atomic<size_t> head;
+  alignas(64) std::atomic<size_t> tail;
+};
+
+#define WORKER_QUEUE 4096
+
+// Table for the rows outside of the time range, which are dropped
+struct null_table {
+  void begin_row(double) {}
+  void cells(tio_stream &, uint64_t) {}
+  void empty_cells(const tio_stream &) {}
+  void end_row() {}
+};
+
+// The first pending sample of a stream. Entries stay in the heap after
+// the stream's first sample changes, until they are on top.
+struct stream_head {
+  double t;
+  tio_stream *stream;
+  uint64_t sample;
+  bool current() const {
+    return !stream->window.empty() && (stream->window.first == sample);
+  }
 };
 
 struct tio_row_merger {
-  tio_row_merger(): first_time(NAN), fp(nullptr) {}
+  tio_row_merger(): index(0), first_time(NAN),
+                    t_begin(-INFINITY), t_end(INFINITY),
+                    row_begin(-INFINITY), row_end(INFINITY),
+                    window_t(adaptive_window ? MIN_WINDOW : delta_t),
+                    latest(-INFINITY), last_row(-INFINITY), n_late(0) {}
+  size_t index;    // in the converter's mergers
   double first_time;
+  double t_begin;  // only samples with t_begin < t <= t_end are output
+  double t_end;
+  double row_begin; // and only rows with row_begin <= t <= row_end
+  double row_end;
+  double window_t;  // reorder window, up to delta_t
+  double latest;    // sample time added
+  double last_row;  // time of the last row written out
+  size_t n_late;    // samples ignored as their row was written out
+  std::vector<stream_head> heap; // of the streams, earliest on top
   std::vector<tio_stream*> streams;
-  FILE *fp;
+  tsv_table tsv;
+  npy_table npy;
+  std::unique_ptr<spsc_queue<queued_sample>> queue; // for the worker
+  std::thread worker;
+
+  void add_sample(tio_stream &stream, uint64_t sample,
+                  const uint8_t *data, size_t size);
+  void flush() {
+    while (std::isfinite(first_time))
+      write_next_row();
+  }
+  void start_worker();
+  void stop_worker();
+  void set_range(double from, double to);
 
   void write_next_row();
+  template<typename TABLE> void merge_row(TABLE &table);
+  void push_head(tio_stream &stream);
+  void update_first_time();
+  static bool later(const stream_head &a, const stream_head &b) {
+    return a.t > b.t;
+  }
 };
 
-std::map<std::string,tio_row_merger> mergers;
-
 struct tio_source {
   tio_source(const tl_source_info &si, const std::string &name):
     info(si), full_name(name) {
@@ -107,6 +605,7 @@ struct tio_node {
 };
 
 struct node_route {
+  node_route(): n_hops(0) {}
   node_route(size_t n, const uint8_t *route): n_hops(n) {
     memcpy(this->route, route, n);
   }
@@ -125,10 +624,54 @@ struct node_route {
   }
 };
 
-std::map<node_route,tio_node> nodes;
+struct tio_reader;
+struct tio_index;
+
+// The state of a conversion: the nodes with their metadata and streams, and
+// a row merger for each timebase. Converters set up from the same metadata
+// have the same streams and mergers, with the same indices, so a file is
+// converted in segments by a converter for each segment.
+struct tio_converter {
+  tio_converter(): scan_end(0), quiet(false), copy_data(false),
+                   index(nullptr), last_node(nullptr) {}
+
+  tio_node *get_node(tl_packet *pkt);
+  void add_metadata(tl_packet *ppkt, size_t offset);
+  void scan_metadata(tio_reader &reader, std::deque<tl_packet*> *queue);
+  void scan_all_metadata(const tio_reader &input);
+  void setup();
+  void replay(const tio_converter &conv);
+  bool open_outputs(const std::string &base_path, const std::string &part);
+  bool append_outputs(tio_converter &part);
+  bool sync_outputs();
+  bool close_outputs();
 
-tio_node *get_node(tl_packet *pkt)
+  tio_stream *find_stream(tl_packet *pkt, size_t offset = SIZE_MAX);
+  void process(tl_packet *pkt, size_t offset = SIZE_MAX, bool kept = true);
+  void start_workers(bool copy);
+  void finish();
+
+  std::map<node_route,tio_node> nodes;
+  std::map<std::string,tio_row_merger> mergers;
+  std::vector<tio_stream*> streams; // that are output, in table order
+  std::vector<std::pair<size_t,tl_packet>> metadata; // and input offsets
+  size_t scan_end;    // input offset where scan_metadata() stopped
+  bool quiet;         // messages are printed by another converter
+  bool copy_data;     // for the workers, as the packets are not kept
+  tio_index *index;   // recording the samples processed
+  node_route last_route;
+  tio_node *last_node;
+};
+
+tio_node *tio_converter::get_node(tl_packet *pkt)
 {
+  // Consecutive packets mostly come from the same node
+  size_t n_hops = tl_packet_routing_size(&pkt->hdr);
+  const uint8_t *route = tl_packet_routing_data(&pkt->hdr);
+  if (last_node && (n_hops == last_route.n_hops) &&
+      (memcmp(route, last_route.route, n_hops) == 0))
+    return last_node;
+
   node_route nr(&pkt->hdr);
   auto it = nodes.find(nr);
   if (it == nodes.end()) {
@@ -142,7 +685,276 @@ tio_node *get_node(tl_packet *pkt)
     it = nodes.emplace(std::make_pair(nr, tio_node(routing_path))).first;
   }
 
-  return &it->second;
+  last_route = nr;
+  last_node = &it->second;
+  return last_node;
+}
+
+#define FOLLOW_POLL    100 // ms waited for more input at a time
+#define FOLLOW_CHUNK (1 << 16)
+
+// Set by a signal to end a conversion that follows its input
+static volatile sig_atomic_t follow_stop = 0;
+
+// Reads packets from a .tio file, which is the plain sequence of packets
+// written by tio-record. Regular files are memory mapped and packets are
+// returned in place, walking the headers with tl_packet_total_size, so
+// there are no per packet copies and the data is not duplicated from the
+// page cache; only packets that are not aligned are copied into a buffer.
+// Other inputs (e.g. pipes) and URLs are read with libtio into a buffer.
+// Returned packets must not be modified.
+//
+// A followed input is read in chunks instead, and its end is waited on
+// when it is a regular file. A URL is read without blocking.
+struct tio_reader {
+  tio_reader(): map(nullptr), map_size(0), offset(0), fd(-1), owner(true),
+                quiet(false), follow(false), waiting(false), follow_fd(-1),
+                growing(false), chunk_pos(0), chunk_len(0) {}
+  // Packets of a mapped input from offset 'begin' until offset 'end'
+  tio_reader(const tio_reader &input, size_t begin, size_t end):
+    map(input.map), map_size(end), offset(begin), fd(-1), owner(false),
+    quiet(false), st(input.st), follow(false), waiting(false), follow_fd(-1),
+    growing(false), chunk_pos(0), chunk_len(0) {}
+  ~tio_reader() {
+    if (map && owner)
+      munmap(const_cast<uint8_t*>(map), map_size);
+    if (fd >= 0)
+      tlclose(fd);
+    if (follow_fd >= 0)
+      close(follow_fd);
+  }
+
+  bool open(const char *path, bool follow_input = false) {
+    follow = follow_input;
+    if (strstr(path, "://")) {
+      fd = tlopen(path, follow ? (O_NONBLOCK | O_CLOEXEC) : 0, NULL);
+      return (fd >= 0);
+    }
+    if (follow) {
+      follow_fd = ::open(path, O_RDONLY | O_CLOEXEC);
+      if ((follow_fd < 0) || (fstat(follow_fd, &st) != 0))
+        return false;
+      growing = S_ISREG(st.st_mode);
+      if (!growing)
+        fcntl(follow_fd, F_SETFL, fcntl(follow_fd, F_GETFL) | O_NONBLOCK);
+      chunk.resize(FOLLOW_CHUNK);
+      return true;
+    }
+
+    // Pipes can only be opened once, so check the type before opening
+    int file_fd = -1;
+    if ((stat(path, &st) == 0) && S_ISREG(st.st_mode) && (st.st_size > 0))
+      file_fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if ((file_fd >= 0) && (fstat(file_fd, &st) == 0) && (st.st_size > 0)) {
+      void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, file_fd, 0);
+      if (addr != MAP_FAILED) {
+        madvise(addr, st.st_size, MADV_SEQUENTIAL);
+        map = static_cast<const uint8_t*>(addr);
+        map_size = st.st_size;
+      }
+    }
+    if (file_fd >= 0)
+      close(file_fd);
+    if (map)
+      return true;
+
+    std::string url = "file://";
+    url += path;
+    fd = tlopen(url.c_str(), 0, NULL);
+    return (fd >= 0);
+  }
+
+  // Next packet, or nullptr at the end of the input. When following the
+  // input, nullptr is also returned with 'waiting' set when no packet
+  // arrived within FOLLOW_POLL ms, so that the caller can do something else
+  // before trying again.
+  tl_packet *next() {
+    waiting = false;
+    if (follow)
+      return next_followed();
+    if (!map) {
+      if (tlrecv(fd, &buf, sizeof(buf)) != 0)
+        return nullptr;
+      offset += tl_packet_total_size(&buf.hdr);
+      return &buf;
+    }
+
+    size_t left = map_size - offset;
+    if (left == 0)
+      return nullptr;
+    size_t size = left + 1;
+    if (left >= sizeof(tl_packet_header)) {
+      memcpy(&buf.hdr, map + offset, sizeof(buf.hdr));
+      size = tl_packet_total_size(&buf.hdr);
+    }
+    if (size > sizeof(tl_packet)) {
+      if (!quiet)
+        printf("Invalid packet at offset %zu, stopping\n", offset);
+      return nullptr;
+    }
+    if (size > left) {
+      if (!quiet)
+        printf("Truncated packet at end of file\n");
+      return nullptr;
+    }
+
+    // A packet after one of odd size is not aligned, so it is copied
+    const uint8_t *raw = map + offset;
+    offset += size;
+    if (reinterpret_cast<uintptr_t>(raw) % alignof(tl_packet)) {
+      memcpy(&buf, raw, size);
+      return &buf;
+    }
+    return reinterpret_cast<tl_packet*>(const_cast<uint8_t*>(raw));
+  }
+
+  // Whether a packet returned by next() is in the mapping, and so stays
+  // valid until the end of the conversion
+  bool in_place(const tl_packet *pkt) const {
+    const uint8_t *raw = reinterpret_cast<const uint8_t*>(pkt);
+    return map && (raw >= map) && (raw < map + map_size);
+  }
+
+  tl_packet *next_followed() {
+    if (follow_stop)
+      return nullptr;
+
+    if (fd >= 0) {
+      if (tlrecv(fd, &buf, sizeof(buf)) == 0) {
+        offset += tl_packet_total_size(&buf.hdr);
+        return &buf;
+      }
+      if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+        return nullptr;
+      struct pollfd pfd = { fd, POLLIN, 0 };
+      poll(&pfd, 1, FOLLOW_POLL);
+      waiting = !follow_stop;
+      return nullptr;
+    }
+
+    for (;;) {
+      size_t left = chunk_len - chunk_pos;
+      if (left >= sizeof(tl_packet_header)) {
+        memcpy(&buf.hdr, &chunk[chunk_pos], sizeof(buf.hdr));
+        size_t size = tl_packet_total_size(&buf.hdr);
+        if (size > sizeof(tl_packet)) {
+          printf("Invalid packet at offset %zu, stopping\n", offset);
+          return nullptr;
+        }
+        if (size <= left) {
+          memcpy(&buf, &chunk[chunk_pos], size);
+          chunk_pos += size;
+          offset += size;
+          return &buf;
+        }
+      }
+
+      // Read more after the partial packet left, if any
+      memmove(chunk.data(), chunk.data() + chunk_pos, left);
+      chunk_pos = 0;
+      chunk_len = left;
+      ssize_t n = read(follow_fd, chunk.data() + left, chunk.size() - left);
+      if (n > 0) {
+        chunk_len += n;
+        continue;
+      }
+      if ((n < 0) && (errno != EAGAIN) && (errno != EINTR))
+        return nullptr;
+      if ((n == 0) && !growing) {
+        if (left)
+          printf("Truncated packet at end of input\n");
+        return nullptr;
+      }
+      if (growing) {
+        usleep(FOLLOW_POLL * 1000);
+      } else {
+        struct pollfd pfd = { follow_fd, POLLIN, 0 };
+        poll(&pfd, 1, FOLLOW_POLL);
+      }
+      waiting = !follow_stop;
+      return nullptr;
+    }
+  }
+
+  // Size of a packet of a mapped input if its header is valid, or 0
+  size_t packet_size(size_t pos) const {
+    if ((map_size - pos) < sizeof(tl_packet_header))
+      return 0;
+    tl_packet_header hdr;
+    memcpy(&hdr, map + pos, sizeof(hdr));
+    if ((tl_packet_routing_size(&hdr) > TL_PACKET_MAX_ROUTING_SIZE) ||
+        (hdr.payload_size > TL_PACKET_MAX_PAYLOAD_SIZE))
+      return 0;
+    size_t size = tl_packet_total_size(&hdr);
+    return (size <= (map_size - pos)) ? size : 0;
+  }
+
+  // Offset of the first packet at or after 'pos' in a mapped input: where
+  // RESYNC_PACKETS consecutive valid headers start, or valid headers lead
+  // exactly to the end.
+  size_t resync(size_t pos) const {
+    for (; pos < map_size; pos++) {
+      size_t next = pos;
+      size_t n = 0;
+      for (size_t size; (n < RESYNC_PACKETS) && (size = packet_size(next));
+           n++)
+        next += size;
+      if ((n == RESYNC_PACKETS) || (next == map_size))
+        return pos;
+    }
+    return map_size;
+  }
+
+  // Keep a packet returned by next() valid across further calls to next().
+  // Copies are packed in large blocks, each one aligned like a tl_packet.
+  tl_packet *retain(tl_packet *pkt) {
+    if (in_place(pkt))
+      return pkt;
+    size_t size = tl_packet_total_size(&pkt->hdr);
+    size_t pad = (alignof(tl_packet) - 1) & -size;
+    if (retained.empty() ||
+        ((retained.back().size() + size + pad) > RETAIN_BLOCK)) {
+      retained.emplace_back();
+      retained.back().reserve(RETAIN_BLOCK);
+    }
+    std::vector<uint8_t> &block = retained.back();
+    size_t pos = block.size();
+    const uint8_t *raw = reinterpret_cast<const uint8_t*>(pkt);
+    block.insert(block.end(), raw, raw + size);
+    block.resize(block.size() + pad);
+    return reinterpret_cast<tl_packet*>(&block[pos]);
+  }
+
+  // Packets that were retained and are no longer needed
+  void release_all() {
+    retained.clear();
+  }
+
+  const uint8_t *map;
+  size_t map_size;
+  size_t offset;    // of the next packet
+  int fd;
+  bool owner;
+  bool quiet;       // about invalid packets
+  struct stat st;   // of a mapped file
+  tl_packet buf;
+  bool follow;
+  bool waiting;     // for a followed input to have more packets
+  int follow_fd;
+  bool growing;     // a followed regular file
+  std::vector<uint8_t> chunk;
+  size_t chunk_pos;
+  size_t chunk_len;
+  static constexpr size_t RETAIN_BLOCK = 1 << 20;
+  static constexpr size_t RESYNC_PACKETS = 8;
+  std::deque<std::vector<uint8_t>> retained;
+};
+
+static double monotonic_time()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
 }
 
 std::string tabjoin(std::vector<std::string> &vs)
@@ -158,172 +970,758 @@ std::string tabjoin(std::vector<std::string> &vs)
   return str;
 }
 
-std::string bin2string(uint8_t **pdataptr, uint8_t tio_type)
-{
-  uint8_t *dataptr = *pdataptr;
-  size_t size = tl_data_type_size(tio_type);
-  *pdataptr = dataptr + size;
-  char fmtbuf[256];
-  strcpy(fmtbuf, "NaN");
-  if (tio_type == TL_DATA_TYPE_FLOAT32) {
-    float val;
-    memcpy(&val, dataptr, sizeof(val));
-    snprintf(fmtbuf, sizeof(fmtbuf), "%f", val);
-  } else if (tio_type == TL_DATA_TYPE_FLOAT64) {
-    double val;
-    memcpy(&val, dataptr, sizeof(val));
-    snprintf(fmtbuf, sizeof(fmtbuf), "%f", val);
-  } else {
-    uint8_t buf[sizeof(uint64_t)];
-    size_t size = tio_type >> 4;
-    if (size > sizeof(buf))
-      throw "Unexpected size";
-    memcpy(buf, dataptr, size);
-    memset(buf+size, 0, sizeof(buf)-size);
-    if (tio_type & 1) {
-      // signed
-      int64_t val;
-      memcpy(&val, buf, sizeof(val));
-      // sign extend
-      val = (val << ((sizeof(buf)-size)*8)) >> ((sizeof(buf)-size)*8);
-      snprintf(fmtbuf, sizeof(fmtbuf), "%" PRId64, val);
-    } else {
-      // unsigned
-      uint64_t val;
-      memcpy(&val, buf, sizeof(val));
-      snprintf(fmtbuf, sizeof(fmtbuf), "%" PRIu64, val);
-    }
-  }
-  return std::string(fmtbuf);
-};
-
 #define INITIAL_QUEUE 200000
-#define DELTA_T          5.0
-#define EPSILON         1e-5
+#define FOLLOW_SCAN      2.0
+#define FOLLOW_SYNC      1.0
 
-void tio_row_merger::write_next_row()
+// Add the first pending sample of a stream to the heap
+void tio_row_merger::push_head(tio_stream &stream)
 {
-  std::vector<std::string> row;
-  char fmtbuf[32];
-  snprintf(fmtbuf, 32, "%.6f", first_time);
-  row.push_back(fmtbuf);
-  double threshold = first_time + EPSILON;
-  first_time = NAN;
+  uint64_t sample = stream.window.first;
+  heap.push_back(stream_head{stream.time(sample), &stream, sample});
+  std::push_heap(heap.begin(), heap.end(), later);
+}
+
+// Drop the entries of samples that are no longer first in their stream,
+// and update first_time to the earliest pending sample.
+void tio_row_merger::update_first_time()
+{
+  while (!heap.empty() && !heap.front().current()) {
+    std::pop_heap(heap.begin(), heap.end(), later);
+    heap.pop_back();
+  }
+  first_time = heap.empty() ? NAN : heap.front().t;
+}
+
+template<typename TABLE>
+void tio_row_merger::merge_row(TABLE &table)
+{
+  table.begin_row(first_time);
+  last_row = first_time;
+  double threshold = first_time + epsilon;
+
+  // Take the streams with a sample in the row off the heap
+  while (!heap.empty() && (heap.front().t <= threshold)) {
+    if (heap.front().current())
+      heap.front().stream->in_row = true;
+    std::pop_heap(heap.begin(), heap.end(), later);
+    heap.pop_back();
+  }
 
   for (tio_stream *stream_ptr: streams) {
-    if (!stream_ptr->samples.empty() &&
-        (stream_ptr->samples.begin()->first <= threshold)) {
-      for (const std::string &str: stream_ptr->samples.begin()->second)
-        row.push_back(str);
-      stream_ptr->samples.erase(stream_ptr->samples.begin());
-    } else {
-      for (size_t i = 0; i < stream_ptr->columns.size(); i++)
-        row.push_back("");
-    }
-    if (!stream_ptr->samples.empty()) {
-      if (!std::isfinite(first_time) ||
-          (stream_ptr->samples.begin()->first < first_time))
-        first_time = stream_ptr->samples.begin()->first;
+    if (!stream_ptr->in_row) {
+      table.empty_cells(*stream_ptr);
+      continue;
     }
+    sample_window &window = stream_ptr->window;
+    table.cells(*stream_ptr, window.first);
+    window.pop();
+    stream_ptr->in_row = false;
+    if (!window.empty())
+      push_head(*stream_ptr);
   }
-  fprintf(fp, "%s\n", tabjoin(row).c_str());
+  table.end_row();
+  update_first_time();
 }
 
-void usage(const char *bin)
+void tio_row_merger::write_next_row()
 {
-  fprintf(stderr, "\n    Usage: %s <path to .tio file>\n\n", bin);
-  fprintf(stderr,
-          "  This program will generate one TSV file for each timebase\n"
-          "  present in the original data. For 'abcd.tio' with a local\n"
-          "  and an absolute timebase, it will create:\n"
-          "      - abcd.unix.tsv (data with absolute time)\n"
-          "      - abcd.1.tsv (data with local time)\n\n");
+  if ((first_time < row_begin) || (first_time > row_end)) {
+    null_table dropped;
+    merge_row(dropped);
+  } else if (output_format == OUTPUT_NPY)
+    merge_row(npy);
+  else
+    merge_row(tsv);
 }
 
-int main(int argc, char *argv[])
+// Store a sample in the window of its stream, and write out the rows that
+// are complete.
+void tio_row_merger::add_sample(tio_stream &stream, uint64_t sample,
+                                const uint8_t *data, size_t size)
 {
-  if (argc != 2) {
-    usage(argv[0]);
-    return 1;
+  // Calculate sample time, and skip samples output by other segments
+  double t = stream.time(sample);
+  if ((t <= t_begin) || (t > t_end))
+    return;
+
+  // Grow an adaptive window to a margin over the lateness of the sample.
+  // A sample of a row already written out would be written out of order.
+  if (!(t < latest))
+    latest = t;
+  else if (adaptive_window && ((latest - t) * WINDOW_MARGIN > window_t))
+    window_t = std::min(delta_t, (latest - t) * WINDOW_MARGIN);
+  if (t <= last_row + epsilon) {
+    n_late++;
+    return;
   }
 
-  int fd = -1;
-  {
-    std::string url = "file://";
-    url += argv[1];
-    fd = tlopen(url.c_str(), 0, NULL);
-    if (fd < 0) {
-      fprintf(stderr, "Failed to open %s\n", argv[1]);
-      return 1;
-    }
+  // Make room in the stream's window if the sample falls outside of it,
+  // then decode the values into the column arrays.
+  if (stream.data_size(sample) > size) {
+    printf("Short packet at time %.6f for stream %s, ignoring it\n",
+           t, stream.name.c_str());
+    return;
   }
+  sample_window &window = stream.window;
+  while (!window.fits(sample))
+    write_next_row();
+  if (!window.insert(sample))
+    printf("Duplicate sample at time %.6f for stream %s, keeping latest\n",
+           t, stream.name.c_str());
+  else if (window.first == sample)
+    push_head(stream);
+  stream.decode(sample, data);
 
-  // read in fixed number of data packets and store the raw metadata
-  // found, and put the samples in queued_data.
-  std::deque<tl_data_stream_packet> queued_data;
+  // Update row merger's earliest sample time if needed
+  if (!std::isfinite(first_time) || (t < first_time))
+    first_time = t;
 
-  while (queued_data.size() < INITIAL_QUEUE) {
-    tl_packet pkt;
-    if (tlrecv(fd, &pkt, sizeof(pkt)) != 0)
-      break;
+  // Output the next row as long as the current sample time exceeds the
+  // earliest sample time by at least the window.
+  while (t > (first_time + window_t))
+    write_next_row();
+}
 
-    if (pkt.hdr.type == TL_PTYPE_TIMEBASE) {
-      tio_node *tn = get_node(&pkt);
-      const tl_timebase_update_packet *tup =
-        reinterpret_cast<tl_timebase_update_packet*>(&pkt);
-      tn->timebases.emplace(std::make_pair(tup->info.id, tup->info));
-    } else if (pkt.hdr.type == TL_PTYPE_SOURCE) {
-      tio_node *tn = get_node(&pkt);
-      const tl_source_update_packet *sup =
-        reinterpret_cast<tl_source_update_packet*>(&pkt);
-      size_t name_len = (pkt.hdr.payload_size -
-                         sizeof(tl_source_info));
-      tn->sources.emplace(
-        std::make_pair(sup->info.id,
-                       tio_source(sup->info,
-                                  std::string(sup->name, name_len))));
-    } else if (pkt.hdr.type == TL_PTYPE_STREAM) {
-      const tl_stream_update_packet *sup =
-        reinterpret_cast<tl_stream_update_packet*>(&pkt);
-      if (!(sup->info.flags & TL_STREAM_ONLY_INFO)) {
-        tio_node *tn = get_node(&pkt);
-        tio_stream &stream = tn->streams[sup->info.id];
-        if (stream.components.size() != sup->info.total_components) {
-          stream.info = sup->info;
-          for(size_t i = 0; i < sup->info.total_components; i++)
-            stream.components.push_back(sup->component[i]);
-        }
-      }
-    } else {
-      int id = tl_packet_stream_id(&pkt.hdr);
-      if (id >= 0) {
-        // To avoid processing packets for a previous acquisition mistakenly
-        // recorded, discard anything before a stream's metadata is received.
-        tio_node *tn = get_node(&pkt);
-        if (tn->streams.count(id)) {
-          const tl_data_stream_packet *dsp =
-            reinterpret_cast<tl_data_stream_packet*>(&pkt);
-          queued_data.push_back(*dsp);
-        }
-      }
+// Output only the rows from 'from' to 'to'. The samples up to delta_t
+// around them are still merged, so that the rows are the same as when
+// converting everything.
+void tio_row_merger::set_range(double from, double to)
+{
+  row_begin = from;
+  row_end = to;
+  t_begin = from - delta_t;
+  t_end = to + delta_t;
+}
+
+void tio_row_merger::start_worker()
+{
+  queue.reset(new spsc_queue<queued_sample>(WORKER_QUEUE));
+  worker = std::thread([this]() {
+    for (;;) {
+      queued_sample &qs = queue->front();
+      if (!qs.stream)
+        break;
+      add_sample(*qs.stream, qs.sample, qs.data, qs.size);
+      queue->pop();
+    }
+    flush();
+  });
+}
+
+void tio_row_merger::stop_worker()
+{
+  queue->claim().stream = nullptr;
+  queue->push();
+  worker.join();
+  queue.reset();
+}
+
+bool tsv_table::open(const std::string &path,
+                     const std::vector<tio_stream*> &streams, bool header)
+{
+  this->path = path;
+  fp = fopen(path.c_str(), "w");
+  if (!fp)
+    return false;
+
+  // Generate header. 2 lines: address+name, description+units
+  std::vector<std::string> names, descs;
+  names.push_back("t");
+  descs.push_back("Time, s");
+  for (const tio_stream *stream_ptr: streams) {
+    for (const column &c: stream_ptr->columns) {
+      names.push_back(c.name);
+      descs.push_back(c.desc + ", " + c.units);
     }
   }
+  // Write first header line
+  if (header)
+    fprintf(fp, "%s\n", tabjoin(names).c_str());
+  // Write second header line with descriptions and units
+  // Some tools expect just one line to label the data, so this is disabled:
+  // fprintf(fp, "%s\n", tabjoin(descs).c_str());
 
-  // Process metadata to create structures about how to parse data
-  for (auto nit = nodes.begin(); nit != nodes.end(); ++nit) {
-    auto &tn = nit->second;
-    std::string addr_prefix = tn.path;
+  max_row_size = names.size() * (FORMAT_MAX_CHARS + 1) + 1;
+  out.open(fp, std::max<size_t>(1 << 20, 2 * max_row_size));
+  return true;
+}
 
-    for (auto sit = tn.streams.begin(); sit != tn.streams.end(); ++sit) {
-      auto stream_id = sit->first;
-      auto &stream = sit->second;
+void tsv_table::close()
+{
+  out.flush();
+  fclose(fp);
+}
 
-      // determine parameters using to convert sample number to sample time
-      auto tbit = tn.timebases.find(stream.info.timebase_id);
-      if (tbit == tn.timebases.end()) {
-        printf("Cannot find metadata for Timebase %d, ignoring stream %s%d\n",
-               stream.info.timebase_id, addr_prefix.c_str(), stream_id);
-        continue;
+// Append the contents of a file after the first 'skip' bytes, and delete it
+static bool append_file(FILE *fp, const std::string &path, size_t skip)
+{
+  FILE *in = fopen(path.c_str(), "rb");
+  bool ok = in && (fseek(in, skip, SEEK_SET) == 0);
+  std::vector<char> buf(1 << 20);
+  size_t n;
+  while (ok && ((n = fread(buf.data(), 1, buf.size(), in)) > 0))
+    ok = (fwrite(buf.data(), 1, n, fp) == n);
+  if (in)
+    fclose(in);
+  unlink(path.c_str());
+  return ok;
+}
+
+// Append the rows of a closed table with the same columns
+bool tsv_table::append_part(tsv_table &part)
+{
+  out.flush();
+  return append_file(fp, part.path, 0);
+}
+
+#define NPY_HEADER_SIZE 128
+
+static bool write_npy_header(FILE *fp, const std::string &dtype, size_t rows)
+{
+  char dict[NPY_HEADER_SIZE];
+  int len = snprintf(dict, sizeof(dict),
+                     "{'descr': '%s', 'fortran_order': False, "
+                     "'shape': (%20zu,), }", dtype.c_str(), rows);
+  size_t header_len = NPY_HEADER_SIZE - 10;
+  if ((len < 0) || (size_t(len) >= header_len))
+    return false;
+  std::string header("\x93NUMPY\x01\x00", 8);
+  header += char(header_len & 0xFF);
+  header += char(header_len >> 8);
+  header += dict;
+  header.resize(NPY_HEADER_SIZE - 1, ' ');
+  header += '\n';
+  return fwrite(header.data(), 1, header.size(), fp) == header.size();
+}
+
+bool npy_file::open(const std::string &path, const std::string &dtype)
+{
+  this->path = path;
+  this->dtype = dtype;
+  fp = fopen(path.c_str(), "wb");
+  if (!fp || !write_npy_header(fp, dtype, 0))
+    return false;
+  out.open(fp, 1 << 16);
+  return true;
+}
+
+// Write out the values so far, with a header for them
+bool npy_file::sync(size_t rows)
+{
+  out.flush();
+  bool ok = (fseek(fp, 0, SEEK_SET) == 0) &&
+    write_npy_header(fp, dtype, rows) && (fseek(fp, 0, SEEK_END) == 0);
+  return (fflush(fp) == 0) && ok;
+}
+
+bool npy_file::close(size_t rows)
+{
+  bool ok = sync(rows);
+  return (fclose(fp) == 0) && ok;
+}
+
+template<typename T> const char *npy_dtype();
+template<> const char *npy_dtype<uint8_t>()  { return "|u1"; }
+template<> const char *npy_dtype<int8_t>()   { return "|i1"; }
+template<> const char *npy_dtype<uint16_t>() { return "<u2"; }
+template<> const char *npy_dtype<int16_t>()  { return "<i2"; }
+template<> const char *npy_dtype<uint32_t>() { return "<u4"; }
+template<> const char *npy_dtype<int32_t>()  { return "<i4"; }
+template<> const char *npy_dtype<uint64_t>() { return "<u8"; }
+template<> const char *npy_dtype<int64_t>()  { return "<i8"; }
+template<> const char *npy_dtype<float>()    { return "<f4"; }
+template<> const char *npy_dtype<double>()   { return "<f8"; }
+
+std::string json_string(const std::string &str)
+{
+  std::string ret = "\"";
+  for (char c: str) {
+    if ((c == '"') || (c == '\\')) {
+      ret += '\\';
+      ret += c;
+    } else if (uint8_t(c) < 0x20) {
+      char fmtbuf[8];
+      snprintf(fmtbuf, sizeof(fmtbuf), "\\u%04x", c);
+      ret += fmtbuf;
+    } else {
+      ret += c;
+    }
+  }
+  return ret + "\"";
+}
+
+// Create a directory and its parents
+static bool make_dirs(const std::string &path)
+{
+  for (size_t pos = 0; pos != std::string::npos; ) {
+    pos = path.find('/', pos + 1);
+    std::string dir = path.substr(0, pos);
+    if ((mkdir(dir.c_str(), 0755) != 0) && (errno != EEXIST))
+      return false;
+  }
+  return true;
+}
+
+// File of a column, relative to the table directory and without the
+// .npy extension. Column names are node paths and are used as relative
+// paths, with the empty components dropped and "." or ".." escaped as
+// "_." or "_..". A component that clashes with a file or directory
+// already in 'paths' (true for directories) gets a number appended.
+static std::string npy_file_name(const std::string &name,
+                                 std::map<std::string,bool> &paths)
+{
+  std::vector<std::string> parts;
+  for (size_t pos = 0; pos <= name.size(); ) {
+    size_t end = std::min(name.find('/', pos), name.size());
+    std::string part = name.substr(pos, end - pos);
+    if ((part == ".") || (part == ".."))
+      part = "_" + part;
+    if (!part.empty())
+      parts.push_back(part);
+    pos = end + 1;
+  }
+  if (parts.empty())
+    parts.push_back("column");
+
+  std::string file;
+  for (size_t i = 0; i + 1 < parts.size(); i++) {
+    std::string dir = file + parts[i];
+    for (unsigned n = 2; paths.count(dir) && !paths[dir]; n++)
+      dir = file + parts[i] + "_" + std::to_string(n);
+    paths[dir] = true;
+    file = dir + "/";
+  }
+  std::string base = file + parts.back();
+  file = base;
+  for (unsigned n = 2; paths.count(file + ".npy") ||
+         paths.count(file + ".mask.npy"); n++)
+    file = base + "_" + std::to_string(n);
+  paths[file + ".npy"] = paths[file + ".mask.npy"] = false;
+  return file;
+}
+
+bool npy_table::open(const std::string &dir, const std::string &tbid,
+                     const std::vector<tio_stream*> &streams,
+                     const std::string &part)
+{
+  this->dir = dir;
+  this->part = part;
+  if (!make_dirs(dir))
+    return false;
+
+  json = "{\n  \"timebase\": " + json_string(tbid) + ",\n";
+  json += "  \"columns\": [\n";
+  json += "    { \"name\": \"t\", \"description\": \"Time\", "
+    "\"units\": \"s\", \"file\": \"t.npy\", \"dtype\": \"<f8\" }";
+  columns.resize(1);
+  columns[0].size = sizeof(double);
+  if (!columns[0].data.open(dir + "/t.npy" + part, npy_dtype<double>()))
+    return false;
+  std::map<std::string,bool> paths = {
+    {"t.npy", false}, {"table.json", false}
+  };
+
+  for (const tio_stream *stream_ptr: streams) {
+    for (const column &c: stream_ptr->columns) {
+      columns.emplace_back();
+      npy_column &col = columns.back();
+      std::string dtype;
+      with_tio_type(c.tio_type, [&](auto t) {
+        using T = typename tio_type<decltype(t)::value>::native;
+        dtype = npy_dtype<T>();
+        col.size = sizeof(T);
+        T missing = T(0);
+        if constexpr (std::is_floating_point<T>::value)
+          missing = NAN;
+        else
+          col.has_mask = true;
+        memcpy(col.missing, &missing, sizeof(T));
+      });
+
+      std::string file = npy_file_name(c.name, paths);
+      size_t slash = file.rfind('/');
+      if ((slash != std::string::npos) &&
+          !make_dirs(dir + "/" + file.substr(0, slash)))
+        return false;
+      if (!col.data.open(dir + "/" + file + ".npy" + part, dtype))
+        return false;
+
+      json += ",\n    { \"name\": " + json_string(c.name) +
+        ", \"description\": " + json_string(c.desc) +
+        ", \"units\": " + json_string(c.units) +
+        ", \"file\": " + json_string(file + ".npy") +
+        ", \"dtype\": \"" + dtype + "\"";
+      if (col.has_mask) {
+        if (!col.mask.open(dir + "/" + file + ".mask.npy" + part,
+                           npy_dtype<uint8_t>()))
+          return false;
+        json += ", \"mask\": " + json_string(file + ".mask.npy");
+      }
+      json += " }";
+    }
+  }
+  json += "\n  ],\n";
+  return true;
+}
+
+void npy_table::cells(tio_stream &stream, uint64_t sample)
+{
+  size_t col = 1 + stream.first_column;
+  for (const column_run &run: stream.runs) {
+    if (!run.present(sample)) {
+      for (size_t i = 0; i < run.n_columns; i++)
+        append_missing(columns[col + i]);
+    } else {
+      const uint8_t *src = stream.window.run_data(run, sample);
+      with_tio_type(run.tio_type, [&](auto t) {
+        append_run<decltype(t)::value>(col, run, src);
+      });
+    }
+    col += run.n_columns;
+  }
+}
+
+bool npy_table::write_json()
+{
+  std::string text = json + "  \"rows\": " + std::to_string(rows) + "\n}\n";
+  FILE *fp = fopen((dir + "/table.json").c_str(), "w");
+  if (!fp)
+    return false;
+  bool ok = (fwrite(text.data(), 1, text.size(), fp) == text.size());
+  return (fclose(fp) == 0) && ok;
+}
+
+// Make the rows so far readable, while more are written
+bool npy_table::sync()
+{
+  bool ok = true;
+  for (npy_column &col: columns) {
+    ok = col.data.sync(rows) && ok;
+    if (col.has_mask)
+      ok = col.mask.sync(rows) && ok;
+  }
+  return write_json() && ok;
+}
+
+bool npy_table::close()
+{
+  bool ok = true;
+  for (npy_column &col: columns) {
+    ok = col.data.close(rows) && ok;
+    if (col.has_mask)
+      ok = col.mask.close(rows) && ok;
+  }
+  if (!part.empty())
+    return ok;
+  return write_json() && ok;
+}
+
+// Append the rows of a closed table with the same columns
+bool npy_table::append_part(npy_table &part)
+{
+  bool ok = true;
+  for (size_t i = 0; i < columns.size(); i++) {
+    columns[i].data.out.flush();
+    ok = append_file(columns[i].data.fp, part.columns[i].data.path,
+                     NPY_HEADER_SIZE) && ok;
+    if (columns[i].has_mask) {
+      columns[i].mask.out.flush();
+      ok = append_file(columns[i].mask.fp, part.columns[i].mask.path,
+                       NPY_HEADER_SIZE) && ok;
+    }
+  }
+  rows += part.rows;
+  return ok;
+}
+
+void tio_converter::add_metadata(tl_packet *ppkt, size_t offset)
+{
+  if ((ppkt->hdr.type != TL_PTYPE_TIMEBASE) &&
+      (ppkt->hdr.type != TL_PTYPE_SOURCE) &&
+      (ppkt->hdr.type != TL_PTYPE_STREAM))
+    return;
+
+  // Metadata is rare, copy it out of the input to access it aligned
+  metadata.emplace_back();
+  metadata.back().first = offset;
+  tl_packet &pkt = metadata.back().second;
+  memcpy(&pkt, ppkt, tl_packet_total_size(&ppkt->hdr));
+
+  if (pkt.hdr.type == TL_PTYPE_TIMEBASE) {
+    tio_node *tn = get_node(&pkt);
+    const tl_timebase_update_packet *tup =
+      reinterpret_cast<tl_timebase_update_packet*>(&pkt);
+    tn->timebases.emplace(std::make_pair(tup->info.id, tup->info));
+  } else if (pkt.hdr.type == TL_PTYPE_SOURCE) {
+    tio_node *tn = get_node(&pkt);
+    const tl_source_update_packet *sup =
+      reinterpret_cast<tl_source_update_packet*>(&pkt);
+    size_t name_len = (pkt.hdr.payload_size -
+                       sizeof(tl_source_info));
+    tn->sources.emplace(
+      std::make_pair(sup->info.id,
+                     tio_source(sup->info,
+                                std::string(sup->name, name_len))));
+  } else {
+    const tl_stream_update_packet *sup =
+      reinterpret_cast<tl_stream_update_packet*>(&pkt);
+    if (!(sup->info.flags & TL_STREAM_ONLY_INFO)) {
+      tio_node *tn = get_node(&pkt);
+      tio_stream &stream = tn->streams[sup->info.id];
+      if (stream.components.size() != sup->info.total_components) {
+        stream.info = sup->info;
+        stream.valid_from = offset;
+        for(size_t i = 0; i < sup->info.total_components; i++)
+          stream.components.push_back(sup->component[i]);
+      }
+    }
+  }
+}
+
+// Read in a fixed number of data packets and process the metadata found.
+// The data packets are put in 'queue' if given. A followed input is read
+// for FOLLOW_SCAN seconds at most.
+void tio_converter::scan_metadata(tio_reader &reader,
+                                  std::deque<tl_packet*> *queue)
+{
+  double deadline = monotonic_time() + FOLLOW_SCAN;
+  for (size_t n_data = 0; n_data < INITIAL_QUEUE; ) {
+    if (reader.follow && (monotonic_time() > deadline))
+      break;
+    size_t offset = reader.offset;
+    tl_packet *ppkt = reader.next();
+    if (!ppkt && reader.waiting)
+      continue;
+    if (!ppkt)
+      break;
+
+    int id = tl_packet_stream_id(&ppkt->hdr);
+    if (id >= 0) {
+      // To avoid processing packets for a previous acquisition mistakenly
+      // recorded, discard anything before a stream's metadata is received.
+      tio_node *tn = get_node(ppkt);
+      if (tn->streams.count(id)) {
+        n_data++;
+        if (queue)
+          queue->push_back(reader.retain(ppkt));
+      }
+      continue;
+    }
+
+    add_metadata(ppkt, offset);
+  }
+  scan_end = reader.offset;
+}
+
+// Find all the metadata of a mapped input, in a pass over the packet headers
+void tio_converter::scan_all_metadata(const tio_reader &input)
+{
+  tio_reader reader(input, 0, input.map_size);
+  reader.quiet = true;
+  for (;;) {
+    size_t offset = reader.offset;
+    tl_packet *pkt = reader.next();
+    if (!pkt)
+      break;
+    if (tl_packet_stream_id(&pkt->hdr) < 0)
+      add_metadata(pkt, offset);
+  }
+}
+
+#define CHECKPOINT_INTERVAL (1 << 20)
+#define NO_SAMPLE UINT64_MAX
+
+// Index of a .tio file, saved next to it as abcd.tioidx, so that converting
+// it again does not need a pass to find the metadata, and a time range is
+// converted by reading only the packets around it. It has:
+//  - the metadata packets, with the offset where they were found;
+//  - for each stream, the lowest sample number and the offset past its
+//    last packet;
+//  - checkpoints about every CHECKPOINT_INTERVAL bytes and at the end of
+//    the file, with the offset and the highest sample number of each stream
+//    before it (or NO_SAMPLE).
+// Streams are in the order of tio_converter::streams, which depends only on
+// the metadata. The index is recorded while converting the whole file, and
+// it is only used while the file has the size and modification time
+// recorded.
+struct tio_index {
+  tio_index(): n_streams(0), next_checkpoint(0) {}
+
+  void start(const tio_converter &conv) {
+    n_streams = conv.streams.size();
+    first_sample.assign(n_streams, NO_SAMPLE);
+    stream_end.assign(n_streams, 0);
+    max_sample.assign(n_streams, NO_SAMPLE);
+    checkpoints.clear();
+    next_checkpoint = 0;
+  }
+
+  // Called with the offset of every packet, in order
+  void reached(size_t offset) {
+    if (offset < next_checkpoint)
+      return;
+    checkpoints.push_back(offset);
+    checkpoints.insert(checkpoints.end(), max_sample.begin(),
+                       max_sample.end());
+    next_checkpoint = offset + CHECKPOINT_INTERVAL;
+  }
+
+  void add_sample(size_t stream, uint64_t sample, size_t end) {
+    if ((first_sample[stream] == NO_SAMPLE) || (sample < first_sample[stream]))
+      first_sample[stream] = sample;
+    if ((max_sample[stream] == NO_SAMPLE) || (sample > max_sample[stream]))
+      max_sample[stream] = sample;
+    stream_end[stream] = end;
+  }
+
+  void finish(size_t end) {
+    next_checkpoint = 0;
+    reached(end);
+  }
+
+  size_t n_checkpoints() const {
+    return checkpoints.size() / (n_streams + 1);
+  }
+  // Offset of a checkpoint, followed by the highest sample of each stream
+  const uint64_t *checkpoint(size_t i) const {
+    return &checkpoints[i * (n_streams + 1)];
+  }
+
+  bool load(const std::string &path, const tio_reader &input,
+            tio_converter &conv);
+  bool save(const std::string &path, const tio_reader &input,
+            const tio_converter &conv);
+
+  size_t n_streams;
+  std::vector<uint64_t> first_sample;
+  std::vector<uint64_t> stream_end;
+  std::vector<uint64_t> checkpoints;
+  std::vector<uint64_t> max_sample; // so far, while recording
+  size_t next_checkpoint;
+};
+
+#define INDEX_MAGIC "TIOIDX2"
+
+// The index file starts with this header, followed by the metadata packets
+// each preceded by its uint64_t offset, and then by the uint64_t arrays.
+struct tio_index_header {
+  char magic[8];
+  uint64_t file_size;
+  int64_t file_mtime;
+  uint64_t n_metadata;
+  uint64_t n_streams;
+  uint64_t n_checkpoints;
+};
+
+// Load the index of a mapped input, if it is up to date, and add its
+// metadata to a converter. The number of streams should be checked after
+// setting the converter up.
+bool tio_index::load(const std::string &path, const tio_reader &input,
+                     tio_converter &conv)
+{
+  FILE *fp = fopen(path.c_str(), "rb");
+  if (!fp)
+    return false;
+
+  tio_index_header hdr;
+  bool ok = (fread(&hdr, sizeof(hdr), 1, fp) == 1) &&
+    (memcmp(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic)) == 0) &&
+    (hdr.file_size == uint64_t(input.st.st_size)) &&
+    (hdr.file_mtime == int64_t(input.st.st_mtime)) &&
+    (hdr.n_streams < (1 << 16)) && (hdr.n_checkpoints <= hdr.file_size);
+
+  std::vector<std::pair<size_t,tl_packet>> metadata;
+  for (uint64_t i = 0; ok && (i < hdr.n_metadata); i++) {
+    uint64_t offset;
+    tl_packet pkt;
+    ok = (fread(&offset, sizeof(offset), 1, fp) == 1) &&
+      (offset < hdr.file_size) &&
+      (fread(&pkt.hdr, sizeof(pkt.hdr), 1, fp) == 1);
+    size_t size = ok ? tl_packet_total_size(&pkt.hdr) : 0;
+    ok = ok && (size <= sizeof(pkt)) &&
+      (fread(pkt.payload, size - sizeof(pkt.hdr), 1, fp) == 1);
+    if (ok)
+      metadata.emplace_back(offset, pkt);
+  }
+
+  if (ok) {
+    n_streams = hdr.n_streams;
+    first_sample.resize(n_streams);
+    stream_end.resize(n_streams);
+    checkpoints.resize(hdr.n_checkpoints * (n_streams + 1));
+    ok = (fread(first_sample.data(), sizeof(uint64_t), n_streams, fp) ==
+          n_streams) &&
+      (fread(stream_end.data(), sizeof(uint64_t), n_streams, fp) ==
+       n_streams) &&
+      (fread(checkpoints.data(), sizeof(uint64_t), checkpoints.size(), fp) ==
+       checkpoints.size());
+  }
+  fclose(fp);
+
+  if (!ok)
+    return false;
+  for (auto &m: metadata)
+    conv.add_metadata(&m.second, m.first);
+  return true;
+}
+
+bool tio_index::save(const std::string &path, const tio_reader &input,
+                     const tio_converter &conv)
+{
+  std::string tmp_path = path + ".tmp";
+  FILE *fp = fopen(tmp_path.c_str(), "wb");
+  if (!fp)
+    return false;
+
+  tio_index_header hdr;
+  memcpy(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic));
+  hdr.file_size = input.st.st_size;
+  hdr.file_mtime = input.st.st_mtime;
+  hdr.n_metadata = conv.metadata.size();
+  hdr.n_streams = n_streams;
+  hdr.n_checkpoints = n_checkpoints();
+  bool ok = (fwrite(&hdr, sizeof(hdr), 1, fp) == 1);
+  for (auto &m: conv.metadata) {
+    uint64_t offset = m.first;
+    tl_packet pkt = m.second;
+    ok = ok && (fwrite(&offset, sizeof(offset), 1, fp) == 1) &&
+      (fwrite(&pkt, tl_packet_total_size(&pkt.hdr), 1, fp) == 1);
+  }
+  ok = ok &&
+    (fwrite(first_sample.data(), sizeof(uint64_t), n_streams, fp) ==
+     n_streams) &&
+    (fwrite(stream_end.data(), sizeof(uint64_t), n_streams, fp) ==
+     n_streams) &&
+    (fwrite(checkpoints.data(), sizeof(uint64_t), checkpoints.size(), fp) ==
+     checkpoints.size());
+  ok = (fclose(fp) == 0) && ok;
+
+  if (ok && (rename(tmp_path.c_str(), path.c_str()) == 0))
+    return true;
+  unlink(tmp_path.c_str());
+  return false;
+}
+
+// Process metadata to create structures about how to parse data
+void tio_converter::setup()
+{
+  for (auto nit = nodes.begin(); nit != nodes.end(); ++nit) {
+    auto &tn = nit->second;
+    std::string addr_prefix = tn.path;
+
+    for (auto sit = tn.streams.begin(); sit != tn.streams.end(); ++sit) {
+      auto stream_id = sit->first;
+      auto &stream = sit->second;
+      stream.name = addr_prefix + std::to_string(stream_id);
+
+      // determine parameters using to convert sample number to sample time
+      auto tbit = tn.timebases.find(stream.info.timebase_id);
+      if (tbit == tn.timebases.end()) {
+        if (!quiet)
+          printf("Cannot find metadata for Timebase %d, ignoring stream %s\n",
+                 stream.info.timebase_id, stream.name.c_str());
+        continue;
       }
       stream.sps =
         1000000ull * tbit->second.period_denom_us / tbit->second.period_num_us;
@@ -337,8 +1735,9 @@ int main(int argc, char *argv[])
         if (tbit->second.epoch == TL_TIMEBASE_EPOCH_UNIX)
           tbid = "unix";
         else {
-          printf("Global timebase implemented only for unix time, ignoring "
-                 "stream %s%d\n", addr_prefix.c_str(), stream_id);
+          if (!quiet)
+            printf("Global timebase implemented only for unix time, "
+                   "ignoring stream %s\n", stream.name.c_str());
           continue;
         }
       } else {
@@ -356,8 +1755,9 @@ int main(int argc, char *argv[])
       for (const auto &comp: stream.components) {
         auto it = tn.sources.find(comp.source_id);
         if (it == tn.sources.end()) {
-          printf("Cannot find metadata for Source %d, ignoring stream %s%d\n",
-                 comp.source_id, addr_prefix.c_str(), stream_id);
+          if (!quiet)
+            printf("Cannot find metadata for Source %d, ignoring stream %s\n",
+                   comp.source_id, stream.name.c_str());
           skip = true;
           break;
         }
@@ -381,7 +1781,7 @@ int main(int argc, char *argv[])
           std::string units_str = "";
           if (!units.empty())
             units_str = units[0];
-          colvec.push_back(column(addr_prefix + name, desc + ", " + units_str,
+          colvec.push_back(column(addr_prefix + name, desc, units_str,
                                   si.type, comp.period));
         } else {
           for (size_t i = 0; i < si.channels; i++) {
@@ -391,159 +1791,842 @@ int main(int argc, char *argv[])
             else if (!units.empty())
               units_str = units[0];
             colvec.push_back(column(addr_prefix + name + "." + channel_names[i],
-                                    desc + ", " + units_str,
-                                    si.type, comp.period));
+                                    desc, units_str, si.type, comp.period));
           }
         }
       }
       if (skip)
         continue;
 
+      stream.columns = colvec;
+      if (!stream.compile_runs()) {
+        if (!quiet)
+          printf("Unsupported data type, ignoring stream %s\n",
+                 stream.name.c_str());
+        continue;
+      }
+
       tio_row_merger &merger = mergers[tbid];
+      if (!merger.streams.empty()) {
+        const tio_stream *prev = merger.streams.back();
+        stream.first_column = prev->first_column + prev->columns.size();
+      }
       merger.streams.push_back(&stream);
       stream.merger = &merger;
-      stream.columns = colvec;
+      stream.window.init(stream.runs,
+                         size_t(std::ceil(delta_t * stream.sps)) + 2);
       stream.is_good = true;
+      stream.index = streams.size();
+      streams.push_back(&stream);
     }
   }
 
-  // Generate all the tsv file names, open the files and write out headers.
-  {
-    std::string base_output_path = argv[1];
-    size_t last_dot = base_output_path.find_last_of(".");
-    if (last_dot != std::string::npos) {
-      std::string ext =
-        base_output_path.substr(last_dot, base_output_path.length()-last_dot);
-      if (ext == ".tio")
-        base_output_path.resize(last_dot+1);
+  size_t index = 0;
+  for (auto &kv: mergers)
+    kv.second.index = index++;
+}
+
+// Set up from the metadata read by another converter
+void tio_converter::replay(const tio_converter &conv)
+{
+  quiet = true;
+  for (auto &m: conv.metadata) {
+    tl_packet pkt = m.second;
+    add_metadata(&pkt, m.first);
+  }
+  scan_end = conv.scan_end;
+  setup();
+}
+
+// Generate all the output file names, open the files and write out
+// headers. The files for a part of the output get the suffix 'part'.
+bool tio_converter::open_outputs(const std::string &base_path,
+                                 const std::string &part)
+{
+  size_t index = 0;
+  for (auto it = mergers.begin(); it != mergers.end(); ++it) {
+    const std::string &tbid = it->first;
+    tio_row_merger &merger = it->second;
+
+    std::string output_path = base_path;
+    if (tbid == "unix") {
+      output_path += tbid;
+    } else {
+      char fmtbuf[32];
+      snprintf(fmtbuf, sizeof(fmtbuf), "%zd", ++index);
+      output_path += fmtbuf;
     }
 
-    size_t index = 0;
-    for (auto it = mergers.begin(); it != mergers.end(); ++it) {
-      const std::string &tbid = it->first;
-      tio_row_merger &merger = it->second;
+    bool ok;
+    if (output_format == OUTPUT_NPY) {
+      ok = merger.npy.open(output_path, tbid, merger.streams, part);
+    } else {
+      output_path += ".tsv" + part;
+      ok = merger.tsv.open(output_path, merger.streams, part.empty());
+    }
 
-      std::string output_path = base_output_path;
-      if (tbid == "unix") {
-        output_path += tbid;
-      } else {
-        char fmtbuf[32];
-        snprintf(fmtbuf, sizeof(fmtbuf), "%zd", ++index);
-        output_path += fmtbuf;
+    if (!ok) {
+      printf("Failed to open output file: %s\n", output_path.c_str());
+      return false;
+    }
+  }
+  return true;
+}
+
+// Append the closed output of a converter with the same setup
+bool tio_converter::append_outputs(tio_converter &part)
+{
+  bool ok = true;
+  auto pit = part.mergers.begin();
+  for (auto &kv: mergers) {
+    tio_row_merger &merger = kv.second;
+    if (output_format == OUTPUT_NPY)
+      ok = merger.npy.append_part(pit->second.npy) && ok;
+    else
+      ok = merger.tsv.append_part(pit->second.tsv) && ok;
+    ++pit;
+  }
+  return ok;
+}
+
+bool tio_converter::sync_outputs()
+{
+  bool ok = true;
+  for (auto &kv: mergers) {
+    tio_row_merger &merger = kv.second;
+    if (output_format == OUTPUT_NPY)
+      ok = merger.npy.sync() && ok;
+    else
+      merger.tsv.sync();
+  }
+  return ok;
+}
+
+bool tio_converter::close_outputs()
+{
+  for (auto &kv: mergers) {
+    tio_row_merger &merger = kv.second;
+    if (output_format == OUTPUT_NPY) {
+      if (!merger.npy.close()) {
+        printf("Failed to write output in %s\n", merger.npy.dir.c_str());
+        return false;
+      }
+    } else {
+      merger.tsv.close();
+    }
+  }
+  return true;
+}
+
+// Get the stream of a data packet, or nullptr if it is not output. When the
+// packet's input offset is given, data read while scanning for metadata is
+// ignored like when it's not queued.
+tio_stream *tio_converter::find_stream(tl_packet *pkt, size_t offset)
+{
+  int stream_id = tl_packet_stream_id(&pkt->hdr);
+  if (stream_id < 0)
+    return nullptr;
+
+  tio_node *tn = get_node(pkt);
+  auto it = tn->streams.find(stream_id);
+  if (it == tn->streams.end()) {
+    if (offset < scan_end)
+      return nullptr;
+    tn->streams[stream_id].is_good = false;
+    if (!quiet)
+      printf("Cannot find metadata, ignoring stream %s%d\n",
+             tn->path.c_str(), stream_id);
+    return nullptr;
+  }
+
+  tio_stream &stream = it->second;
+  if (!stream.is_good || (pkt->hdr.payload_size < sizeof(uint32_t)) ||
+      (offset < stream.valid_from))
+    return nullptr;
+  return &stream;
+}
+
+// A packet that is not 'kept' until the end of the conversion has its data
+// copied if it is handed to a worker.
+void tio_converter::process(tl_packet *pkt, size_t offset, bool kept)
+{
+  tio_stream *stream = find_stream(pkt, offset);
+  if (!stream)
+    return;
+
+  // Identify the sample number. The packet may be unaligned.
+  uint32_t start_sample;
+  memcpy(&start_sample, pkt->payload, sizeof(start_sample));
+  uint64_t sample = stream->unwrap(start_sample);
+  const uint8_t *data = pkt->payload + sizeof(start_sample);
+  size_t size = pkt->hdr.payload_size - sizeof(start_sample);
+  if (index)
+    index->add_sample(stream->index, sample,
+                      offset + tl_packet_total_size(&pkt->hdr));
+
+  tio_row_merger &merger = *stream->merger;
+  if (!merger.queue) {
+    merger.add_sample(*stream, sample, data, size);
+    return;
+  }
+  queued_sample &qs = merger.queue->claim();
+  qs.stream = stream;
+  qs.sample = sample;
+  qs.size = size;
+  if (copy_data || !kept) {
+    memcpy(qs.copy, data, size);
+    qs.data = qs.copy;
+  } else {
+    qs.data = data;
+  }
+  merger.queue->push();
+}
+
+// Give each row merger a thread. When packets are not valid until the end
+// of the conversion, their data is copied into the queues.
+void tio_converter::start_workers(bool copy)
+{
+  copy_data = copy;
+  for (auto &kv: mergers)
+    kv.second.start_worker();
+}
+
+// Finish writing out all the rows
+void tio_converter::finish()
+{
+  for (auto &kv: mergers) {
+    if (kv.second.queue)
+      kv.second.stop_worker();
+    else
+      kv.second.flush();
+    if (kv.second.n_late)
+      printf("Ignored %zu samples for timebase %s that arrived after their "
+             "row was written\n", kv.second.n_late, kv.first.c_str());
+  }
+}
+
+#define MIN_SEGMENT_SIZE (16 << 20)
+
+// A segment of the input, with the state of the conversion at its start
+struct tio_segment {
+  size_t begin;
+  size_t end;   // past the start of the next segment, to complete its rows
+  std::vector<uint64_t> sample_numbers; // latest of each stream
+  std::vector<double> times; // of each merger, output if after these
+};
+
+// Split a mapped input into up to n segments of about the same size, with a
+// pass over the packet headers using a converter that was set up. The
+// converter's index, if any, is recorded.
+//
+// A row merger's samples are output by the segment that starts before them,
+// so the time boundary with the previous segment starts from the latest
+// time of the samples before the segment. It is moved forward to a gap
+// between samples that is larger than epsilon, so that no row is split, and
+// the previous segment continues until past delta_t of the boundary, as
+// samples are reordered at most that much.
+std::vector<tio_segment> split_input(const tio_reader &input,
+                                     tio_converter &conv, size_t n)
+{
+  std::vector<tio_segment> segments;
+  size_t n_mergers = conv.mergers.size();
+  std::vector<double> latest(n_mergers, -INFINITY);
+  std::vector<size_t> last_end(n_mergers, 0);
+
+  // Segment boundaries whose times are not settled yet, with the sample
+  // times of each merger that can move them.
+  struct boundary {
+    size_t segment;
+    size_t n_pending;
+    std::vector<bool> pending;
+    std::vector<std::vector<double>> times;
+  };
+  std::deque<boundary> boundaries;
+  auto settle = [&](boundary &b, size_t m, size_t end) {
+    double &t_boundary = segments[b.segment].times[m];
+    std::vector<double> &times = b.times[m];
+    std::sort(times.begin(), times.end());
+    for (double t: times) {
+      if (t > t_boundary + epsilon)
+        break;
+      t_boundary = std::max(t_boundary, t);
+    }
+    times = std::vector<double>();
+    size_t &prev_end = segments[b.segment - 1].end;
+    prev_end = std::max(prev_end, end);
+    b.pending[m] = false;
+    b.n_pending--;
+  };
+
+  tio_reader reader(input, 0, input.map_size);
+  for (;;) {
+    size_t offset = reader.offset;
+    if ((segments.size() < n) &&
+        (offset >= (segments.size() * input.map_size / n))) {
+      tio_segment seg;
+      seg.begin = seg.end = offset;
+      for (tio_stream *stream: conv.streams)
+        seg.sample_numbers.push_back(stream->info.sample_number);
+      seg.times = latest;
+      if (!segments.empty())
+        segments.back().end = offset;
+      segments.push_back(seg);
+
+      boundary b;
+      b.segment = segments.size() - 1;
+      b.n_pending = 0;
+      b.pending.resize(n_mergers);
+      b.times.resize(n_mergers);
+      for (size_t m = 0; m < n_mergers; m++) {
+        b.pending[m] = (b.segment != 0) && std::isfinite(latest[m]);
+        b.n_pending += b.pending[m];
       }
-      output_path += ".tsv";
+      if (b.n_pending)
+        boundaries.push_back(std::move(b));
+    }
+
+    if (conv.index)
+      conv.index->reached(offset);
+    tl_packet *pkt = reader.next();
+    if (!pkt)
+      break;
+    tio_stream *stream = conv.find_stream(pkt, offset);
+    if (!stream)
+      continue;
+
+    uint32_t start_sample;
+    memcpy(&start_sample, pkt->payload, sizeof(start_sample));
+    uint64_t sample = stream->unwrap(start_sample);
+    if (conv.index)
+      conv.index->add_sample(stream->index, sample, reader.offset);
+    double t = stream->time(sample);
+    size_t m = stream->merger->index;
+    latest[m] = std::max(latest[m], t);
+    last_end[m] = reader.offset;
+
+    for (boundary &b: boundaries) {
+      if (!b.pending[m])
+        continue;
+      double t_boundary = segments[b.segment].times[m];
+      if (t <= t_boundary + delta_t)
+        b.times[m].push_back(t);
+      else if (t > t_boundary + 2 * delta_t)
+        settle(b, m, reader.offset);
+    }
+    while (!boundaries.empty() && (boundaries.front().n_pending == 0))
+      boundaries.pop_front();
+  }
 
-      merger.fp = fopen(output_path.c_str(), "w");
+  // Samples up to the end are needed for boundaries not settled yet
+  for (boundary &b: boundaries)
+    for (size_t m = 0; m < n_mergers; m++)
+      if (b.pending[m])
+        settle(b, m, last_end[m]);
+  segments.back().end = reader.offset;
+  if (conv.index)
+    conv.index->finish(reader.offset);
+
+  // A boundary moved past the next one leaves a segment without rows
+  for (size_t i = 1; i < segments.size(); i++)
+    for (size_t m = 0; m < n_mergers; m++)
+      segments[i].times[m] =
+        std::max(segments[i].times[m], segments[i - 1].times[m]);
+
+  return segments;
+}
 
-      if (!merger.fp) {
-        printf("Failed to open output file: %s\n", output_path.c_str());
-        exit(1);
+// Convert the segments concurrently, each one to its own part of the
+// output files, and append the parts in order to the first one.
+bool convert_segments(const tio_reader &input, const tio_converter &setup,
+                      const std::vector<tio_segment> &segments,
+                      const std::string &base_path)
+{
+  size_t n = segments.size();
+  std::vector<tio_converter> convs(n);
+  for (size_t i = 0; i < n; i++) {
+    convs[i].replay(setup);
+    std::string part = i ? ".part" + std::to_string(i) : "";
+    if (!convs[i].open_outputs(base_path, part))
+      return false;
+  }
+
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < n; i++) {
+    threads.emplace_back([&, i]() {
+      tio_converter &conv = convs[i];
+      const tio_segment &seg = segments[i];
+      for (tio_stream *stream: conv.streams)
+        stream->info.sample_number = seg.sample_numbers[stream->index];
+      for (auto &kv: conv.mergers) {
+        tio_row_merger &merger = kv.second;
+        merger.t_begin = seg.times[merger.index];
+        if (i + 1 < n)
+          merger.t_end = segments[i + 1].times[merger.index];
       }
 
-      // Generate header. 2 lines: address+name, description+units
-      std::vector<std::string> names, descs;
-      names.push_back("t");
-      descs.push_back("Time, s");
-      for (const tio_stream *stream_ptr: merger.streams) {
-        for (const column &c: stream_ptr->columns) {
-          names.push_back(c.name);
-          descs.push_back(c.desc);
-        }
+      tio_reader reader(input, seg.begin, seg.end);
+      for (;;) {
+        size_t offset = reader.offset;
+        tl_packet *pkt = reader.next();
+        if (!pkt)
+          break;
+        conv.process(pkt, offset);
       }
-      // Write first header line
-      fprintf(merger.fp, "%s\n", tabjoin(names).c_str());
-      // Write second header line with descriptions and units
-      // Some tools expect just one line to label the data, so this is disabled:
-      // fprintf(merger.fp, "%s\n", tabjoin(descs).c_str());
+      conv.finish();
+      if (i != 0)
+        conv.close_outputs();
+    });
+  }
+  for (std::thread &t: threads)
+    t.join();
+
+  bool ok = true;
+  for (size_t i = 1; i < n; i++)
+    ok = convs[0].append_outputs(convs[i]) && ok;
+  if (!ok)
+    printf("Failed to append output parts\n");
+  return convs[0].close_outputs() && ok;
+}
+
+#define SEARCH_GRANULARITY (64 << 10)
+
+// Find the part of a mapped input to convert for the rows from 'from' to
+// 'to', with the sample numbers of the streams at its start, using the
+// checkpoints of the index. For each timebase with samples in the range,
+// it starts at the last checkpoint before which no sample is after
+// t_begin, and ends at the first checkpoint after which all of its streams
+// either have no more packets or are past t_end by delta_t.
+tio_segment seek_index(const tio_index &index, const tio_converter &conv,
+                       double from, double to)
+{
+  tio_segment seg;
+  seg.begin = SIZE_MAX;
+  seg.end = 0;
+  size_t n = index.n_checkpoints();
+  size_t k_first = n - 1;
+  const uint64_t *last = index.checkpoint(n - 1) + 1;
+
+  for (auto &kv: conv.mergers) {
+    const tio_row_merger &merger = kv.second;
+    double t_begin = from - delta_t;
+    double t_end = to + delta_t;
+
+    double first_time = INFINITY;
+    double last_time = -INFINITY;
+    for (const tio_stream *stream: merger.streams) {
+      if (index.first_sample[stream->index] == NO_SAMPLE)
+        continue;
+      first_time = std::min(first_time,
+                            stream->time(index.first_sample[stream->index]));
+      last_time = std::max(last_time, stream->time(last[stream->index]));
     }
+    if ((last_time <= t_begin) || (first_time > t_end))
+      continue;
+
+    auto before = [&](size_t k) {
+      const uint64_t *max_sample = index.checkpoint(k) + 1;
+      for (const tio_stream *stream: merger.streams) {
+        uint64_t sample = max_sample[stream->index];
+        if ((sample != NO_SAMPLE) && (stream->time(sample) > t_begin))
+          return false;
+      }
+      return true;
+    };
+    auto after = [&](size_t k) {
+      uint64_t offset = index.checkpoint(k)[0];
+      const uint64_t *max_sample = index.checkpoint(k) + 1;
+      for (const tio_stream *stream: merger.streams) {
+        uint64_t sample = max_sample[stream->index];
+        if ((index.stream_end[stream->index] > offset) &&
+            ((sample == NO_SAMPLE) ||
+             ((stream->time(sample) - delta_t) <= t_end)))
+          return false;
+      }
+      return true;
+    };
+
+    // Both are monotonic, and the first checkpoint is before any sample
+    size_t lo = 0, hi = n;
+    while ((hi - lo) > 1) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (before(mid))
+        lo = mid;
+      else
+        hi = mid;
+    }
+    size_t k_begin = lo;
+    lo = k_begin;
+    hi = n - 1;
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (after(mid))
+        hi = mid;
+      else
+        lo = mid + 1;
+    }
+
+    k_first = std::min(k_first, k_begin);
+    seg.begin = std::min<size_t>(seg.begin, index.checkpoint(k_begin)[0]);
+    seg.end = std::max<size_t>(seg.end, index.checkpoint(lo)[0]);
   }
 
-  // Process all the samples
+  if (seg.begin > seg.end)
+    seg.begin = seg.end;
+  const uint64_t *max_sample = index.checkpoint(k_first) + 1;
+  for (const tio_stream *stream: conv.streams) {
+    uint64_t sample = max_sample[stream->index];
+    seg.sample_numbers.push_back((sample != NO_SAMPLE) ? sample :
+                                 stream->info.sample_number);
+  }
+  return seg;
+}
+
+// Time of the first sample of a row merger after 'after', in the packets
+// of a mapped input from the first one at or after 'offset' up to 'end'.
+// 'offset' is set to where the packet is, and NAN is returned if there is
+// none. Sample numbers are taken as the nearest to the ones in the
+// metadata.
+static double probe(const tio_reader &input, tio_converter &conv,
+                    const tio_row_merger &merger, size_t &offset,
+                    size_t end, double after = -INFINITY)
+{
+  tio_reader reader(input, input.resync(offset), end);
+  reader.quiet = true;
   for (;;) {
-    // Get the next sample, either from queue or from the input file.
-    tl_data_stream_packet dsp;
-    tl_packet *pkt = (tl_packet*)&dsp;
-    if (queued_data.empty()) {
-      if (tlrecv(fd, &dsp, sizeof(dsp)) != 0)
-        break;
-      if (tl_packet_stream_id(&pkt->hdr) < 0)
-        continue;
-    } else {
-      dsp = queued_data.front();
-      queued_data.pop_front();
+    offset = reader.offset;
+    tl_packet *pkt = reader.next();
+    if (!pkt)
+      return NAN;
+    tio_stream *stream = conv.find_stream(pkt, offset);
+    if (!stream || (stream->merger != &merger))
+      continue;
+    uint32_t start_sample;
+    memcpy(&start_sample, pkt->payload, sizeof(start_sample));
+    double t = stream->time(stream->nearest_sample(start_sample));
+    if (t > after)
+      return t;
+  }
+}
+
+// Without an index, find the part of a mapped input to convert for the
+// rows from 'from' to 'to' with binary searches over the file. Like the
+// row mergers, this relies on the samples of a timebase being out of order
+// by less than delta_t: the part of a timebase starts where the next
+// sample is before t_begin by delta_t, and ends where the next sample is
+// after t_end by delta_t. The streams start from the sample numbers of the
+// metadata, so this works for ranges within 2^31 samples of them.
+tio_segment seek_search(const tio_reader &input, tio_converter &conv,
+                        double from, double to)
+{
+  tio_segment seg;
+  seg.begin = SIZE_MAX;
+  seg.end = 0;
+  size_t size = input.map_size;
+  bool quiet = conv.quiet;
+  conv.quiet = true;
+
+  for (auto &kv: conv.mergers) {
+    const tio_row_merger &merger = kv.second;
+    double t_begin = from - delta_t;
+    double t_end = to + delta_t;
+    size_t offset;
+
+    size_t lo = 0, hi = size;
+    while ((hi - lo) > SEARCH_GRANULARITY) {
+      size_t mid = lo + (hi - lo) / 2;
+      offset = mid;
+      if (probe(input, conv, merger, offset, size) <= (t_begin - delta_t))
+        lo = mid;
+      else
+        hi = mid;
     }
+    size_t begin = input.resync(lo);
 
-    // Get the corresponding stream
-    tio_node *tn = get_node((tl_packet*)&dsp);
-    auto it = tn->streams.find(tl_packet_stream_id(&pkt->hdr));
-    if (it == tn->streams.end()) {
-      uint8_t stream_id = tl_packet_stream_id(&pkt->hdr);
-      tn->streams[stream_id].is_good = false;
-      printf("Cannot find metadata, ignoring stream %s%d\n",
-             tn->path.c_str(), stream_id);
+    auto past_end = [&](size_t pos) {
+      double t = probe(input, conv, merger, pos, size);
+      return !((t - delta_t) <= t_end);
+    };
+    if (past_end(begin))
       continue;
+    lo = begin;
+    hi = size;
+    while ((hi - lo) > SEARCH_GRANULARITY) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (past_end(mid))
+        hi = mid;
+      else
+        lo = mid;
     }
+    size_t end = input.resync(hi);
 
-    tio_stream &stream = it->second;
-    if (!stream.is_good)
+    // The timebase may end before the range
+    offset = begin;
+    if (std::isnan(probe(input, conv, merger, offset, end, t_begin)))
       continue;
 
-    // Identify the sample number and time
-
-    // Determine full 64 bit sample number.
-    uint64_t sample =
-      ((stream.info.sample_number >> 32)<<32) | dsp.start_sample;
-    uint64_t sample_next =
-      (((stream.info.sample_number >> 32)+1)<<32) | dsp.start_sample;
-    int64_t d1 = sample - stream.info.sample_number;
-    int64_t d2 = sample_next - stream.info.sample_number;
-    if (std::abs(d1) > std::abs(d2))
-      sample = sample_next;
-
-    // Update latest sample number in metadata.
-    stream.info.sample_number = sample;
-
-    // Calculate sample time
-    uint64_t secs = sample / stream.sps;
-    double t =
-      (sample - secs * stream.sps) * stream.sample_time +
-      secs + stream.start_time;
-
-    // Format sample and push it to the stream's map.
-    std::vector<std::string> &sample_data = stream.samples[t];
-    if (!sample_data.empty()) {
-      printf("Duplicate sample at time %.6f for stream %s%d, keeping latest\n",
-             t, tn->path.c_str(), it->first);
-      sample_data.clear();
-    }
-    uint8_t *dataptr = dsp.data;
-    for (column &c: stream.columns) {
-      if ((sample % c.period) != 0) {
-        sample_data.push_back("");
+    seg.begin = std::min(seg.begin, begin);
+    seg.end = std::max(seg.end, end);
+  }
+
+  conv.quiet = quiet;
+  if (seg.begin > seg.end)
+    seg.begin = seg.end;
+  for (const tio_stream *stream: conv.streams)
+    seg.sample_numbers.push_back(stream->info.sample_number);
+  return seg;
+}
+
+void usage(const char *bin)
+{
+  fprintf(stderr, "\n    Usage: %s [-s] [-o tsv|npy] [-j threads] [-n] "
+          "[-w window] [-e epsilon] [-a]\n"
+          "           [--from t] [--to t] [--follow] "
+          "<path to .tio file or tcp:// URL>\n\n", bin);
+  fprintf(stderr,
+          "  This program will generate one TSV file for each timebase\n"
+          "  present in the original data. For 'abcd.tio' with a local\n"
+          "  and an absolute timebase, it will create:\n"
+          "      - abcd.unix.tsv (data with absolute time)\n"
+          "      - abcd.1.tsv (data with local time)\n\n");
+  fprintf(stderr,
+          "  -s      write floating point values with the shortest text\n"
+          "          that reads back exactly, instead of six fixed decimals\n"
+          "  -o npy  instead of TSV files, create a directory for each\n"
+          "          timebase (abcd.unix/, abcd.1/) with a .npy file per\n"
+          "          column and table.json describing them\n"
+          "  -j N    convert using N threads\n"
+          "  -n      do not use or create abcd.tioidx, the index of the\n"
+          "          metadata and of where samples are in the file\n"
+          "  -w T    samples are out of order by less than T seconds,\n"
+          "          and rows are written out T seconds after their time\n"
+          "          (default 5)\n"
+          "  -e T    samples less than T seconds apart are in the same row\n"
+          "          (default 1e-5)\n"
+          "  -a      start with a short reorder window, growing it up to\n"
+          "          the -w window as late samples are seen. Samples that\n"
+          "          arrive after their row was written out are ignored\n"
+          "  --from t, --to t\n"
+          "          only output the rows with time from t and up to t,\n"
+          "          in seconds in the time of each table. Only the part\n"
+          "          of the file with them is read, found with the index\n"
+          "          created by a previous conversion or with a search\n"
+          "  --follow\n"
+          "          keep converting the packets appended to the file, or\n"
+          "          received from the URL, until interrupted. The rows\n"
+          "          written are flushed every second. -j is ignored\n\n");
+}
+
+static void stop_following(int)
+{
+  follow_stop = 1;
+}
+
+// Parse a --from or --to time
+static bool parse_time(const char *str, double &t)
+{
+  char *end;
+  t = strtod(str, &end);
+  return (end != str) && (*end == '\0') && !std::isnan(t);
+}
+
+int main(int argc, char *argv[])
+{
+  size_t threads = 1;
+  bool use_index = true;
+  double from = -INFINITY;
+  double to = INFINITY;
+  bool follow = false;
+
+  static const struct option long_options[] = {
+    { "from",   required_argument, nullptr, 'F' },
+    { "to",     required_argument, nullptr, 'T' },
+    { "follow", no_argument,       nullptr, 'f' },
+    { nullptr, 0, nullptr, 0 }
+  };
+  for (int opt = -1;
+       (opt = getopt_long(argc, argv, "so:j:nw:e:a", long_options,
+                          nullptr)) != -1; ) {
+    if (opt == 's') {
+      shortest_floats = true;
+    } else if (opt == 'o') {
+      if (strcmp(optarg, "tsv") == 0) {
+        output_format = OUTPUT_TSV;
+      } else if (strcmp(optarg, "npy") == 0) {
+        output_format = OUTPUT_NPY;
       } else {
-        sample_data.push_back(c.parser(&dataptr));
+        fprintf(stderr, "Unsupported output format: %s\n", optarg);
+        return 1;
       }
+    } else if (opt == 'j') {
+      char *end;
+      threads = strtoul(optarg, &end, 0);
+      if ((*end != '\0') || (threads == 0)) {
+        fprintf(stderr, "Invalid number of threads: %s\n", optarg);
+        return 1;
+      }
+    } else if (opt == 'n') {
+      use_index = false;
+    } else if ((opt == 'w') || (opt == 'e')) {
+      double &t = (opt == 'w') ? delta_t : epsilon;
+      if (!parse_time(optarg, t) || !std::isfinite(t) || (t < 0) ||
+          ((opt == 'w') && (t == 0))) {
+        fprintf(stderr, "Invalid time: %s\n", optarg);
+        return 1;
+      }
+    } else if (opt == 'a') {
+      adaptive_window = true;
+    } else if (opt == 'f') {
+      follow = true;
+      threads = 1;
+    } else if ((opt == 'F') || (opt == 'T')) {
+      if (!parse_time(optarg, (opt == 'F') ? from : to)) {
+        fprintf(stderr, "Invalid time: %s\n", optarg);
+        return 1;
+      }
+    } else {
+      usage(argv[0]);
+      return 1;
     }
+  }
 
-    // Update row merger's earliest sample time if needed
-    if (!std::isfinite(stream.merger->first_time) ||
-        (t < stream.merger->first_time))
-      stream.merger->first_time = t;
+  if (optind != (argc - 1)) {
+    usage(argv[0]);
+    return 1;
+  }
+  const char *input_path = argv[optind];
+  bool range = std::isfinite(from) || std::isfinite(to);
 
-    // Output the next row as long as the current sample time exceeds the
-    // earliest sample time by at least DELTA_T.
-    tio_row_merger &merger = *stream.merger;
-    while (t > (merger.first_time + DELTA_T))
-      merger.write_next_row();
+  if (follow) {
+    // End cleanly, with all the rows written out
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_following;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
   }
 
-  // Finish writing out all the rows and close the files cleanly.
-  for (auto kv: mergers) {
-    tio_row_merger &merger = kv.second;
-    while (std::isfinite(merger.first_time))
-      merger.write_next_row();
-    fclose(merger.fp);
+  tio_reader reader;
+  if (!reader.open(input_path, follow)) {
+    fprintf(stderr, "Failed to open %s: %s\n", input_path, strerror(errno));
+    return 1;
+  }
+
+  std::string base_output_path = input_path;
+  size_t last_dot = base_output_path.find_last_of(".");
+  const char *url_path = strstr(input_path, "://");
+  if (url_path) {
+    // Name the output after the host and path of a URL
+    base_output_path.clear();
+    for (const char *p = url_path + 3; *p; p++)
+      base_output_path += (isalnum(*p) || (*p == '.') || (*p == '-')) ?
+        *p : '_';
+    base_output_path += '.';
+  } else if (last_dot != std::string::npos) {
+    std::string ext =
+      base_output_path.substr(last_dot, base_output_path.length()-last_dot);
+    if (ext == ".tio")
+      base_output_path.resize(last_dot+1);
+  }
+  std::string index_path = input_path;
+  index_path += (base_output_path != input_path) ? "idx" : ".tioidx";
+
+  tio_converter conv;
+  tio_index index;
+  bool indexed = false;
+  std::deque<tl_packet*> queued_data;
+
+  if (reader.map) {
+    // Get all the metadata, from the index when it's up to date. Without
+    // it, a range is converted with the metadata found at the start.
+    indexed = use_index && index.load(index_path, reader, conv);
+    if (!indexed && range) {
+      tio_reader head(reader, 0, reader.map_size);
+      head.quiet = true;
+      conv.scan_metadata(head, nullptr);
+    } else if (!indexed) {
+      conv.scan_all_metadata(reader);
+    }
+  } else {
+    // Read in the metadata, and put the samples read in the meantime in
+    // queued_data.
+    conv.scan_metadata(reader, &queued_data);
+  }
+  conv.setup();
+  indexed = indexed && (index.n_streams == conv.streams.size()) &&
+    (index.n_checkpoints() > 0);
+
+  // A full conversion of a mapped input records the index
+  if (reader.map && use_index && !indexed && !range) {
+    index.start(conv);
+    conv.index = &index;
   }
 
-  return 0;
+  // Large mapped files are converted in segments
+  size_t n_segments = 1;
+  if (reader.map && !range)
+    n_segments = std::min(threads, reader.map_size / MIN_SEGMENT_SIZE);
+  if (n_segments > 1) {
+    std::vector<tio_segment> segments =
+      split_input(reader, conv, n_segments);
+    if (conv.index)
+      index.save(index_path, reader, conv);
+    return convert_segments(reader, conv, segments, base_output_path) ? 0 : 1;
+  }
+
+  // For a range, only read the part of a mapped input with it
+  tio_reader *input = &reader;
+  std::unique_ptr<tio_reader> part;
+  if (range) {
+    for (auto &kv: conv.mergers)
+      kv.second.set_range(from, to);
+  }
+  if (range && reader.map) {
+    tio_segment seg = indexed ? seek_index(index, conv, from, to) :
+      seek_search(reader, conv, from, to);
+    for (tio_stream *stream: conv.streams)
+      stream->info.sample_number = seg.sample_numbers[stream->index];
+    part.reset(new tio_reader(reader, seg.begin, seg.end));
+    input = part.get();
+  }
+
+  if (!conv.open_outputs(base_output_path, ""))
+    return 1;
+  if (threads > 1)
+    conv.start_workers(reader.map == nullptr);
+
+  // Process all the samples
+  double next_sync = monotonic_time() + FOLLOW_SYNC;
+  for (;;) {
+    // Get the next sample, either from queue or from the input file.
+    tl_packet *pkt;
+    size_t offset = SIZE_MAX;
+    if (queued_data.empty()) {
+      input->release_all();
+      offset = input->offset;
+      if (conv.index)
+        index.reached(offset);
+      pkt = input->next();
+      if (!pkt && !input->waiting)
+        break;
+    } else {
+      pkt = queued_data.front();
+      queued_data.pop_front();
+    }
+    if (pkt)
+      conv.process(pkt, offset, input->in_place(pkt));
+
+    // Make the rows written out so far available regularly
+    if (follow && (monotonic_time() >= next_sync)) {
+      conv.sync_outputs();
+      next_sync = monotonic_time() + FOLLOW_SYNC;
+    }
+  }
+  if (conv.index) {
+    index.finish(input->offset);
+    index.save(index_path, reader, conv);
+  }
+
+  // Finish writing out all the rows and close the files cleanly.
+  conv.finish();
+  return conv.close_outputs() ? 0 : 1;
 }
@@ -1,25 +1,45 @@
 // Copyright: 2016-2021 Twinleaf LLC
 // License: MIT
 
+#if defined(__linux__)
+#define _GNU_SOURCE // for pinning threads to CPUs
+#endif
+
 #include <tio/io.h>
 #include <tio/packet.h>
 #include <tio/log.h>
 #include <tio/rpc.h>
+#include <tio/data.h>
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <errno.h>
 #include <time.h>
 
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <signal.h>
 #include <poll.h>
 #include <sysexits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+
+// The event loop uses epoll on Linux, ppoll elsewhere (or with -DUSE_PPOLL)
+#if defined(__linux__) && !defined(USE_PPOLL)
+#define EVENT_EPOLL 1
+#include <sys/epoll.h>
+#else
+#define EVENT_EPOLL 0
+#endif
 
 #ifndef WEBSOCKETS
 #define WEBSOCKETS 0
@@ -28,10 +48,22 @@
 #if WEBSOCKETS
 #include <openssl/sha.h>
 #include <openssl/evp.h>
+#include <zlib.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 // SIGPIPE is ignored anyway
 #endif
 
 #define MAX_CLIENTS_DEFAULT 64
-#define MAX_RPCS_DEFAULT 64
+#define MAX_RPCS_DEFAULT 1024
+#define MAX_ROUTE_RPCS_DEFAULT 16
+#define RPC_TIMEOUT_DEFAULT 5000 // ms
+#define CLIENT_QUEUE_DEFAULT 262144 // bytes
+#define DECIMATE_DEFAULT 10
+#define LAG_TIMEOUT_DEFAULT 5000 // ms
+#define HISTORY_SIZE_DEFAULT (64 << 20) // bytes, with only a time for -H
+#define FLUSH_SIZE_DEFAULT 65536 // bytes, with only a time for -F
 
 #if defined (__linux__)
 // For some reason, at least on some linux systems there is no declaration
@@ -93,36 +125,32 @@ size_t max_descriptors = 0;
 
 const char **sensor_url = NULL;
 int sensor_reconnect_timeout = 60;
+unsigned sensor_opens[256]; // times each sensor was reopened
 struct timespec last_reconnect_attempt;
 
 struct pollfd *poll_array = NULL;
 uint32_t *descriptor_flags = NULL;
 #define WEBSOCKET_PORT         1 // server flag: websocket port
+#define WORKER_PIPE            2 // server flag: wakeups from writer threads
+#define STATS_PORT             4 // server flag: statistics over HTTP
 #define WEBSOCKET_HANDSHAKE    1 // client flag: handshake hasn't happened yet
+#define CLIENT_WORKER          2 // client flag: handled by a writer thread
+#define STATS_CLIENT           4 // client flag: of the stats port
+
+const char *stats_port = NULL; // -S
 
 #if WEBSOCKETS
 const char *websock_port = EXPAND_AND_QUOTE(TL_WS_DEFAULT_PORT);
 #endif
 
-int disconnected_clients_flag = 0;
-
-struct rpc_remap {
-  struct rpc_remap *next, *prev;
-  struct rpc_remap *to_next, *to_prev;
-  time_t send_time;
-  int client_desc; // index of client in poll_array
-  uint16_t id;
-  uint16_t orig_id;
-  int routing_size; // keep routing to send out timeout messages
-  uint8_t routing[TL_PACKET_MAX_ROUTING_SIZE];
-};
-typedef struct rpc_remap rpc_remap;
-
-size_t max_rpcs_in_flight = MAX_RPCS_DEFAULT;
-rpc_remap *remap_array;
-rpc_remap *client_list;
-rpc_remap orphan_list;
-rpc_remap timeout_list; // circular list of timeouts
+// Client entries of poll_array are reused, rather than compacted, so that
+// their index stays valid for the backend and the RPC remapping. Entries
+// of clients disconnected while handling events are only made available
+// again on the next loop iteration, when no events are pending for them.
+size_t *free_slots = NULL;
+size_t n_free_slots = 0;
+size_t *closed_slots = NULL;
+size_t n_closed_slots = 0;
 
 int verbose = 0;
 const char *timefmt = "%F %T";
@@ -132,16 +160,31 @@ int usage(FILE *out, const char *program, const char *error)
 {
   if (error)
     fprintf(out, "%s\n", error);
-  fprintf(out, "Usage: %s [-p port] [-f] [-c max_clients] [-r max_rpc] [-v] "
-          "[-h [-i hub_id]] [-t timefmt] sensor_url [sensor_url ...]\n",
+  fprintf(out, "Usage: %s [-p port] [-f] [-c max_clients] [-r max_rpc] [-v]\n"
+          "  [-z level] [-S port] [-h [-i hub_id]] [-t timefmt] [-W threads] "
+          "[-I threads]\n"
+          "  [-b policy] [-q size] [-F ms[,size]] [-H history] [-L max_rpc]\n"
+          "  [-R [method=]ms] [-C method=ms] sensor_url [sensor_url ...]\n",
           program);
   fprintf(out, "  -p port   TCP listen port. default 7855\n");
   fprintf(out, "  -w port   WebSocket listen port. default 7853\n");
+  fprintf(out, "  -S port   HTTP port on localhost for statistics, in the "
+          "Prometheus text\n            format. default none\n");
+  fprintf(out, "  -z level  compress WebSocket messages at zlib level 1-9 "
+          "for clients that\n            offer permessage-deflate "
+          "(default 0, never)\n");
   fprintf(out, "  -f        client forward mode\n");
   fprintf(out, "  -c max    max simultaneous clients in shared mode, "
           "default %d\n", MAX_CLIENTS_DEFAULT);
   fprintf(out, "  -r max    max number of RPCs in flight in shared mode, "
           "default %d\n", MAX_RPCS_DEFAULT);
+  fprintf(out, "  -L max    max number of RPCs in flight to each device, "
+          "0 for no limit,\n            default %d\n",
+          MAX_ROUTE_RPCS_DEFAULT);
+  fprintf(out, "  -R ms     RPC timeout in ms, or method=ms for a method. "
+          "default %d\n", RPC_TIMEOUT_DEFAULT);
+  fprintf(out, "  -C method=ms  answer calls to method without argument "
+          "with the last\n            reply for ms\n");
   fprintf(out, "  -h        hub sensor mode\n");
   fprintf(out, "  -i id     id of the hub\n");
   fprintf(out, "  -v        verbose logging\n");
@@ -151,6 +194,31 @@ int usage(FILE *out, const char *program, const char *error)
   fprintf(out, "  -u        append microseconds to timestamp\n");
   fprintf(out, "  -T sec    seconds to auto-reconnect a sensor before "
           "exiting (default 60)\n");
+  fprintf(out, "  -W n      writer threads sending to clients (default 0, "
+          "send from the main thread)\n");
+  fprintf(out, "  -I n[,cpu] ingest threads reading the sensors, pinned to "
+          "CPUs cpu, cpu+1...\n            (default none, read from the "
+          "main thread)\n");
+  fprintf(out, "  -b policy for clients with more than the queue size "
+          "pending:\n");
+  fprintf(out, "            drop: drop the oldest data (default)\n");
+  fprintf(out, "            latest: drop all queued data but the latest\n");
+  fprintf(out, "            decimate[:N]: send every Nth queued sample "
+          "(default %d)\n", DECIMATE_DEFAULT);
+  fprintf(out, "            disconnect[:ms]: drop the oldest, and "
+          "disconnect if not\n");
+  fprintf(out, "            caught up within ms (default %d)\n",
+          LAG_TIMEOUT_DEFAULT);
+  fprintf(out, "  -q size   client queue size in bytes, k and M suffixes "
+          "allowed (default %dk)\n", CLIENT_QUEUE_DEFAULT / 1024);
+  fprintf(out, "  -F ms[,size] hold packets for clients up to ms, or until "
+          "size bytes\n            are pending (default %dk), to write "
+          "them together\n", FLUSH_SIZE_DEFAULT / 1024);
+  fprintf(out, "  -H hist   keep the data of the last N seconds (Ns), or "
+          "N bytes of it\n");
+  fprintf(out, "            (k, M, G suffixes) for clients to replay, or "
+          "both (30s,256M).\n");
+  fprintf(out, "            default size %dM\n", HISTORY_SIZE_DEFAULT >> 20);
   return EX_USAGE;
 }
 
@@ -169,25 +237,320 @@ int error(const char *fmt, ...)
   return EXIT_FAILURE;
 }
 
-// Log a message to terminal, prefixed with a timestamp
-void logmsg(const char *fmt, ...)
+// Logging. Once log_init() has started the logger thread, logmsg() only
+// formats the message into a slot of a lock-free ring, and the logger
+// thread adds the timestamp and writes it out, so that threads forwarding
+// packets never wait on the terminal or the file. The strftime() prefix
+// is kept for as long as the second does not change. If the ring is full,
+// the message is lost and counted. Each call site (format string) gets
+// LOG_BURST messages a second, and how many more it had is reported
+// instead, so that a storm of drops cannot flood the log. Messages with a
+// key of their own, like the logs of each sensor and level, are limited
+// separately from the rest of their call site, and those with key 0 are
+// never limited. Slots are kept once claimed; keys that find no free slot
+// share the last one.
+#define LOG_RING_SIZE 1024 // messages, power of two
+#define LOG_MESSAGE_MAX 640 // longer messages are cut short
+#define LOG_BURST 20 // messages per key and second
+#define LOG_LIMIT_SLOTS 512 // keys tracked, power of two
+#define LOG_LIMIT_PROBES 16 // slots looked at for a key
+#define LOG_LABEL_MAX 128
+
+struct log_record {
+  atomic_uint_fast64_t seq; // position + 1 once written, see log_reserve()
+  struct timespec time;
+  char text[LOG_MESSAGE_MAX];
+};
+
+// Messages of a key this second
+struct log_limit {
+  atomic_uint_fast64_t key; // 0 while the slot is free
+  atomic_int ready; // 'label' is set
+  char label[LOG_LABEL_MAX]; // what the messages are, for the report
+  atomic_uint_fast64_t second;
+  atomic_uint count;
+  atomic_uint suppressed; // not reported yet
+};
+
+struct log_record *log_ring = NULL; // NULL while logging synchronously
+atomic_uint_fast64_t log_head; // next position to reserve
+uint64_t log_tail; // next position to write out, logger thread only
+atomic_uint_fast64_t log_lost;
+struct log_limit log_limits[LOG_LIMIT_SLOTS + 1]; // last for the others
+pthread_t log_thread;
+int log_wake_pipe[2];
+atomic_int log_sleeping;
+atomic_int log_stop;
+
+// Key of the messages identified by 'data', never 0 nor a call site
+uint64_t log_key(const void *data, size_t size)
 {
-  struct timespec now;
-  clock_gettime(CLOCK_REALTIME, &now);
-  struct tm tm;
-  localtime_r(&now.tv_sec, &tm);
-  char timebuf[128];
-  if (strftime(timebuf, sizeof(timebuf), timefmt, &tm) == 0)
-    timebuf[0] = '\0';
+  uint64_t hash = 0xCBF29CE484222325ull; // FNV-1a
+  for (size_t i = 0; i < size; i++)
+    hash = (hash ^ ((const uint8_t*) data)[i]) * 0x100000001B3ull;
+  return hash | (1ull << 63);
+}
+
+// The slot of 'key', claimed for it if it has none yet. The label of a
+// new slot is 'label', or the format string 'fmt' of the call site.
+struct log_limit *log_limit_slot(uint64_t key, const char *label,
+                                const char *fmt)
+{
+  size_t i = ((key >> 4) * 0x9E3779B97F4A7C15ull) >> 40;
+  for (size_t n = 0; n < LOG_LIMIT_PROBES; n++, i++) {
+    struct log_limit *l = &log_limits[i & (LOG_LIMIT_SLOTS - 1)];
+    uint_fast64_t k = atomic_load_explicit(&l->key, memory_order_relaxed);
+    if ((k == 0) &&
+        atomic_compare_exchange_strong(&l->key, &k, (uint_fast64_t) key)) {
+      if (label)
+        snprintf(l->label, sizeof(l->label), "%s", label);
+      else
+        snprintf(l->label, sizeof(l->label), "like \"%s\"", fmt);
+      atomic_store_explicit(&l->ready, 1, memory_order_release);
+      return l;
+    }
+    if (k == key)
+      return l;
+  }
+  return &log_limits[LOG_LIMIT_SLOTS];
+}
+
+// Whether another message with 'key' can go out this second
+int log_allowed(uint64_t key, const char *label, const char *fmt,
+                time_t second)
+{
+  if (key == 0)
+    return 1;
+  struct log_limit *l = log_limit_slot(key, label, fmt);
+  uint_fast64_t last = atomic_load_explicit(&l->second, memory_order_relaxed);
+  if ((last != (uint_fast64_t) second) &&
+      atomic_compare_exchange_strong(&l->second, &last, second))
+    atomic_store_explicit(&l->count, 0, memory_order_relaxed);
+  if (atomic_fetch_add_explicit(&l->count, 1, memory_order_relaxed) <
+      LOG_BURST)
+    return 1;
+  atomic_fetch_add_explicit(&l->suppressed, 1, memory_order_relaxed);
+  return 0;
+}
+
+// Reserve the next slot of the ring, or return NULL if it is full. Each
+// slot's seq is its position while free, and position + 1 once written.
+struct log_record *log_reserve(uint64_t *pos)
+{
+  uint64_t head = atomic_load_explicit(&log_head, memory_order_relaxed);
+  for (;;) {
+    struct log_record *rec = &log_ring[head & (LOG_RING_SIZE - 1)];
+    uint64_t seq = atomic_load_explicit(&rec->seq, memory_order_acquire);
+    if (seq == head) {
+      if (atomic_compare_exchange_weak_explicit(&log_head, &head, head + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        *pos = head;
+        return rec;
+      }
+    } else if (seq < head) {
+      return NULL; // the logger thread has yet to write it out
+    } else {
+      head = atomic_load_explicit(&log_head, memory_order_relaxed);
+    }
+  }
+}
+
+// Print a message with its timestamp. Only from one thread at a time.
+void log_print(const struct timespec *time, const char *text)
+{
+  static time_t cached_second = -1;
+  static char prefix[128];
+  if (time->tv_sec != cached_second) {
+    cached_second = time->tv_sec;
+    struct tm tm;
+    localtime_r(&time->tv_sec, &tm);
+    if (strftime(prefix, sizeof(prefix), timefmt, &tm) == 0)
+      prefix[0] = '\0';
+  }
   if (timestamp_us)
-    printf("%s.%06d  ", timebuf, (int)(now.tv_nsec/1000));
+    printf("%s.%06d  %s\n", prefix, (int)(time->tv_nsec/1000), text);
   else
-    printf("%s  ", timebuf);
+    printf("%s  %s\n", prefix, text);
+}
+
+// Report the messages lost or suppressed since the last time
+void log_report(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  char text[LOG_MESSAGE_MAX];
+  uint64_t lost = atomic_exchange(&log_lost, 0);
+  if (lost > 0) {
+    snprintf(text, sizeof(text), "%llu log messages lost, logging too "
+             "slow", (unsigned long long) lost);
+    log_print(&now, text);
+  }
+  for (size_t i = 0; i <= LOG_LIMIT_SLOTS; i++) {
+    struct log_limit *l = &log_limits[i];
+    if ((atomic_load_explicit(&l->suppressed, memory_order_relaxed) == 0) ||
+        (atomic_load_explicit(&l->second, memory_order_relaxed) ==
+         (uint_fast64_t) now.tv_sec))
+      continue;
+    unsigned n = atomic_exchange(&l->suppressed, 0);
+    const char *label = (i == LOG_LIMIT_SLOTS) ? "of other kinds" :
+      atomic_load_explicit(&l->ready, memory_order_acquire) ? l->label :
+      NULL;
+    if ((n > 0) && label) {
+      snprintf(text, sizeof(text), "%u more messages %s suppressed", n,
+               label);
+      log_print(&now, text);
+    }
+  }
+}
+
+// Write out the messages in the ring. Returns how many there were.
+size_t log_drain(void)
+{
+  size_t n = 0;
+  for (;; n++, log_tail++) {
+    struct log_record *rec = &log_ring[log_tail & (LOG_RING_SIZE - 1)];
+    if (atomic_load_explicit(&rec->seq, memory_order_acquire) !=
+        (log_tail + 1))
+      break;
+    log_print(&rec->time, rec->text);
+    atomic_store_explicit(&rec->seq, log_tail + LOG_RING_SIZE,
+                          memory_order_release);
+  }
+  return n;
+}
+
+void *log_thread_main(void *arg)
+{
+  (void) arg;
+  time_t last_report = time(NULL);
+  for (;;) {
+    int stop = atomic_load(&log_stop);
+    log_drain();
+    time_t now = time(NULL);
+    if (now != last_report) {
+      last_report = now;
+      log_report();
+    }
+    fflush(stdout);
+    if (stop)
+      break;
+
+    // Sleep, unless something was logged since looking. Pairs with
+    // logmsg().
+    atomic_store(&log_sleeping, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    struct log_record *rec = &log_ring[log_tail & (LOG_RING_SIZE - 1)];
+    if (atomic_load_explicit(&rec->seq, memory_order_acquire) ==
+        (log_tail + 1)) {
+      atomic_store(&log_sleeping, 0);
+      continue;
+    }
+    struct pollfd pfd = { log_wake_pipe[0], POLLIN, 0 };
+    poll(&pfd, 1, 1000);
+    atomic_store(&log_sleeping, 0);
+    char buf[64];
+    while (read(log_wake_pipe[0], buf, sizeof(buf)) > 0);
+  }
+  return NULL;
+}
+
+// Log a message to terminal, prefixed with a timestamp, limited under
+// 'key' as 'label' (see above)
+void log_vmsg(uint64_t key, const char *label, const char *fmt, va_list ap)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  if (!log_allowed(key, label, fmt, now.tv_sec))
+    return;
+
+  char sync_text[LOG_MESSAGE_MAX];
+  char *text = sync_text;
+  struct log_record *rec = NULL;
+  uint64_t pos = 0;
+  if (log_ring) {
+    rec = log_reserve(&pos);
+    if (!rec) {
+      atomic_fetch_add(&log_lost, 1);
+      return;
+    }
+    rec->time = now;
+    text = rec->text;
+  }
+  vsnprintf(text, LOG_MESSAGE_MAX, fmt, ap);
+  if (!rec) {
+    log_print(&now, text);
+    return;
+  }
+
+  atomic_store_explicit(&rec->seq, pos + 1, memory_order_release);
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load(&log_sleeping) && atomic_exchange(&log_sleeping, 0)) {
+    if (write(log_wake_pipe[1], "", 1) < 0) {
+      // pipe full: the logger thread has plenty of wakeups pending
+    }
+  }
+}
+
+void logmsg_keyed(uint64_t key, const char *label, const char *fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  log_vmsg(key, label, fmt, ap);
+  va_end(ap);
+}
+
+// Log a message to terminal, limited with the others of its call site
+void logmsg(const char *fmt, ...)
+{
   va_list ap;
   va_start(ap, fmt);
-  vprintf(fmt, ap);
+  log_vmsg((uintptr_t) fmt, NULL, fmt, ap);
   va_end(ap);
-  putchar('\n');
+}
+
+// Start logging from a thread of its own
+int log_init(void)
+{
+  log_ring = calloc(LOG_RING_SIZE, sizeof(*log_ring));
+  if (!log_ring)
+    return -1;
+  for (size_t i = 0; i < LOG_RING_SIZE; i++)
+    atomic_init(&log_ring[i].seq, i);
+  atomic_init(&log_head, 0);
+  log_tail = 0;
+  atomic_init(&log_lost, 0);
+  atomic_init(&log_sleeping, 0);
+  atomic_init(&log_stop, 0);
+  if ((pipe(log_wake_pipe) != 0) ||
+      (fcntl(log_wake_pipe[0], F_SETFL, O_NONBLOCK) != 0) ||
+      (fcntl(log_wake_pipe[1], F_SETFL, O_NONBLOCK) != 0) ||
+      (pthread_create(&log_thread, NULL, log_thread_main, NULL) != 0)) {
+    free(log_ring);
+    log_ring = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+// Write out what is left, and go back to logging synchronously
+void log_finish(void)
+{
+  if (!log_ring)
+    return;
+  atomic_store(&log_stop, 1);
+  if (write(log_wake_pipe[1], "", 1) < 0) {
+    // already awake
+  }
+  pthread_join(log_thread, NULL);
+  // Messages reserved while stopping
+  log_drain();
+  log_report();
+  fflush(stdout);
+  free(log_ring);
+  log_ring = NULL;
+  close(log_wake_pipe[0]);
+  close(log_wake_pipe[1]);
 }
 
 // As above, but will only display if given verbose flag
@@ -199,172 +562,4556 @@ void io_log(int fd, const char *message)
   logmsgverbose("IO fd #%d message: %s", fd, message);
 }
 
-// State dump for debugging
-void dump_state(void)
+// Event loop. An array of pollfd holds the descriptors and the events each
+// one is waiting for, and the backend reports which of them are ready: with
+// epoll the cost of a wakeup depends on the number of ready descriptors,
+// not on the number of clients. After changing the fd or the events of an
+// entry, call event_update(loop, i); entries must be updated to fd -1
+// before the descriptor is closed, since epoll would not know a reused fd
+// number. Entries waiting for no events are not registered at all.
+struct event_loop {
+  struct pollfd *fds;
+  size_t max_fds;
+  size_t *ready; // indices in fds with events, from event_wait()
+#if EVENT_EPOLL
+  int epoll_fd;
+  struct epoll_event *events;
+  int *registered; // fd registered for each entry, or -1
+#endif
+};
+
+struct event_loop main_loop; // over poll_array
+
+int event_init(struct event_loop *loop, struct pollfd *fds, size_t max_fds)
 {
-  printf("** BEGIN STATE DUMP **\n");
-  printf("Remap array:\n");
-  for (size_t i = 0; i <= max_rpcs_in_flight; i++) {
-    rpc_remap *remap = &remap_array[i];
-    printf("%zd(%p): <%p:%p> <%p:%p> %ld %d %d %d\n",
-           i, remap, remap->prev, remap->next, remap->to_prev, remap->to_next,
-           remap->send_time, remap->client_desc, remap->id, remap->orig_id);
+  loop->fds = fds;
+  loop->max_fds = max_fds;
+  loop->ready = calloc(max_fds, sizeof(*loop->ready));
+  if (!loop->ready)
+    return -1;
+#if EVENT_EPOLL
+  loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  loop->events = calloc(max_fds, sizeof(*loop->events));
+  loop->registered = malloc(max_fds * sizeof(*loop->registered));
+  if ((loop->epoll_fd < 0) || !loop->events || !loop->registered)
+    return -1;
+  for (size_t i = 0; i < max_fds; i++)
+    loop->registered[i] = -1;
+#endif
+  return 0;
+}
+
+int event_update(struct event_loop *loop, size_t i)
+{
+#if EVENT_EPOLL
+  int fd = loop->fds[i].fd;
+  short events = loop->fds[i].events;
+  if ((loop->registered[i] >= 0) &&
+      ((loop->registered[i] != fd) || (events == 0))) {
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, loop->registered[i], NULL);
+    loop->registered[i] = -1;
   }
-  printf("Client lists:\n");
-  for (size_t i = 0; i < max_descriptors; i++) {
-    rpc_remap *remap = &client_list[i];
-    printf("%zd(%p): <%p:%p> <%p:%p> %ld %d %d %d\n",
-           i, remap, remap->prev, remap->next, remap->to_prev, remap->to_next,
-           remap->send_time, remap->client_desc, remap->id, remap->orig_id);
+  if ((fd < 0) || (events == 0))
+    return 0;
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  if (events & POLLIN)
+    ev.events |= EPOLLIN;
+  if (events & POLLOUT)
+    ev.events |= EPOLLOUT;
+  ev.data.u32 = i;
+  int op = (loop->registered[i] < 0) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+  if (epoll_ctl(loop->epoll_fd, op, fd, &ev) != 0)
+    return -1;
+  loop->registered[i] = fd;
+#else
+  (void) loop;
+  (void) i;
+#endif
+  return 0;
+}
+
+// Move entry 'from' to the unused entry 'to'
+int event_move(struct event_loop *loop, size_t from, size_t to)
+{
+  loop->fds[to] = loop->fds[from];
+  loop->fds[from].fd = -1;
+#if EVENT_EPOLL
+  loop->registered[to] = loop->registered[from];
+  loop->registered[from] = -1;
+#endif
+  return event_update(loop, to);
+}
+
+// Turn on or off waiting for an entry to be writeable
+void event_pollout(struct event_loop *loop, size_t i, int enable)
+{
+  short events = loop->fds[i].events & ~POLLOUT;
+  if (enable)
+    events |= POLLOUT;
+  if (events != loop->fds[i].events) {
+    loop->fds[i].events = events;
+    event_update(loop, i);
   }
-  // TODO: add more stuff if needed
-  printf("** END STATE DUMP **\n");
 }
 
-void init_remap_struct(rpc_remap *remap, rpc_remap *prev, rpc_remap *next)
+// Wait for events on the first n_fds entries, with a timeout in ms and
+// with the signal mask given while waiting. Sets the revents of the ready
+// entries and returns how many of them there are in loop->ready.
+int event_wait(struct event_loop *loop, size_t n_fds, int timeout_ms,
+               const sigset_t *sigmask)
 {
-  remap->prev = prev;
-  remap->next = next;
-  remap->to_prev = NULL;
-  remap->to_next = NULL;
-  remap->send_time = 0;
-  remap->client_desc = -1;
-  remap->id = 0xFFFF;
-  remap->orig_id = 0xFFFF;
-  remap->routing_size = 0;
+#if EVENT_EPOLL
+  (void) n_fds;
+  int n = epoll_pwait(loop->epoll_fd, loop->events, loop->max_fds,
+                      timeout_ms, sigmask);
+  for (int i = 0; i < n; i++) {
+    size_t ps = loop->events[i].data.u32;
+    uint32_t ev = loop->events[i].events;
+    short revents = 0;
+    // a hangup is seen like with poll, as end of file when reading
+    if (ev & (EPOLLIN | EPOLLHUP))
+      revents |= POLLIN;
+    if (ev & EPOLLOUT)
+      revents |= POLLOUT;
+    if (ev & EPOLLERR)
+      revents |= POLLERR;
+    loop->fds[ps].revents = revents;
+    loop->ready[i] = ps;
+  }
+  return n;
+#else
+  struct timespec timeout = {
+    .tv_sec = timeout_ms / 1000,
+    .tv_nsec = (timeout_ms % 1000) * 1000000L
+  };
+  int n = ppoll(loop->fds, n_fds, &timeout, sigmask);
+  int n_ready = 0;
+  for (size_t i = 0; (n_ready < n) && (i < n_fds); i++) {
+    if (loop->fds[i].revents != 0)
+      loop->ready[n_ready++] = i;
+  }
+  return (n < 0) ? n : n_ready;
+#endif
+}
+
+// Make sure we are allowed enough descriptors for all the clients
+void raise_descriptor_limit(size_t needed)
+{
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) != 0)
+    return;
+  if (rl.rlim_cur >= needed)
+    return;
+  rl.rlim_cur = needed;
+  if ((rl.rlim_max != RLIM_INFINITY) && (rl.rlim_max < needed))
+    rl.rlim_cur = rl.rlim_max;
+  if ((setrlimit(RLIMIT_NOFILE, &rl) != 0) || (rl.rlim_cur < needed))
+    logmsg("Warning: open file limit too low for the maximum number of "
+           "clients");
+}
+
+int set_nonblock_cloexec(int fd)
+{
+  if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1)
+    return -1;
+  int flags = fcntl(fd, F_GETFL);
+  if (flags == -1)
+    return -1;
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// sends a packet to an entity, setting up writeable notifications if needed.
+// return -1 on error that would require closing the connection, 0 on success,
+// 1 if the packet was not sent because we were out of buffer space.
+int send_packet(size_t ps, tl_packet *packet)
+{
+  int ret = tlsend(poll_array[ps].fd, packet);
+  if (ret == 0)
+    return 0;
+
+  if ((errno == EOVERFLOW) || (errno == ENOTEMPTY))
+    event_pollout(&main_loop, ps, 1);
+  if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == ENOTEMPTY))
+    return 1;
+  if (errno == EOVERFLOW)
+    return 0;
+  return -1;
+}
+
+// Broadcast ring. Each packet for clients is encoded once into a slot of
+// the ring, and written to the client sockets straight from there: a
+// client only has a cursor into the ring, plus room for the rest of a
+// packet that was partially written. Slots are reused in order, so a
+// client that falls a whole ring behind loses its oldest packets, rather
+// than holding up everybody else. Each writer pins the oldest packet it
+// is reading, and a slot is not reused while pinned.
+#define RING_SIZE 8192 // packets, power of two
+#define WRITE_IOV_MAX 256 // packets per write
+
+struct ring_slot {
+  uint64_t offset; // bytes published before this packet
+  int32_t dest; // client index in poll_array, or -1 for all clients
+  uint16_t route; // id in the route table
+  uint8_t derived; // derived stream id + 1 if for its clients only, or 0
+  uint16_t size;
+  uint8_t data[TL_PACKET_MAX_SIZE]; // the packet as sent on the wire
+};
+
+struct packet_ring {
+  struct ring_slot *slots;
+  uint64_t bytes; // total published, only used by the main thread
+  atomic_uint_fast64_t head; // sequence number of the next packet
+  atomic_uint_fast64_t flushed; // packets released to the writers, see -F
+  uint64_t flushed_bytes; // 'bytes' when last released, main thread only
+  atomic_uint_fast64_t claimed; // all packets before this minus RING_SIZE
+                                // are gone
+  atomic_uint_fast64_t *pins; // oldest packet each writer is reading
+  size_t n_pins;
+};
+
+struct packet_ring ring;
+int ring_published = 0; // packets published since waking up the writers
+
+// Slow client policies (-b). A client is lagging when more than
+// client_queue_limit bytes are queued up for it in the ring. Only data
+// stream packets sent to all clients are ever dropped: metadata, logs and
+// RPC replies always go through, unless the ring itself laps the client.
+#define SLOW_DROP       0 // drop the oldest data beyond the queue limit
+#define SLOW_LATEST     1 // drop all the queued data but the latest packet
+#define SLOW_DECIMATE   2 // only send every Nth sample of the queued data
+#define SLOW_DISCONNECT 3 // drop the oldest, disconnect if lagging N ms
+
+int slow_client_policy = SLOW_DROP;
+unsigned slow_client_arg = 0; // decimation factor, or ms to disconnect
+uint64_t client_queue_limit = CLIENT_QUEUE_DEFAULT;
+
+// Statistics, for the stats port (-S) and proxy.stats. Each counter is
+// only ever updated by one thread, with a plain load and store: they are
+// atomic so that other threads can read them, but cost no more than an
+// ordinary increment. Histograms count values in power of two buckets.
+#define HISTOGRAM_BUCKETS 32 // the last one also counts anything larger
+
+typedef atomic_uint_fast64_t stat_counter;
+
+struct histogram {
+  stat_counter count[HISTOGRAM_BUCKETS]; // values up to 2^i in bucket i
+  stat_counter sum;
+};
+
+// Of each sensor, updated by the main thread
+struct sensor_stats {
+  stat_counter packets_in;
+  stat_counter bytes_in;
+  stat_counter packets_out;
+  stat_counter bytes_out;
+  stat_counter dropped_out; // packets from clients that could not be sent
+};
+
+// Of each client. What the client sent is counted by the main thread, the
+// rest is copied from client_out by the thread writing to the client, see
+// client_stats_publish().
+struct client_stats {
+  stat_counter packets_in;
+  stat_counter bytes_in;
+  stat_counter packets_out;
+  stat_counter bytes_out;
+  stat_counter dropped;
+  stat_counter dropped_bytes;
+  stat_counter queued_bytes;
+  stat_counter peak_queued_bytes;
+};
+
+// Of each thread writing to clients: the writers, then the main thread
+struct writer_stats {
+  struct histogram queued_bytes; // at each write
+  stat_counter dropped_in; // packets from clients, main thread busy
+};
+
+// Updated by the main thread
+struct proxy_stats {
+  stat_counter loop_iterations;
+  struct histogram loop_us; // time not waiting for events, per iteration
+  struct histogram rpc_us; // from remapping a call to its reply
+  stat_counter rpc_timeouts;
+  stat_counter rpc_cached; // answered from the reply cache
+  stat_counter rpc_shared; // answered with the reply to the same query
+  stat_counter rpc_refused; // out of buffers
+};
+
+struct proxy_stats stats;
+struct sensor_stats *sensor_stats = NULL;
+struct writer_stats *writer_stats = NULL;
+
+void stat_add(stat_counter *c, uint64_t n)
+{
+  atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n,
+                        memory_order_relaxed);
+}
+
+void stat_set(stat_counter *c, uint64_t val)
+{
+  atomic_store_explicit(c, val, memory_order_relaxed);
+}
+
+uint64_t stat_get(stat_counter *c)
+{
+  return atomic_load_explicit(c, memory_order_relaxed);
+}
+
+void histogram_add(struct histogram *h, uint64_t val)
+{
+  unsigned i = (val <= 1) ? 0 : (64 - __builtin_clzll(val - 1));
+  if (i >= HISTOGRAM_BUCKETS)
+    i = HISTOGRAM_BUCKETS - 1;
+  stat_add(&h->count[i], 1);
+  stat_add(&h->sum, val);
+}
+
+// Output state of a client, owned by the thread writing to it
+struct client_out {
+  uint64_t seq; // next ring packet to send
+  uint64_t pos; // stream offset of packet 'seq', see ring_slot.offset
+  uint64_t drop_until; // queued data before this packet is subject to
+                       // the slow client policy
+  uint64_t lag_start; // when the client started waiting, in ms, or 0
+  int lagging; // over the queue limit since last caught up
+  // Statistics
+  uint64_t sent_packets;
+  uint64_t sent_bytes;
+  uint64_t dropped; // packets, including the ones lost to the ring
+  uint64_t dropped_bytes;
+  uint64_t queued_bytes; // at the last write
+  uint64_t peak_queued_bytes;
+  struct client_stats stats;
+  struct websocket *ws; // NULL unless a WebSocket client
+  int blocked; // waiting for the socket to be writeable
+  uint16_t partial_size;
+  uint16_t partial_sent;
+  uint8_t partial[TL_PACKET_MAX_SIZE]; // packet partially written
+  int replaying; // sending history before going on with the ring
+  uint64_t replay; // offset of the next history record to look at
+  uint64_t replay_end; // history packets from here to 'seq' were sent live
+  atomic_int replay_requested; // set by the main thread
+  // Set by the main thread, and only replaced or freed under the lock.
+  // The writer holds the lock while picking the packets to send.
+  pthread_mutex_t lock;
+  struct subscription *sub; // NULL for all packets
+  uint64_t derived; // bitmap of the derived streams requested
+  uint64_t replay_from; // history offset to replay from
+  // Owned by the main thread
+  uint64_t start_seq; // first ring packet the client could get
+  // Of a stats port client, owned by the main thread
+  int stats_newline; // the request read so far ends with a line break
+  char *stats_reply; // NULL until the request is complete
+  size_t stats_reply_size;
+  size_t stats_reply_sent;
+};
+
+struct client_out *client_out = NULL;
+
+// Subscriptions (proxy.subscribe). Every route the sensors send packets
+// from on their own (not RPC replies, whose routing a client chose) gets a
+// small id, and each subscription keeps a bitmap of the packet types
+// wanted from each route, so that filtering a packet is a single lookup.
+// Routes past MAX_ROUTES all get the last id, which only matches
+// subscriptions to everything from the root.
+#define MAX_ROUTES 256
+#define ROUTE_HASH_SIZE 1024 // power of two, well over MAX_ROUTES
+#define SUBSCRIBE_MAX_RULES 32
+
+struct route {
+  uint8_t size;
+  uint8_t routing[TL_PACKET_MAX_ROUTING_SIZE];
+};
+
+struct route routes[MAX_ROUTES];
+size_t n_routes = 0;
+int16_t route_hash[ROUTE_HASH_SIZE]; // route id + 1, 0 if empty
+
+struct subscription_rule {
+  uint8_t size;
+  uint8_t routing[TL_PACKET_MAX_ROUTING_SIZE]; // route prefix
+  uint64_t types[4]; // bitmap of packet types
+};
+
+struct subscription {
+  size_t n_rules;
+  struct subscription_rule rules[SUBSCRIBE_MAX_RULES];
+  uint64_t types[MAX_ROUTES + 1][4]; // union of the rules, for each route
+};
+
+#define TYPE_SET(bits, type) ((bits)[(type) >> 6] |= 1ull << ((type) & 63))
+#define TYPE_ISSET(bits, type) (((bits)[(type) >> 6] >> ((type) & 63)) & 1)
+
+// Compute the packet types wanted by 'sub' from route 'id'
+void subscription_route(struct subscription *sub, size_t id)
+{
+  uint64_t *types = sub->types[id];
+  memset(types, 0, sizeof(sub->types[id]));
+  for (size_t i = 0; i < sub->n_rules; i++) {
+    struct subscription_rule *rule = &sub->rules[i];
+    // Routing is stored last hop first, so the prefix is at the end
+    if (id == MAX_ROUTES) {
+      if (rule->size != 0)
+        continue;
+    } else if ((rule->size > routes[id].size) ||
+               (memcmp(routes[id].routing + routes[id].size - rule->size,
+                       rule->routing, rule->size) != 0)) {
+      continue;
+    }
+    for (size_t w = 0; w < 4; w++)
+      types[w] |= rule->types[w];
+  }
+}
+
+uint32_t routing_hash(const uint8_t *routing, size_t size)
+{
+  uint32_t hash = 2166136261u ^ size;
+  for (size_t i = 0; i < size; i++)
+    hash = (hash ^ routing[i]) * 16777619u;
+  return hash;
+}
+
+// Hash table slot of a route: the one holding it, or the empty one where
+// it would go
+size_t route_slot(const uint8_t *routing, size_t size)
+{
+  size_t h = routing_hash(routing, size) & (ROUTE_HASH_SIZE - 1);
+  for (; route_hash[h] != 0; h = (h + 1) & (ROUTE_HASH_SIZE - 1)) {
+    struct route *r = &routes[route_hash[h] - 1];
+    if ((r->size == size) && (memcmp(r->routing, routing, size) == 0))
+      break;
+  }
+  return h;
+}
+
+// Get the id of a route already seen, or MAX_ROUTES
+uint16_t route_lookup(const uint8_t *routing, size_t size)
+{
+  size_t h = route_slot(routing, size);
+  return route_hash[h] ? route_hash[h] - 1 : MAX_ROUTES;
+}
+
+// Get the id of a route, adding it to the table if new
+uint16_t route_id(const uint8_t *routing, size_t size)
+{
+  size_t h = route_slot(routing, size);
+  if (route_hash[h] != 0)
+    return route_hash[h] - 1;
+  if (n_routes == MAX_ROUTES)
+    return MAX_ROUTES;
+
+  uint16_t id = n_routes++;
+  routes[id].size = size;
+  memcpy(routes[id].routing, routing, size);
+  route_hash[h] = id + 1;
+  // No need to lock: the writers do not look at this route until a
+  // packet from it is published
+  for (size_t ps = 0; ps < max_descriptors; ps++) {
+    if (client_out[ps].sub)
+      subscription_route(client_out[ps].sub, id);
+  }
+  return id;
+}
+
+// Parse a subscription: rules separated by spaces, each a route prefix
+// optionally followed by a colon and a comma separated list of what to
+// get from it: all (the default), data, meta, log, or a stream id.
+// For example "/0 /3/1:meta,0,2" gets everything from sensor 0, and the
+// metadata and streams 0 and 2 from the sensor at /3/1.
+int subscription_parse(struct subscription *sub, const char *spec,
+                       size_t len)
+{
+  sub->n_rules = 0;
+  for (size_t i = 0; i < len;) {
+    if (spec[i] == ' ') {
+      i++;
+      continue;
+    }
+    char token[64];
+    size_t n = 0;
+    for (; (i < len) && (spec[i] != ' '); i++) {
+      if (n == (sizeof(token) - 1))
+        return -1;
+      token[n++] = spec[i];
+    }
+    token[n] = '\0';
+    if (sub->n_rules == SUBSCRIBE_MAX_RULES)
+      return -1;
+    struct subscription_rule *rule = &sub->rules[sub->n_rules++];
+    memset(rule, 0, sizeof(*rule));
+
+    char *what = strchr(token, ':');
+    if (what)
+      *what++ = '\0';
+    int size = tl_parse_routing(rule->routing, token);
+    if (size < 0)
+      return -1;
+    rule->size = size;
+
+    for (char *item = what ? strtok(what, ",") : "all"; item;
+         item = what ? strtok(NULL, ",") : NULL) {
+      char *end;
+      unsigned long stream = strtoul(item, &end, 10);
+      if (strcmp(item, "all") == 0) {
+        memset(rule->types, 0xFF, sizeof(rule->types));
+      } else if (strcmp(item, "data") == 0) {
+        rule->types[2] = rule->types[3] = UINT64_MAX;
+      } else if (strcmp(item, "meta") == 0) {
+        TYPE_SET(rule->types, TL_PTYPE_TIMEBASE);
+        TYPE_SET(rule->types, TL_PTYPE_SOURCE);
+        TYPE_SET(rule->types, TL_PTYPE_STREAM);
+      } else if (strcmp(item, "log") == 0) {
+        TYPE_SET(rule->types, TL_PTYPE_LOG);
+        TYPE_SET(rule->types, TL_PTYPE_TEXT);
+      } else if ((end != item) && (*end == '\0') && (stream < 128)) {
+        TYPE_SET(rule->types, TL_PTYPE_STREAM0 + stream);
+      } else {
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+// Replace the subscription of client 'ps' with 'spec', or subscribe it to
+// everything if empty. Returns -1 if 'spec' is invalid.
+int client_subscribe(size_t ps, const char *spec, size_t len)
+{
+  struct subscription *sub = malloc(sizeof(*sub));
+  if (!sub)
+    return -1;
+  if (subscription_parse(sub, spec, len) != 0) {
+    free(sub);
+    return -1;
+  }
+  if (sub->n_rules == 0) {
+    free(sub);
+    sub = NULL;
+  } else {
+    for (size_t id = 0; id < n_routes; id++)
+      subscription_route(sub, id);
+    subscription_route(sub, MAX_ROUTES);
+  }
+
+  struct client_out *c = &client_out[ps];
+  pthread_mutex_lock(&c->lock);
+  struct subscription *old = c->sub;
+  c->sub = sub;
+  pthread_mutex_unlock(&c->lock);
+  free(old);
+  logmsgverbose("Client #%d subscribed to '%.*s'", poll_array[ps].fd,
+                (int) len, spec);
+  return 0;
+}
+
+int ring_init(size_t n_writers)
+{
+  ring.slots = calloc(RING_SIZE, sizeof(*ring.slots));
+  ring.pins = calloc(n_writers, sizeof(*ring.pins));
+  client_out = calloc(max_descriptors, sizeof(*client_out));
+  if (!ring.slots || !ring.pins || !client_out)
+    return -1;
+  for (size_t i = 0; i < max_descriptors; i++)
+    pthread_mutex_init(&client_out[i].lock, NULL);
+  ring.n_pins = n_writers;
+  for (size_t i = 0; i < n_writers; i++)
+    atomic_init(&ring.pins[i], UINT64_MAX);
+  atomic_init(&ring.head, 0);
+  atomic_init(&ring.flushed, 0);
+  atomic_init(&ring.claimed, 0);
+  return 0;
+}
+
+// Publish a packet for client 'dest', or for all clients if -1. If
+// 'derived' is nonzero, only the clients of derived stream 'derived' - 1
+// get it.
+void ring_publish_derived(int32_t dest, uint8_t derived, tl_packet *packet)
+{
+  uint64_t seq = atomic_load_explicit(&ring.head, memory_order_relaxed);
+  atomic_store(&ring.claimed, seq + 1);
+  if (seq >= RING_SIZE) {
+    // Wait for writes still in progress from the slot. Pairs with ring_pin
+    for (size_t i = 0; i < ring.n_pins; i++) {
+      while (atomic_load(&ring.pins[i]) <= (seq - RING_SIZE))
+        sched_yield();
+    }
+  }
+  struct ring_slot *slot = &ring.slots[seq & (RING_SIZE - 1)];
+  slot->offset = ring.bytes;
+  slot->dest = dest;
+  slot->derived = derived;
+  slot->route = route_lookup(tl_packet_routing_data(&packet->hdr),
+                             tl_packet_routing_size(&packet->hdr));
+  slot->size = tl_packet_total_size(&packet->hdr);
+  memcpy(slot->data, packet, slot->size);
+  ring.bytes += slot->size;
+  atomic_store_explicit(&ring.head, seq + 1, memory_order_release);
+}
+
+void ring_publish(int32_t dest, tl_packet *packet)
+{
+  ring_publish_derived(dest, 0, packet);
+}
+
+// Pin packet 'seq' and the ones after it for reading by writer 'writer'.
+// Returns the oldest packet still available, in case 'seq' is gone
+uint64_t ring_pin(size_t writer, uint64_t seq)
+{
+  for (;;) {
+    atomic_store(&ring.pins[writer], seq);
+    uint64_t claimed = atomic_load(&ring.claimed);
+    if ((seq + RING_SIZE) >= claimed)
+      return seq;
+    seq = claimed - RING_SIZE;
+  }
+}
+
+void ring_unpin(size_t writer)
+{
+  atomic_store_explicit(&ring.pins[writer], UINT64_MAX, memory_order_release);
+}
+
+uint64_t monotonic_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t monotonic_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint64_t realtime_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Flush budget (-F). The packets published into the ring are released to
+// the writers once flush_bytes of them are pending, or once the oldest has
+// been pending for flush_us, so that at high packet rates each client
+// gets a few large writes rather than one per main loop iteration. With
+// no budget, they are released on every iteration.
+uint64_t flush_us = 0;
+uint64_t flush_bytes = FLUSH_SIZE_DEFAULT;
+uint64_t flush_pending_since = 0; // us, or 0 if nothing pending
+
+// Release the packets published to the writers if the budget ran out, or
+// if 'force'. Returns whether it did.
+int ring_flush(int force)
+{
+  uint64_t head = atomic_load_explicit(&ring.head, memory_order_relaxed);
+  if (head == atomic_load_explicit(&ring.flushed, memory_order_relaxed))
+    return 0;
+  if ((flush_us > 0) && !force) {
+    uint64_t now = monotonic_us();
+    if (flush_pending_since == 0)
+      flush_pending_since = now;
+    uint64_t flushed = atomic_load_explicit(&ring.flushed,
+                                            memory_order_relaxed);
+    if (((ring.bytes - ring.flushed_bytes) < flush_bytes) &&
+        ((head - flushed) < (RING_SIZE / 2)) &&
+        ((now - flush_pending_since) < flush_us))
+      return 0;
+  }
+  flush_pending_since = 0;
+  ring.flushed_bytes = ring.bytes;
+  atomic_store_explicit(&ring.flushed, head, memory_order_release);
+  ring_published = 1;
+  return 1;
+}
+
+// Time in ms until the packets pending have to be released, at most max_ms
+int ring_flush_wait_ms(int max_ms)
+{
+  if (flush_pending_since == 0)
+    return max_ms;
+  uint64_t now = monotonic_us();
+  uint64_t deadline = flush_pending_since + flush_us;
+  if (now >= deadline)
+    return 0;
+  uint64_t ms = (deadline - now + 999) / 1000;
+  return (ms < (uint64_t) max_ms) ? (int) ms : max_ms;
+}
+
+// History (-H). The data stream packets sent to all clients are also kept
+// for a while in an arena allocated upfront, so that a client can get
+// the recent data it missed (proxy.replay) before going on with the live
+// data. Records are stored back to back at increasing offsets, each one
+// contiguous in the arena, and the oldest are overwritten. Like the ring,
+// each writer pins the oldest record it is reading.
+struct history_record {
+  uint64_t seq; // of the packet in the ring
+  uint64_t time_ms; // when received, since the epoch
+  uint16_t route;
+  uint16_t size; // of the packet, or 0 for padding to the end of the arena
+  uint8_t data[];
+};
+
+struct packet_history {
+  uint8_t *arena; // NULL if disabled
+  size_t size;
+  uint64_t max_age_ms; // 0 for no limit
+  atomic_uint_fast64_t head; // offset of the next record
+  atomic_uint_fast64_t tail; // offset of the oldest record
+  atomic_uint_fast64_t *pins; // oldest offset each writer is reading
+  size_t n_pins;
+};
+
+struct packet_history history;
+
+int history_init(size_t n_writers)
+{
+  history.size &= ~(size_t) 7;
+  history.arena = malloc(history.size);
+  history.pins = calloc(n_writers, sizeof(*history.pins));
+  if (!history.arena || !history.pins)
+    return -1;
+  history.n_pins = n_writers;
+  for (size_t i = 0; i < n_writers; i++)
+    atomic_init(&history.pins[i], UINT64_MAX);
+  atomic_init(&history.head, 0);
+  atomic_init(&history.tail, 0);
+  return 0;
+}
+
+struct history_record *history_at(uint64_t offset)
+{
+  return (struct history_record*) (history.arena + offset % history.size);
+}
+
+// Offset of the record after the one at 'offset'
+uint64_t history_next(uint64_t offset)
+{
+  size_t room = history.size - offset % history.size;
+  if (room < sizeof(struct history_record))
+    return offset + room;
+  struct history_record *rec = history_at(offset);
+  if (rec->size == 0)
+    return offset + room;
+  return offset + ((sizeof(*rec) + rec->size + 7) & ~(size_t) 7);
+}
+
+// Keep the packet just published to all clients
+void history_append(tl_packet *packet)
+{
+  uint64_t seq = atomic_load_explicit(&ring.head, memory_order_relaxed) - 1;
+  size_t size = tl_packet_total_size(&packet->hdr);
+  size_t need = (sizeof(struct history_record) + size + 7) & ~(size_t) 7;
+  uint64_t head = atomic_load_explicit(&history.head, memory_order_relaxed);
+  uint64_t tail = atomic_load_explicit(&history.tail, memory_order_relaxed);
+  size_t room = history.size - head % history.size;
+  uint64_t start = (need > room) ? head + room : head;
+  uint64_t end = start + need;
+  uint64_t now = realtime_ms();
+
+  // Drop what the record overwrites, and what is too old
+  while ((tail != head) &&
+         (((end - tail) > history.size) ||
+          ((history.max_age_ms > 0) && (history_at(tail)->size != 0) &&
+           (now > history_at(tail)->time_ms + history.max_age_ms))))
+    tail = history_next(tail);
+  atomic_store(&history.tail, tail);
+  if (end > history.size) {
+    // Wait for writes still in progress from there. Pairs with history_pin
+    for (size_t i = 0; i < history.n_pins; i++) {
+      while (atomic_load(&history.pins[i]) < (end - history.size))
+        sched_yield();
+    }
+  }
+
+  if ((start != head) && (room >= sizeof(struct history_record)))
+    history_at(head)->size = 0;
+  struct history_record *rec = history_at(start);
+  rec->seq = seq;
+  rec->time_ms = now;
+  rec->route = ring.slots[seq & (RING_SIZE - 1)].route;
+  rec->size = size;
+  memcpy(rec->data, packet, size);
+  atomic_store_explicit(&history.head, end, memory_order_release);
+}
+
+// Pin the record at 'offset' and the ones after it for reading by writer
+// 'writer'. Returns the oldest record still there, in case 'offset' is
+// gone
+uint64_t history_pin(size_t writer, uint64_t offset)
+{
+  for (;;) {
+    atomic_store(&history.pins[writer], offset);
+    uint64_t tail = atomic_load(&history.tail);
+    if (offset >= tail)
+      return offset;
+    offset = tail;
+  }
+}
+
+void history_unpin(size_t writer)
+{
+  atomic_store_explicit(&history.pins[writer], UINT64_MAX,
+                        memory_order_release);
+}
+
+// Find where to replay the history from for 'spec': "@TIME" for the data
+// received since TIME, in seconds since the epoch or, if negative, ago;
+// or "ROUTE STREAM SAMPLE" for the data from a sample of a stream on.
+// Returns 0 or an RPC error code.
+int history_find(const char *spec, size_t len, uint64_t *from)
+{
+  char buf[128], route[64];
+  unsigned stream;
+  unsigned long sample = 0;
+  uint64_t time_ms = 0;
+  uint16_t id = MAX_ROUTES;
+  if (!history.arena)
+    return TL_RPC_ERROR_NOTFOUND;
+  if (len >= sizeof(buf))
+    return TL_RPC_ERROR_INVALID;
+  memcpy(buf, spec, len);
+  buf[len] = '\0';
+
+  if (buf[0] == '@') {
+    char *end;
+    double t = strtod(buf + 1, &end);
+    if ((end == buf + 1) || (*end != '\0'))
+      return TL_RPC_ERROR_INVALID;
+    if (t < 0)
+      t += realtime_ms() / 1000.0;
+    time_ms = (t > 0) ? (uint64_t) (t * 1000) : 0;
+  } else {
+    if (sscanf(buf, "%63s %u %lu", route, &stream, &sample) != 3)
+      return TL_RPC_ERROR_INVALID;
+    uint8_t routing[TL_PACKET_MAX_ROUTING_SIZE];
+    int routing_size = tl_parse_routing(routing, route);
+    if ((routing_size < 0) || (stream >= 128))
+      return TL_RPC_ERROR_INVALID;
+    id = route_lookup(routing, routing_size);
+    if (id == MAX_ROUTES)
+      return TL_RPC_ERROR_NOTFOUND;
+  }
+
+  uint64_t head = atomic_load_explicit(&history.head, memory_order_relaxed);
+  uint64_t offset = atomic_load_explicit(&history.tail, memory_order_relaxed);
+  for (; offset != head; offset = history_next(offset)) {
+    struct history_record *rec = history_at(offset);
+    if (rec->size == 0)
+      continue;
+    if (id == MAX_ROUTES) {
+      if (rec->time_ms >= time_ms)
+        break;
+    } else if ((rec->route == id) &&
+               (rec->data[0] == (TL_PTYPE_STREAM0 + stream))) {
+      uint32_t start_sample;
+      memcpy(&start_sample, rec->data + sizeof(tl_packet_header),
+             sizeof(start_sample));
+      if ((int32_t) (start_sample - (uint32_t) sample) >= 0)
+        break;
+    }
+  }
+  *from = offset;
+  return 0;
+}
+
+// Replay the history described by 'spec' (see history_find) to client
+// 'ps', before the packets it has not been sent yet. Returns 0 or an RPC
+// error code.
+int client_replay(size_t ps, const char *spec, size_t len)
+{
+  uint64_t from;
+  int ret = history_find(spec, len, &from);
+  if (ret != 0)
+    return ret;
+  struct client_out *c = &client_out[ps];
+  pthread_mutex_lock(&c->lock);
+  c->replay_from = from;
+  pthread_mutex_unlock(&c->lock);
+  atomic_store(&c->replay_requested, 1);
+  logmsgverbose("Client #%d replaying %llu bytes of history",
+                poll_array[ps].fd, (unsigned long long)
+                (atomic_load(&history.head) - from));
+  return 0;
+}
+
+#if WEBSOCKETS
+// WebSocket clients. The HTTP upgrade request is read and parsed a line
+// at a time as it comes in, and after the handshake the proxy does the
+// framing itself. Packets for the client are framed into an output
+// buffer, one packet per binary frame, or with ?batch in the request URI,
+// as many packets per frame as fit in WS_BATCH_MAX. If the client offers
+// permessage-deflate, and -z gives a compression level, messages are
+// compressed both ways. Messages from the client carry one or more
+// packets, and they go to client_data() one at a time, like the packets
+// from TCP clients.
+#define WS_IN_SIZE     4096 // bytes read ahead, and longest HTTP request
+#define WS_MESSAGE_MAX 16384 // longest message from the client
+#define WS_BATCH_MAX   16384 // payload bytes of a frame, when batching
+#define WS_FRAME_MAX   (WS_BATCH_MAX + 1024) // with header and deflate
+#define WS_OUT_SIZE    65536 // frames framed but not written yet
+#define WS_CONTROL_MAX 125 // payload of a control frame
+
+#define WS_REQUEST_LINE 0 // handshake: waiting for the request line
+#define WS_HEADERS      1 // handshake: waiting for the headers
+#define WS_OPEN         2 // handshake done
+
+#define WS_CONTINUATION 0x0
+#define WS_TEXT         0x1
+#define WS_BINARY       0x2
+#define WS_CLOSE        0x8
+#define WS_PING         0x9
+#define WS_PONG         0xA
+
+int ws_deflate_level = 0; // -z, 0 to not negotiate permessage-deflate
+
+struct websocket {
+  int state;
+  // Handshake
+  size_t parsed; // bytes of 'in' parsed as request lines
+  int get; // the request method is GET
+  char key[64];
+  int upgrade; // Upgrade: websocket
+  int connection; // Connection: upgrade
+  int version; // Sec-WebSocket-Version: 13
+  int batch; // several packets per frame
+  int deflate; // permessage-deflate negotiated
+  int deflate_reset; // server_no_context_takeover
+  int window_bits; // server_max_window_bits
+  // Input: bytes read ahead, the frame being received, and the message
+  uint8_t in[WS_IN_SIZE];
+  size_t in_pos;
+  size_t in_size;
+  int in_header; // 'frame_left' and the rest are set for a frame
+  int frame_fin;
+  int frame_opcode;
+  uint64_t frame_left; // payload bytes still to come
+  uint8_t mask[4];
+  unsigned mask_pos;
+  int message_opcode; // of the message being received, or 0
+  int message_compressed;
+  size_t message_size;
+  uint8_t message[WS_MESSAGE_MAX];
+  uint8_t control[WS_CONTROL_MAX];
+  size_t control_size;
+  uint8_t *data; // packets of the last message, 'message' or 'inflated'
+  size_t data_size;
+  size_t data_pos; // packets already taken
+  uint8_t *inflated;
+  // Output
+  uint8_t *out; // WS_OUT_SIZE, plus room for control frames
+  size_t out_size;
+  size_t out_sent;
+  z_stream zout;
+  z_stream zin;
+};
+
+struct websocket *ws_new(void)
+{
+  struct websocket *ws = calloc(1, sizeof(*ws));
+  if (!ws)
+    return NULL;
+  ws->out = malloc(WS_OUT_SIZE + 4 * (WS_CONTROL_MAX + 4));
+  if (!ws->out) {
+    free(ws);
+    return NULL;
+  }
+  ws->state = WS_REQUEST_LINE;
+  ws->window_bits = 15;
+  return ws;
+}
+
+void ws_free(struct websocket *ws)
+{
+  if (!ws)
+    return;
+  if (ws->inflated) {
+    deflateEnd(&ws->zout);
+    inflateEnd(&ws->zin);
+    free(ws->inflated);
+  }
+  free(ws->out);
+  free(ws);
+}
+
+// Case insensitive comparison of 'len' chars of 's' to 'token'
+int ws_token(const char *s, size_t len, const char *token)
+{
+  return (strlen(token) == len) && (strncasecmp(s, token, len) == 0);
+}
+
+// Whether the comma separated list 'value' has 'token'
+int ws_has_token(const char *value, const char *token)
+{
+  for (const char *p = value; *p; ) {
+    p += strspn(p, " \t,");
+    size_t len = strcspn(p, ",");
+    size_t end = len;
+    while ((end > 0) && ((p[end - 1] == ' ') || (p[end - 1] == '\t')))
+      end--;
+    if (ws_token(p, end, token))
+      return 1;
+    p += len;
+  }
+  return 0;
+}
+
+// Take the first permessage-deflate offer in Sec-WebSocket-Extensions
+// whose parameters can be met
+void ws_extensions(struct websocket *ws, const char *value)
+{
+  for (const char *p = value; *p && !ws->deflate; ) {
+    size_t len = strcspn(p, ",");
+    char offer[256];
+    snprintf(offer, sizeof(offer), "%.*s", (int) len, p);
+    p += len + (p[len] == ',');
+
+    int ok = 1, reset = 0, bits = 15, n = 0;
+    for (char *save, *param = strtok_r(offer, ";", &save); param && ok;
+         param = strtok_r(NULL, ";", &save), n++) {
+      param += strspn(param, " \t");
+      size_t end = strlen(param);
+      while ((end > 0) && ((param[end - 1] == ' ') || (param[end - 1] == '\t')))
+        param[--end] = '\0';
+      char *eq = strchr(param, '=');
+      size_t name = eq ? (size_t) (eq - param) : end;
+      while ((name > 0) && (param[name - 1] == ' '))
+        name--;
+      if (n == 0) {
+        ok = ws_token(param, end, "permessage-deflate");
+      } else if (ws_token(param, name, "server_no_context_takeover")) {
+        reset = 1;
+      } else if (ws_token(param, name, "client_no_context_takeover") ||
+                 ws_token(param, name, "client_max_window_bits")) {
+        // fine either way: replies do not constrain the client
+      } else if (ws_token(param, name, "server_max_window_bits") && eq) {
+        // zlib has no raw deflate with a 256 byte window
+        bits = atoi(eq + 1 + strspn(eq + 1, " \t\""));
+        ok = (bits >= 9) && (bits <= 15);
+      } else {
+        ok = 0;
+      }
+    }
+    if (ok) {
+      ws->deflate = 1;
+      ws->deflate_reset = reset;
+      ws->window_bits = bits;
+    }
+  }
+}
+
+// Parse a request line or header of the handshake
+void ws_request_line(struct websocket *ws, char *line)
+{
+  if (ws->state == WS_REQUEST_LINE) {
+    // GET /path?query HTTP/1.1
+    ws->state = WS_HEADERS;
+    ws->get = (strncmp(line, "GET ", 4) == 0);
+    if (!ws->get)
+      return;
+    char *uri = line + 4;
+    size_t len = strcspn(uri, " ");
+    uri[len] = '\0';
+    char *query = strchr(uri, '?');
+    if (query) {
+      for (char *save, *arg = strtok_r(query + 1, "&", &save); arg;
+           arg = strtok_r(NULL, "&", &save)) {
+        if ((strcmp(arg, "batch") == 0) || (strcmp(arg, "batch=1") == 0))
+          ws->batch = 1;
+      }
+    }
+    return;
+  }
+
+  char *colon = strchr(line, ':');
+  if (!colon)
+    return;
+  size_t name = colon - line;
+  char *value = colon + 1 + strspn(colon + 1, " \t");
+  size_t end = strlen(value);
+  while ((end > 0) && ((value[end - 1] == ' ') || (value[end - 1] == '\t')))
+    value[--end] = '\0';
+
+  if (ws_token(line, name, "Upgrade")) {
+    ws->upgrade = ws_has_token(value, "websocket");
+  } else if (ws_token(line, name, "Connection")) {
+    ws->connection = ws_has_token(value, "upgrade");
+  } else if (ws_token(line, name, "Sec-WebSocket-Key")) {
+    snprintf(ws->key, sizeof(ws->key), "%s", value);
+  } else if (ws_token(line, name, "Sec-WebSocket-Version")) {
+    ws->version = ws_has_token(value, "13");
+  } else if (ws_token(line, name, "Sec-WebSocket-Extensions")) {
+    if (ws_deflate_level > 0)
+      ws_extensions(ws, value);
+  }
+}
+
+// Parse the complete lines of the handshake read so far. Returns 1 once
+// the request is complete, 0 if more is to come, -1 if it cannot be
+// handled.
+int ws_parse_request(struct websocket *ws)
+{
+  for (;;) {
+    char *line = (char*) ws->in + ws->parsed;
+    uint8_t *end = memchr(line, '\n', ws->in_size - ws->parsed);
+    if (!end)
+      return (ws->in_size < WS_IN_SIZE) ? 0 : -1;
+    ws->parsed = end + 1 - ws->in;
+    if ((end > (uint8_t*) line) && (end[-1] == '\r'))
+      end--;
+    if (end == (uint8_t*) line) {
+      if (ws->state != WS_HEADERS)
+        continue; // tolerate empty lines before the request
+      // Keep what came after the request as frame data
+      ws->in_pos = ws->parsed;
+      ws->state = WS_OPEN;
+      return 1;
+    }
+    *end = '\0';
+    ws_request_line(ws, line);
+  }
+}
+
+// Put an HTTP error reply in the output
+void ws_refuse(struct websocket *ws, const char *status)
+{
+  ws->out_size = snprintf((char*) ws->out, WS_OUT_SIZE,
+                          "HTTP/1.1 %s\r\n"
+                          "Sec-WebSocket-Version: 13\r\n"
+                          "Content-Length: 0\r\n"
+                          "Connection: close\r\n\r\n", status);
+}
+
+// Put the handshake reply in the output. Returns 0 on success, -1 if the
+// request was not for a WebSocket we can do.
+int ws_accept(struct websocket *ws)
+{
+  if (!ws->get || !ws->upgrade || !ws->connection || !ws->key[0]) {
+    ws_refuse(ws, "400 Bad Request");
+    return -1;
+  }
+  if (!ws->version) {
+    ws_refuse(ws, "426 Upgrade Required");
+    return -1;
+  }
+
+  SHA_CTX shactx;
+  unsigned char sha_hash[SHA_DIGEST_LENGTH];
+  SHA1_Init(&shactx);
+  SHA1_Update(&shactx, ws->key, strlen(ws->key));
+  SHA1_Update(&shactx, "258EAFA5-E914-47DA-95CA-C5AB0DC85B11", 36);
+  SHA1_Final(sha_hash, &shactx);
+
+  unsigned char hash64[(sizeof(sha_hash)+2)/3*4+1];
+  EVP_EncodeBlock(hash64, sha_hash, sizeof(sha_hash));
+
+  char extensions[128] = "";
+  if (ws->deflate) {
+    ws->inflated = malloc(WS_MESSAGE_MAX);
+    if (!ws->inflated ||
+        (deflateInit2(&ws->zout, ws_deflate_level, Z_DEFLATED,
+                      -ws->window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK)) {
+      free(ws->inflated);
+      ws->inflated = NULL;
+      ws->deflate = 0;
+    } else if (inflateInit2(&ws->zin, -15) != Z_OK) {
+      deflateEnd(&ws->zout);
+      free(ws->inflated);
+      ws->inflated = NULL;
+      ws->deflate = 0;
+    }
+  }
+  if (ws->deflate) {
+    char bits[32] = "";
+    if (ws->window_bits != 15)
+      snprintf(bits, sizeof(bits), "; server_max_window_bits=%d",
+               ws->window_bits);
+    snprintf(extensions, sizeof(extensions),
+             "Sec-WebSocket-Extensions: permessage-deflate%s%s\r\n",
+             ws->deflate_reset ? "; server_no_context_takeover" : "", bits);
+  }
+
+  ws->out_size = snprintf((char*) ws->out, WS_OUT_SIZE,
+                          "HTTP/1.1 101 Switching Protocols\r\n"
+                          "Upgrade: websocket\r\n"
+                          "Connection: Upgrade\r\n"
+                          "Sec-WebSocket-Accept: %s\r\n%s\r\n",
+                          hash64, extensions);
+  return 0;
+}
+
+// Write a frame header at 'p' for a payload of 'size'. Returns its size.
+size_t ws_frame_header(uint8_t *p, int opcode, int compressed, size_t size)
+{
+  p[0] = 0x80 | (compressed ? 0x40 : 0) | opcode;
+  if (size < 126) {
+    p[1] = size;
+    return 2;
+  }
+  if (size < 65536) {
+    p[1] = 126;
+    p[2] = size >> 8;
+    p[3] = size;
+    return 4;
+  }
+  p[1] = 127;
+  for (int i = 0; i < 8; i++)
+    p[2 + i] = (uint64_t) size >> (56 - 8 * i);
+  return 10;
+}
+
+// Frame packets from iov[0..n) into a message at the end of the output,
+// which must have room for WS_FRAME_MAX. Returns how many were taken.
+size_t ws_frame(struct websocket *ws, const struct iovec *iov, size_t n)
+{
+  size_t count = 1;
+  size_t size = iov[0].iov_len;
+  if (ws->batch) {
+    while ((count < n) && ((size + iov[count].iov_len) <= WS_BATCH_MAX))
+      size += iov[count++].iov_len;
+  }
+
+  uint8_t *p = ws->out + ws->out_size;
+  if (!ws->deflate) {
+    size_t h = ws_frame_header(p, WS_BINARY, 0, size);
+    for (size_t i = 0; i < count; i++) {
+      memcpy(p + h, iov[i].iov_base, iov[i].iov_len);
+      h += iov[i].iov_len;
+    }
+    ws->out_size += h;
+    return count;
+  }
+
+  // Compress after room for a 4 byte header (WS_FRAME_MAX < 65536), and
+  // move it back if the header turns out shorter.
+  z_stream *z = &ws->zout;
+  z->next_out = p + 4;
+  z->avail_out = WS_OUT_SIZE - ws->out_size - 4;
+  for (size_t i = 0; i < count; i++) {
+    z->next_in = iov[i].iov_base;
+    z->avail_in = iov[i].iov_len;
+    deflate(z, (i == (count - 1)) ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+  }
+  // The message ends without the 00 00 FF FF of the sync flush
+  size_t zsize = z->next_out - (p + 4) - 4;
+  if (ws->deflate_reset)
+    deflateReset(z);
+  size_t h = ws_frame_header(p, WS_BINARY, 1, zsize);
+  if (h < 4)
+    memmove(p + h, p + 4, zsize);
+  ws->out_size += h + zsize;
+  return count;
+}
+
+// Append a control frame to the output, if there is room left for it
+void ws_control(struct websocket *ws, int opcode, const uint8_t *payload,
+                size_t size)
+{
+  size_t room = WS_OUT_SIZE + 4 * (WS_CONTROL_MAX + 4);
+  if ((ws->out_size + 4 + size) > room)
+    return;
+  size_t h = ws_frame_header(ws->out + ws->out_size, opcode, 0, size);
+  memcpy(ws->out + ws->out_size + h, payload, size);
+  ws->out_size += h + size;
+}
+
+// Frame packets iov[0..n) for the client, and write out as much as the
+// socket takes. Sets '*taken' to the number of packets framed, and adds
+// the bytes written to '*sent'. Returns 0 if all of it went out, 1 if the
+// client has to wait to be writeable, -1 on error.
+int ws_send(struct websocket *ws, int fd, const struct iovec *iov, size_t n,
+            size_t *taken, uint64_t *sent)
+{
+  *taken = 0;
+  for (;;) {
+    while (ws->out_sent < ws->out_size) {
+      ssize_t k = send(fd, ws->out + ws->out_sent,
+                       ws->out_size - ws->out_sent, MSG_NOSIGNAL);
+      if (k < 0)
+        return ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ? 1 : -1;
+      ws->out_sent += k;
+      *sent += k;
+    }
+    ws->out_size = ws->out_sent = 0;
+    if (*taken == n)
+      return 0;
+    while ((*taken < n) && ((WS_OUT_SIZE - ws->out_size) >= WS_FRAME_MAX))
+      *taken += ws_frame(ws, iov + *taken, n - *taken);
+  }
+}
+
+// Done with the frame just received. Returns 1 if a message is complete,
+// 0 if not, -1 if the connection is to be closed.
+int ws_frame_done(struct websocket *ws, int fd, uint64_t *sent)
+{
+  ws->in_header = 0;
+  if (ws->frame_opcode == WS_PING) {
+    ws_control(ws, WS_PONG, ws->control, ws->control_size);
+  } else if (ws->frame_opcode == WS_CLOSE) {
+    ws_control(ws, WS_CLOSE, ws->control, (ws->control_size >= 2) ? 2 : 0);
+  }
+  if (ws->frame_opcode >= WS_CLOSE) {
+    size_t taken;
+    int ret = ws_send(ws, fd, NULL, 0, &taken, sent);
+    if (ws->frame_opcode == WS_CLOSE) {
+      errno = 0;
+      return -1;
+    }
+    return (ret < 0) ? -1 : 0;
+  }
+  if (!ws->frame_fin)
+    return 0;
+
+  ws->data = ws->message;
+  ws->data_size = ws->message_size;
+  ws->data_pos = 0;
+  if (ws->message_compressed) {
+    static const uint8_t tail[4] = { 0x00, 0x00, 0xFF, 0xFF };
+    z_stream *z = &ws->zin;
+    z->next_out = ws->inflated;
+    z->avail_out = WS_MESSAGE_MAX;
+    z->next_in = ws->message;
+    z->avail_in = ws->message_size;
+    int ret = inflate(z, Z_SYNC_FLUSH);
+    if ((ret == Z_OK) || (ret == Z_BUF_ERROR)) {
+      z->next_in = (uint8_t*) tail;
+      z->avail_in = sizeof(tail);
+      ret = inflate(z, Z_SYNC_FLUSH);
+    }
+    if (((ret != Z_OK) && (ret != Z_BUF_ERROR)) || (z->avail_in != 0)) {
+      errno = EPROTO;
+      return -1;
+    }
+    ws->data = ws->inflated;
+    ws->data_size = WS_MESSAGE_MAX - z->avail_out;
+  }
+  ws->message_opcode = 0;
+  ws->message_size = 0;
+  return 1;
+}
+
+// Parse the frames read ahead. Returns 1 once a message is complete, 0 if
+// more input is needed, -1 if the connection is to be closed.
+int ws_parse_frames(struct websocket *ws, int fd, uint64_t *sent)
+{
+  for (;;) {
+    uint8_t *p = ws->in + ws->in_pos;
+    size_t avail = ws->in_size - ws->in_pos;
+
+    if (!ws->in_header) {
+      // Client frames are always masked
+      if (avail < 2)
+        break;
+      size_t len = p[1] & 0x7F;
+      size_t h = 2 + ((len == 126) ? 2 : (len == 127) ? 8 : 0) + 4;
+      if (avail < h)
+        break;
+      uint64_t size = len;
+      if (len == 126) {
+        size = (p[2] << 8) | p[3];
+      } else if (len == 127) {
+        size = 0;
+        for (int i = 0; i < 8; i++)
+          size = (size << 8) | p[2 + i];
+      }
+      int fin = p[0] & 0x80;
+      int rsv = p[0] & 0x70;
+      int opcode = p[0] & 0x0F;
+      int first = (opcode == WS_TEXT) || (opcode == WS_BINARY);
+      errno = EPROTO;
+      if (!(p[1] & 0x80) || (rsv & ~0x40) || (rsv && (!first || !ws->deflate)))
+        return -1;
+      if (size >> 63) // the most significant bit must be 0
+        return -1;
+      if ((opcode > WS_PONG) || ((opcode > WS_BINARY) && (opcode < WS_CLOSE)))
+        return -1;
+      if (opcode >= WS_CLOSE) {
+        if (!fin || (size > WS_CONTROL_MAX))
+          return -1;
+        ws->control_size = 0;
+      } else if (first ? (ws->message_opcode != 0) :
+                 ((opcode != WS_CONTINUATION) || !ws->message_opcode)) {
+        return -1;
+      } else if (size > (WS_MESSAGE_MAX - ws->message_size)) {
+        errno = EMSGSIZE;
+        return -1;
+      } else if (first) {
+        ws->message_opcode = opcode;
+        ws->message_compressed = (rsv != 0);
+      }
+      memcpy(ws->mask, p + h - 4, 4);
+      ws->mask_pos = 0;
+      ws->frame_fin = fin;
+      ws->frame_opcode = opcode;
+      ws->frame_left = size;
+      ws->in_header = 1;
+      ws->in_pos += h;
+      p += h;
+      avail -= h;
+    }
+
+    size_t n = (avail < ws->frame_left) ? avail : ws->frame_left;
+    uint8_t *to = (ws->frame_opcode >= WS_CLOSE) ?
+      ws->control + ws->control_size : ws->message + ws->message_size;
+    for (size_t i = 0; i < n; i++)
+      to[i] = p[i] ^ ws->mask[(ws->mask_pos + i) & 3];
+    ws->mask_pos += n;
+    ws->frame_left -= n;
+    ws->in_pos += n;
+    if (ws->frame_opcode >= WS_CLOSE)
+      ws->control_size += n;
+    else
+      ws->message_size += n;
+    if (ws->frame_left > 0)
+      break;
+    int ret = ws_frame_done(ws, fd, sent);
+    if (ret != 0)
+      return ret;
+  }
+
+  // Keep the start of the next frame for when the rest comes
+  memmove(ws->in, ws->in + ws->in_pos, ws->in_size - ws->in_pos);
+  ws->in_size -= ws->in_pos;
+  ws->in_pos = 0;
+  return 0;
+}
+
+// Like tlrecv(), for a WebSocket client: gets the next packet in the
+// messages from the client. Adds the bytes of control frames written
+// back to '*sent'.
+int ws_recv(struct websocket *ws, int fd, tl_packet *packet, uint64_t *sent)
+{
+  for (;;) {
+    if (ws->data_pos < ws->data_size) {
+      size_t left = ws->data_size - ws->data_pos;
+      uint8_t *p = ws->data + ws->data_pos;
+      if (left >= sizeof(tl_packet_header)) {
+        memcpy(&packet->hdr, p, sizeof(tl_packet_header));
+        size_t size = tl_packet_total_size(&packet->hdr);
+        if ((size <= left) && (size <= sizeof(*packet))) {
+          memcpy(packet, p, size);
+          ws->data_pos += size;
+          return 0;
+        }
+      }
+      ws->data_pos = ws->data_size;
+      errno = EPROTO;
+      return -1;
+    }
+
+    int ret = ws_parse_frames(ws, fd, sent);
+    if (ret < 0)
+      return -1;
+    if (ret > 0)
+      continue;
+    ssize_t n = read(fd, ws->in + ws->in_size, WS_IN_SIZE - ws->in_size);
+    if (n <= 0) {
+      if (n == 0)
+        errno = 0;
+      return -1;
+    }
+    ws->in_size += n;
+  }
+}
+#endif
+
+// Close a client descriptor, whether opened with libtio or not
+void client_close(int fd)
+{
+  if (tlclose(fd) != 0)
+    close(fd);
+}
+
+// Like tlrecv(), for clients
+int client_recv(size_t ps, int fd, tl_packet *packet)
+{
+#if WEBSOCKETS
+  struct client_out *c = &client_out[ps];
+  if (c->ws)
+    return ws_recv(c->ws, fd, packet, &c->sent_bytes);
+#else
+  (void) ps;
+#endif
+  return tlrecv(fd, packet, sizeof(*packet));
+}
+
+// Whether client 'ps' gets packet 'seq' of the ring: returns 0 if it
+// does, 1 if the packet is for another client or not subscribed to, 2 if
+// it is dropped by the slow client policy. Call with the client locked.
+int client_skip(struct client_out *c, size_t ps, uint64_t seq,
+                const struct ring_slot *slot)
+{
+  if (slot->dest >= 0)
+    return ((size_t) slot->dest != ps) ? 1 : 0;
+  const tl_packet_header *hdr = (const tl_packet_header*) slot->data;
+  if (slot->derived) {
+    if (!((c->derived >> (slot->derived - 1)) & 1))
+      return 1;
+  } else if (c->sub && !TYPE_ISSET(c->sub->types[slot->route], hdr->type)) {
+    return 1;
+  }
+  if ((seq >= c->drop_until) || (hdr->type < TL_PTYPE_STREAM0))
+    return 0;
+  if (slow_client_policy == SLOW_DECIMATE) {
+    uint32_t sample; // start_sample of the data stream packet
+    memcpy(&sample, slot->data + sizeof(*hdr), sizeof(sample));
+    if ((sample % slow_client_arg) == 0)
+      return 0;
+  }
+  return 2;
+}
+
+// Update the queue statistics of a client with packets 'c->seq' (pinned)
+// to 'head' pending, and if over the limit choose what to drop. The
+// queued bytes include the packets the client is not subscribed to.
+void client_policy(struct client_out *c, int fd, uint64_t head)
+{
+  const struct ring_slot *last = &ring.slots[(head - 1) & (RING_SIZE - 1)];
+  uint64_t end = last->offset + last->size;
+  c->queued_bytes = end - c->pos + c->partial_size - c->partial_sent;
+  if (c->queued_bytes > c->peak_queued_bytes)
+    c->peak_queued_bytes = c->queued_bytes;
+  if (c->queued_bytes <= client_queue_limit)
+    return;
+
+  if (!c->lagging) {
+    c->lagging = 1;
+    logmsgverbose("Client #%d lagging, %llu bytes queued", fd,
+                  (unsigned long long) c->queued_bytes);
+  }
+  if (slow_client_policy == SLOW_LATEST) {
+    c->drop_until = head - 1;
+  } else if (slow_client_policy == SLOW_DECIMATE) {
+    c->drop_until = head;
+  } else {
+    // Oldest packet that leaves at most client_queue_limit bytes queued
+    uint64_t lo = c->seq, hi = head - 1;
+    while (lo < hi) {
+      uint64_t mid = lo + (hi - lo) / 2;
+      if ((end - ring.slots[mid & (RING_SIZE - 1)].offset) <=
+          client_queue_limit)
+        hi = mid;
+      else
+        lo = mid + 1;
+    }
+    if (lo > c->drop_until)
+      c->drop_until = lo;
+  }
+}
+
+// Whether client 'ps' has not caught up for longer than allowed by the
+// slow client policy. Sets errno to ETIMEDOUT if so.
+int client_lagged_out(size_t ps, int fd)
+{
+  struct client_out *c = &client_out[ps];
+  if ((slow_client_policy != SLOW_DISCONNECT) || (c->lag_start == 0) ||
+      ((monotonic_ms() - c->lag_start) <= slow_client_arg))
+    return 0;
+  logmsg("Client #%d lagging for over %u ms, disconnecting",
+         fd, slow_client_arg);
+  errno = ETIMEDOUT;
+  return 1;
+}
+
+// Log the statistics of a client going away
+void client_report(size_t ps, int fd)
+{
+  struct client_out *c = &client_out[ps];
+  if (c->dropped || verbose)
+    logmsg("Client #%d: %llu bytes sent, %llu packets (%llu bytes) "
+           "dropped, peak queue %llu bytes", fd,
+           (unsigned long long) c->sent_bytes,
+           (unsigned long long) c->dropped,
+           (unsigned long long) c->dropped_bytes,
+           (unsigned long long) c->peak_queued_bytes);
+}
+
+// Write a batch of the history client 'ps' asked for, up to ring packet
+// 'seq' (pinned): the records before the client started, and the ones it
+// missed because the ring lapped it during the replay. Returns 0 once
+// done, 2 if there is more to write, or like client_write_ring() if it
+// has to stop.
+int client_write_history(size_t writer, size_t ps, int fd, uint64_t seq)
+{
+  struct client_out *c = &client_out[ps];
+  uint64_t head = atomic_load_explicit(&history.head, memory_order_acquire);
+  uint64_t offset = history_pin(writer, c->replay);
+  if (offset != c->replay) {
+    logmsgverbose("Client #%d replay overtaken, %llu bytes of history lost",
+                  fd, (unsigned long long) (offset - c->replay));
+    c->replay = offset;
+  }
+
+  struct iovec iov[WRITE_IOV_MAX];
+  uint64_t at[WRITE_IOV_MAX]; // offset of each record in the write
+  size_t n_iov = 0;
+  size_t size = 0;
+  int done = 0;
+  pthread_mutex_lock(&c->lock);
+  for (size_t n = 0; (n_iov < WRITE_IOV_MAX) && (n < 16 * WRITE_IOV_MAX);
+       n++, offset = history_next(offset)) {
+    if (offset == head) {
+      done = 1;
+      break;
+    }
+    struct history_record *rec = history_at(offset);
+    if (rec->size == 0)
+      continue;
+    if (rec->seq >= seq) {
+      done = 1;
+      break;
+    }
+    if (((rec->seq >= c->replay_end) && (rec->seq < c->seq)) ||
+        (c->sub && !TYPE_ISSET(c->sub->types[rec->route], rec->data[0])))
+      continue;
+    iov[n_iov].iov_base = rec->data;
+    iov[n_iov].iov_len = rec->size;
+    at[n_iov] = offset;
+    size += rec->size;
+    n_iov++;
+  }
+  pthread_mutex_unlock(&c->lock);
+
+#if WEBSOCKETS
+  if (c->ws) {
+    size_t taken;
+    int ret = ws_send(c->ws, fd, iov, n_iov, &taken, &c->sent_bytes);
+    c->sent_packets += taken;
+    c->replay = (taken == n_iov) ? offset : at[taken];
+    history_unpin(writer);
+    if (ret != 0)
+      return ret;
+    return done ? 0 : 2;
+  }
+#endif
+
+  ssize_t n = 0;
+  if (n_iov > 0) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n_iov;
+    n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    if (n < 0) {
+      if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+        history_unpin(writer);
+        return -1;
+      }
+      n = 0;
+    }
+  }
+  c->sent_bytes += n;
+  if ((size_t) n == size) {
+    c->sent_packets += n_iov;
+    c->replay = offset;
+    history_unpin(writer);
+    return done ? 0 : 2;
+  }
+
+  // Partial write: keep the rest of the packet it stopped in
+  for (size_t i = 0; ; i++) {
+    if ((size_t) n < iov[i].iov_len) {
+      c->partial_size = iov[i].iov_len - n;
+      c->partial_sent = 0;
+      memcpy(c->partial, (uint8_t*) iov[i].iov_base + n, c->partial_size);
+      c->replay = history_next(at[i]);
+      c->sent_packets += i + 1;
+      break;
+    }
+    n -= iov[i].iov_len;
+  }
+  history_unpin(writer);
+  return 1;
+}
+
+// Write the packets pending for client 'ps' from the ring, see
+// client_write()
+int client_write_ring(size_t writer, size_t ps, int fd)
+{
+  struct client_out *c = &client_out[ps];
+  errno = 0;
+
+#if WEBSOCKETS
+  if (c->ws) {
+    size_t taken;
+    int ret = ws_send(c->ws, fd, NULL, 0, &taken, &c->sent_bytes);
+    if (ret != 0)
+      return ret;
+  }
+#endif
+
+  if (c->partial_sent < c->partial_size) {
+    ssize_t n = send(fd, c->partial + c->partial_sent,
+                     c->partial_size - c->partial_sent, MSG_NOSIGNAL);
+    if (n < 0)
+      return ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ? 1 : -1;
+    c->partial_sent += n;
+    c->sent_bytes += n;
+    if (c->partial_sent < c->partial_size)
+      return 1;
+  }
+
+  if (atomic_exchange(&c->replay_requested, 0)) {
+    pthread_mutex_lock(&c->lock);
+    c->replay = c->replay_from;
+    pthread_mutex_unlock(&c->lock);
+    c->replay_end = c->start_seq;
+    c->replaying = 1;
+  }
+
+  for (;;) {
+    // A client started after the last flush is ahead of it
+    uint64_t head = atomic_load_explicit(&ring.flushed, memory_order_acquire);
+    if ((c->seq >= head) && !c->replaying)
+      return 0;
+    uint64_t seq = ring_pin(writer, c->seq);
+    if (c->replaying) {
+      int ret = client_write_history(writer, ps, fd, seq);
+      if (ret != 0) {
+        ring_unpin(writer);
+        if (ret == 2)
+          continue;
+        return ret;
+      }
+      c->replaying = 0;
+      logmsgverbose("Client #%d replay done", fd);
+      if (c->seq >= head) {
+        ring_unpin(writer);
+        return 0;
+      }
+    }
+    if (seq != c->seq) {
+      uint64_t pos = ring.slots[seq & (RING_SIZE - 1)].offset;
+      logmsgverbose("Client #%d fell behind, %llu packets lost", fd,
+                    (unsigned long long) (seq - c->seq));
+      c->dropped += seq - c->seq;
+      c->dropped_bytes += pos - c->pos;
+      c->seq = seq;
+      c->pos = pos;
+    }
+    client_policy(c, fd, head);
+    histogram_add(&writer_stats[writer].queued_bytes, c->queued_bytes);
+
+    // Packets in the write, with what was dropped before each of them
+    struct iovec iov[WRITE_IOV_MAX];
+    struct {
+      uint64_t seq;
+      uint64_t dropped;
+      uint64_t dropped_bytes;
+    } mark[WRITE_IOV_MAX];
+    size_t n_iov = 0;
+    size_t size = 0;
+    uint64_t end = seq;
+    uint64_t end_pos = c->pos;
+    uint64_t dropped = 0, dropped_bytes = 0;
+    pthread_mutex_lock(&c->lock);
+    for (; (end != head) && (n_iov < WRITE_IOV_MAX); end++) {
+      struct ring_slot *slot = &ring.slots[end & (RING_SIZE - 1)];
+      end_pos += slot->size;
+      int skip = client_skip(c, ps, end, slot);
+      if (skip == 2) {
+        dropped++;
+        dropped_bytes += slot->size;
+      }
+      if (skip)
+        continue;
+      iov[n_iov].iov_base = slot->data;
+      iov[n_iov].iov_len = slot->size;
+      mark[n_iov].seq = end;
+      mark[n_iov].dropped = dropped;
+      mark[n_iov].dropped_bytes = dropped_bytes;
+      size += slot->size;
+      n_iov++;
+    }
+    pthread_mutex_unlock(&c->lock);
+
+#if WEBSOCKETS
+    if (c->ws) {
+      // Framed here, and buffered until the socket takes them
+      size_t taken;
+      int ret = ws_send(c->ws, fd, iov, n_iov, &taken, &c->sent_bytes);
+      c->sent_packets += taken;
+      if (taken == n_iov) {
+        c->seq = end;
+        c->pos = end_pos;
+        c->dropped += dropped;
+        c->dropped_bytes += dropped_bytes;
+      } else {
+        c->seq = mark[taken].seq;
+        c->pos = ring.slots[c->seq & (RING_SIZE - 1)].offset;
+        c->dropped += mark[taken].dropped;
+        c->dropped_bytes += mark[taken].dropped_bytes;
+      }
+      ring_unpin(writer);
+      if (ret != 0)
+        return ret;
+      continue;
+    }
+#endif
+
+    ssize_t n = 0;
+    if (n_iov > 0) {
+      struct msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = iov;
+      msg.msg_iovlen = n_iov;
+      n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+      if (n < 0) {
+        if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+          ring_unpin(writer);
+          return -1;
+        }
+        n = 0; // the first packet goes to the partial buffer
+      }
+    }
+    c->sent_bytes += n;
+    if ((size_t) n == size) {
+      c->sent_packets += n_iov;
+      c->seq = end;
+      c->pos = end_pos;
+      c->dropped += dropped;
+      c->dropped_bytes += dropped_bytes;
+      ring_unpin(writer);
+      continue;
+    }
+
+    // Partial write: skip what went out, and keep the rest of the packet
+    // it stopped in, so that the cursor is always at a packet boundary.
+    for (size_t i = 0; ; i++) {
+      if ((size_t) n < iov[i].iov_len) {
+        c->partial_size = iov[i].iov_len - n;
+        c->partial_sent = 0;
+        memcpy(c->partial, (uint8_t*) iov[i].iov_base + n, c->partial_size);
+        c->seq = mark[i].seq + 1;
+        c->pos = ring.slots[mark[i].seq & (RING_SIZE - 1)].offset +
+          iov[i].iov_len;
+        c->dropped += mark[i].dropped;
+        c->dropped_bytes += mark[i].dropped_bytes;
+        c->sent_packets += i + 1;
+        break;
+      }
+      n -= iov[i].iov_len;
+    }
+    ring_unpin(writer);
+    return 1;
+  }
+}
+
+// Update the statistics of a client for other threads to read
+void client_stats_publish(struct client_out *c)
+{
+  stat_set(&c->stats.packets_out, c->sent_packets);
+  stat_set(&c->stats.bytes_out, c->sent_bytes);
+  stat_set(&c->stats.dropped, c->dropped);
+  stat_set(&c->stats.dropped_bytes, c->dropped_bytes);
+  stat_set(&c->stats.queued_bytes, c->queued_bytes);
+  stat_set(&c->stats.peak_queued_bytes, c->peak_queued_bytes);
+}
+
+// Write what is pending for client 'ps' in the ring to its descriptor
+// 'fd', as writer 'writer'. Returns 0 when done, 1 if the client has to
+// wait to be writeable, -1 if it should be closed.
+int client_write(size_t writer, size_t ps, int fd)
+{
+  struct client_out *c = &client_out[ps];
+  if (client_lagged_out(ps, fd))
+    return -1;
+  int ret = client_write_ring(writer, ps, fd);
+  if (ret == 0) {
+    if (c->lagging)
+      logmsgverbose("Client #%d caught up, %llu packets dropped so far", fd,
+                    (unsigned long long) c->dropped);
+    c->lagging = 0;
+    c->lag_start = 0;
+  } else if ((ret > 0) && (c->lag_start == 0)) {
+    c->lag_start = monotonic_ms();
+  }
+  client_stats_publish(c);
+  return ret;
+}
+
+// Metadata cache. The latest timebase, source and stream packets of each
+// route are kept, so that new clients get them as soon as they connect,
+// and data.send_all can be answered without going to the sensor.
+struct meta_timebase {
+  uint16_t route;
+  tl_timebase_update_packet pkt;
+};
+
+struct meta_source {
+  uint16_t route;
+  tl_source_update_packet pkt;
+};
+
+struct meta_stream {
+  uint16_t route;
+  tl_stream_update_packet pkt;
+};
+
+struct meta_timebase *meta_timebases = NULL;
+size_t n_meta_timebases = 0;
+struct meta_source *meta_sources = NULL;
+size_t n_meta_sources = 0;
+struct meta_stream *meta_streams = NULL;
+size_t n_meta_streams = 0;
+
+struct meta_timebase *meta_timebase(uint16_t route, uint16_t id)
+{
+  for (size_t i = 0; i < n_meta_timebases; i++) {
+    if ((meta_timebases[i].route == route) &&
+        (meta_timebases[i].pkt.info.id == id))
+      return &meta_timebases[i];
+  }
+  return NULL;
+}
+
+struct meta_source *meta_source(uint16_t route, uint16_t id)
+{
+  for (size_t i = 0; i < n_meta_sources; i++) {
+    if ((meta_sources[i].route == route) &&
+        (meta_sources[i].pkt.info.id == id))
+      return &meta_sources[i];
+  }
+  return NULL;
+}
+
+struct meta_stream *meta_stream(uint16_t route, uint16_t id)
+{
+  for (size_t i = 0; i < n_meta_streams; i++) {
+    if ((meta_streams[i].route == route) &&
+        (meta_streams[i].pkt.info.id == id))
+      return &meta_streams[i];
+  }
+  return NULL;
+}
+
+// Grow an array of metadata entries by one, returning the new entry
+void *meta_add(void *array_ptr, size_t *n, size_t size)
+{
+  void **array = array_ptr;
+  void *grown = realloc(*array, (*n + 1) * size);
+  if (!grown)
+    return NULL;
+  *array = grown;
+  return (uint8_t*) grown + (*n)++ * size;
+}
+
+// Whether the metadata of route 'route' is all there: at least a stream,
+// and the sources and timebases it refers to
+int meta_complete(uint16_t route)
+{
+  int n_streams = 0;
+  for (size_t i = 0; i < n_meta_streams; i++) {
+    tl_stream_update_packet *sup = &meta_streams[i].pkt;
+    if (meta_streams[i].route != route)
+      continue;
+    if (!meta_timebase(route, sup->info.timebase_id))
+      return 0;
+    for (size_t j = 0; j < sup->info.total_components; j++) {
+      struct meta_source *src = meta_source(route,
+                                            sup->component[j].source_id);
+      if (!src || !meta_timebase(route, src->pkt.info.timebase_id))
+        return 0;
+    }
+    n_streams++;
+  }
+  return n_streams > 0;
+}
+
+// Send client 'ps' the cached metadata of route 'route', or of all the
+// routes if -1. Timebases go first, then the sources, then the streams,
+// like a sensor sends them.
+void meta_replay(size_t ps, int route)
+{
+  for (size_t i = 0; i < n_meta_timebases; i++) {
+    if ((route < 0) || (meta_timebases[i].route == route))
+      ring_publish(ps, (tl_packet*) &meta_timebases[i].pkt);
+  }
+  for (size_t i = 0; i < n_meta_sources; i++) {
+    if ((route < 0) || (meta_sources[i].route == route))
+      ring_publish(ps, (tl_packet*) &meta_sources[i].pkt);
+  }
+  for (size_t i = 0; i < n_meta_streams; i++) {
+    if ((route < 0) || (meta_streams[i].route == route))
+      ring_publish(ps, (tl_packet*) &meta_streams[i].pkt);
+  }
+}
+
+// Whether route 'id' goes through sensor 'sensor'
+int route_via_sensor(uint16_t id, int sensor)
+{
+  if (sensor_mode != SENSOR_MODE_HUB)
+    return 1;
+  // the sensor index is the last hop added, at the end of the routing
+  return (id < n_routes) && (routes[id].size > 0) &&
+    (routes[id].routing[routes[id].size - 1] == sensor);
+}
+
+// Remove an entry from a metadata array, moving the last one in its place
+void meta_remove(void *array, size_t *n, size_t size, size_t i)
+{
+  uint8_t *base = array;
+  if (i != --(*n))
+    memcpy(base + i * size, base + *n * size, size);
+}
+
+// Forget the metadata of the routes through sensor 'sensor', which may
+// well be a different device once it reconnects
+void meta_forget(int sensor)
+{
+  for (size_t i = n_meta_timebases; i-- > 0;) {
+    if (route_via_sensor(meta_timebases[i].route, sensor))
+      meta_remove(meta_timebases, &n_meta_timebases,
+                  sizeof(*meta_timebases), i);
+  }
+  for (size_t i = n_meta_sources; i-- > 0;) {
+    if (route_via_sensor(meta_sources[i].route, sensor))
+      meta_remove(meta_sources, &n_meta_sources, sizeof(*meta_sources), i);
+  }
+  for (size_t i = n_meta_streams; i-- > 0;) {
+    if (route_via_sensor(meta_streams[i].route, sensor))
+      meta_remove(meta_streams, &n_meta_streams, sizeof(*meta_streams), i);
+  }
+}
+
+// Derived streams (proxy.derive). Using the cached metadata, the proxy
+// can reduce a data stream to a lower rate: every Nth sample (decimate),
+// or the mean, minimum or maximum of each block of N samples. Each
+// reduction is computed once however many clients ask for it, and
+// published as a stream of the same route with an id the route does not
+// use, to those clients only. A reduced sample has the components the
+// first sample of its block has; components sampled less often than every
+// N samples are just decimated.
+#define MAX_DERIVED 64 // fits the bitmap in client_out
+
+#define DERIVE_DECIMATE 0
+#define DERIVE_MEAN     1
+#define DERIVE_MIN      2
+#define DERIVE_MAX      3
+
+const char *derive_modes[] = { "decimate", "mean", "min", "max" };
+
+struct derived_value {
+  uint8_t type;
+  uint32_t period; // of its component, in input samples
+  uint32_t count; // values in the current block
+  double sum;
+  double best; // minimum or maximum so far
+  uint8_t best_raw[8];
+};
+
+struct derived {
+  size_t n_clients; // 0 if the entry is free
+  uint16_t route;
+  uint8_t stream; // input stream id
+  uint8_t id; // output stream id
+  int mode;
+  uint32_t factor;
+  uint64_t sample; // last input sample number, unwrapped
+  uint64_t block; // output sample being computed
+  int pending; // values accumulated for 'block'
+  size_t n_values; // 0 if the metadata is incomplete
+  struct derived_value *values;
+};
+
+struct derived derived[MAX_DERIVED];
+size_t n_derived = 0; // in use
+
+double value_decode(const uint8_t *raw, uint8_t type)
+{
+  union { uint8_t u8; int8_t i8; uint16_t u16; int16_t i16; uint32_t u32;
+          int32_t i32; uint64_t u64; int64_t i64; float f32; double f64; } v;
+  memcpy(&v, raw, tl_data_type_size(type));
+  switch (type) {
+   case TL_DATA_TYPE_UINT8: return v.u8;
+   case TL_DATA_TYPE_INT8: return v.i8;
+   case TL_DATA_TYPE_UINT16: return v.u16;
+   case TL_DATA_TYPE_INT16: return v.i16;
+   case TL_DATA_TYPE_UINT24: return raw[0] | (raw[1] << 8) | (raw[2] << 16);
+   case TL_DATA_TYPE_INT24:
+    return (int32_t) ((raw[0] << 8) | (raw[1] << 16) |
+                      ((uint32_t) raw[2] << 24)) >> 8;
+   case TL_DATA_TYPE_UINT32: return v.u32;
+   case TL_DATA_TYPE_INT32: return v.i32;
+   case TL_DATA_TYPE_UINT64: return v.u64;
+   case TL_DATA_TYPE_INT64: return v.i64;
+   case TL_DATA_TYPE_FLOAT32: return v.f32;
+   default: return v.f64;
+  }
+}
+
+// Store 'val' as 'type', rounding to the nearest integer if needed
+void value_encode(uint8_t *raw, uint8_t type, double val)
+{
+  size_t size = tl_data_type_size(type);
+  if (type == TL_DATA_TYPE_FLOAT32) {
+    float f = val;
+    memcpy(raw, &f, size);
+  } else if (type == TL_DATA_TYPE_FLOAT64) {
+    memcpy(raw, &val, size);
+  } else {
+    // little endian, and 24 bit types are the low bytes of 32 bit ones
+    uint64_t u;
+    if (type & 1)
+      u = (int64_t) (val + ((val < 0) ? -0.5 : 0.5));
+    else
+      u = val + 0.5;
+    for (size_t i = 0; i < size; i++, u >>= 8)
+      raw[i] = u;
+  }
+}
+
+// Set up the values of a derived stream from the metadata of its input
+// stream. Leaves it without values if the metadata is not all there.
+void derived_layout(struct derived *d)
+{
+  free(d->values);
+  d->values = NULL;
+  d->n_values = 0;
+  d->pending = 0;
+  struct meta_stream *ms = meta_stream(d->route, d->stream);
+  if (!ms)
+    return;
+  d->sample = ms->pkt.info.sample_number;
+
+  size_t n = 0;
+  for (size_t i = 0; i < ms->pkt.info.total_components; i++) {
+    struct meta_source *src =
+      meta_source(d->route, ms->pkt.component[i].source_id);
+    if (!src || (tl_data_type_size(src->pkt.info.type) == 0))
+      return;
+    n += src->pkt.info.channels;
+  }
+  d->values = calloc(n ? n : 1, sizeof(*d->values));
+  if (!d->values)
+    return;
+  n = 0;
+  for (size_t i = 0; i < ms->pkt.info.total_components; i++) {
+    const tl_stream_component_info *comp = &ms->pkt.component[i];
+    struct meta_source *src = meta_source(d->route, comp->source_id);
+    for (size_t ch = 0; ch < src->pkt.info.channels; ch++, n++) {
+      d->values[n].type = src->pkt.info.type;
+      d->values[n].period = comp->period ? comp->period : 1;
+    }
+  }
+  d->n_values = n;
+}
+
+uint32_t gcd(uint32_t a, uint32_t b)
+{
+  while (b) {
+    uint32_t t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+// Publish the metadata of a derived stream to client 'dest', or to all of
+// its clients if -1
+void derived_metadata(struct derived *d, int32_t dest)
+{
+  struct meta_stream *ms = meta_stream(d->route, d->stream);
+  if (!ms || (d->n_values == 0))
+    return;
+  tl_stream_update_packet pkt;
+  size_t size = tl_packet_total_size(&ms->pkt.hdr);
+  memcpy(&pkt, &ms->pkt, size);
+  pkt.info.id = d->id;
+  pkt.info.period *= d->factor;
+  pkt.info.sample_number /= d->factor;
+  for (size_t i = 0; i < pkt.info.total_components; i++) {
+    uint32_t period = pkt.component[i].period ? pkt.component[i].period : 1;
+    pkt.component[i].period = period / gcd(period, d->factor);
+  }
+  ring_publish_derived(dest, d - derived + 1, (tl_packet*) &pkt);
+}
+
+// Publish the reduced sample of the current block
+void derived_emit(struct derived *d)
+{
+  d->pending = 0;
+  uint64_t first = d->block * d->factor;
+  tl_data_stream_packet out;
+  uint8_t *p = out.data;
+  int complete = 1;
+  for (size_t i = 0; i < d->n_values; i++) {
+    struct derived_value *v = &d->values[i];
+    if ((first % v->period) != 0)
+      continue;
+    if (v->count == 0)
+      complete = 0; // lost input packets
+    else if (d->mode == DERIVE_MEAN)
+      value_encode(p, v->type, v->sum / v->count);
+    else
+      memcpy(p, v->best_raw, tl_data_type_size(v->type));
+    p += tl_data_type_size(v->type);
+    v->count = 0;
+    v->sum = 0;
+  }
+  if (!complete)
+    return;
+
+  const struct route *r = &routes[d->route];
+  out.hdr.type = TL_PTYPE_STREAM0 + d->id;
+  out.hdr.routing_size_and_ttl = 0;
+  out.hdr.payload_size = sizeof(out.start_sample) + (p - out.data);
+  out.start_sample = d->block;
+  tl_packet_set_routing_size(&out.hdr, r->size);
+  memcpy(tl_packet_routing_data(&out.hdr), r->routing, r->size);
+  ring_publish_derived(-1, d - derived + 1, (tl_packet*) &out);
+}
+
+// Feed a data packet of route 'route' to the derived streams using it
+void derived_data(uint16_t route, tl_packet *packet)
+{
+  uint8_t stream = packet->hdr.type - TL_PTYPE_STREAM0;
+  tl_data_stream_packet *dp = (tl_data_stream_packet*) packet;
+  if (packet->hdr.payload_size < sizeof(dp->start_sample))
+    return;
+  size_t size = packet->hdr.payload_size - sizeof(dp->start_sample);
+
+  for (size_t k = 0; k < MAX_DERIVED; k++) {
+    struct derived *d = &derived[k];
+    if ((d->n_clients == 0) || (d->n_values == 0) || (d->route != route) ||
+        (d->stream != stream))
+      continue;
+    // Unwrap the sample number, as the nearest to the last one
+    int32_t delta = dp->start_sample - (uint32_t) d->sample;
+    if ((delta >= 0) || ((uint64_t) -(int64_t) delta <= d->sample))
+      d->sample += delta;
+    uint64_t s = d->sample;
+    uint64_t block = s / d->factor;
+
+    if (d->mode == DERIVE_DECIMATE) {
+      if ((s % d->factor) != 0)
+        continue;
+      tl_packet out;
+      memcpy(&out, packet, tl_packet_total_size(&packet->hdr));
+      out.hdr.type = TL_PTYPE_STREAM0 + d->id;
+      ((tl_data_stream_packet*) &out)->start_sample = block;
+      ring_publish_derived(-1, k + 1, &out);
+      continue;
+    }
+
+    if (d->pending && (block != d->block))
+      derived_emit(d);
+    if (!d->pending && ((s % d->factor) != 0))
+      continue; // only whole blocks
+    d->block = block;
+    const uint8_t *raw = dp->data;
+    const uint8_t *end = dp->data + size;
+    uint64_t first = block * d->factor;
+    for (size_t i = 0; i < d->n_values; i++) {
+      struct derived_value *v = &d->values[i];
+      if ((s % v->period) != 0)
+        continue;
+      size_t vsize = tl_data_type_size(v->type);
+      if ((raw + vsize) > end)
+        break; // does not match the metadata
+      if ((first % v->period) == 0) {
+        double val = value_decode(raw, v->type);
+        if ((v->count == 0) ||
+            ((d->mode == DERIVE_MIN) && (val < v->best)) ||
+            ((d->mode == DERIVE_MAX) && (val > v->best))) {
+          v->best = val;
+          memcpy(v->best_raw, raw, vsize);
+        }
+        v->sum += val;
+        v->count++;
+      }
+      raw += vsize;
+    }
+    d->pending = 1;
+    if ((s % d->factor) == (d->factor - 1))
+      derived_emit(d);
+  }
+}
+
+// Keep track of a metadata packet of a sensor. Routes past MAX_ROUTES
+// have no id of their own, so their metadata is not cached.
+void meta_update(tl_packet *packet)
+{
+  uint16_t route = route_lookup(tl_packet_routing_data(&packet->hdr),
+                                tl_packet_routing_size(&packet->hdr));
+  if (route == MAX_ROUTES)
+    return;
+  size_t size = packet->hdr.payload_size;
+  size_t total_size = tl_packet_total_size(&packet->hdr);
+  int stream = -1;
+
+  if (packet->hdr.type == TL_PTYPE_TIMEBASE) {
+    tl_timebase_update_packet *tup = (tl_timebase_update_packet*) packet;
+    if ((size < sizeof(tup->info)) || (total_size > sizeof(*tup)))
+      return;
+    struct meta_timebase *tb = meta_timebase(route, tup->info.id);
+    if (!tb && (tb = meta_add(&meta_timebases, &n_meta_timebases,
+                              sizeof(*tb))))
+      tb->route = route;
+    if (tb)
+      memcpy(&tb->pkt, tup, total_size);
+  } else if (packet->hdr.type == TL_PTYPE_SOURCE) {
+    tl_source_update_packet *sup = (tl_source_update_packet*) packet;
+    if ((size < sizeof(sup->info)) || (total_size > sizeof(*sup)))
+      return;
+    struct meta_source *src = meta_source(route, sup->info.id);
+    if (!src && (src = meta_add(&meta_sources, &n_meta_sources,
+                                sizeof(*src))))
+      src->route = route;
+    if (src)
+      memcpy(&src->pkt, sup, total_size);
+  } else if (packet->hdr.type == TL_PTYPE_STREAM) {
+    tl_stream_update_packet *sup = (tl_stream_update_packet*) packet;
+    if ((size < sizeof(sup->info)) ||
+        (size < (sizeof(sup->info) + sup->info.total_components *
+                 sizeof(sup->component[0]))) ||
+        (total_size > sizeof(*sup)) ||
+        (sup->info.flags & TL_STREAM_ONLY_INFO))
+      return;
+    struct meta_stream *ms = meta_stream(route, sup->info.id);
+    if (!ms && (ms = meta_add(&meta_streams, &n_meta_streams, sizeof(*ms))))
+      ms->route = route;
+    if (!ms)
+      return;
+    memcpy(&ms->pkt, sup, total_size);
+    stream = sup->info.id;
+  }
+
+  // Update the derived streams it affects
+  for (size_t k = 0; k < MAX_DERIVED; k++) {
+    struct derived *d = &derived[k];
+    if ((d->n_clients == 0) || (d->route != route))
+      continue;
+    if ((stream < 0) && (d->n_values != 0))
+      continue; // complete already, a source is unlikely to change
+    derived_layout(d);
+    if ((stream < 0) || (stream == d->stream))
+      derived_metadata(d, -1);
+  }
+}
+
+// Parse "ROUTE STREAM MODE FACTOR", where FACTOR is the number of input
+// samples per output sample, or a rate if followed by Hz. Returns the
+// derived stream it describes, in 'key' without allocating it, or an RPC
+// error code.
+int derive_parse(const char *spec, size_t len, struct derived *key)
+{
+  char buf[128], route[64], mode[16], factor[32];
+  unsigned stream;
+  if (len >= sizeof(buf))
+    return TL_RPC_ERROR_INVALID;
+  memcpy(buf, spec, len);
+  buf[len] = '\0';
+  if (sscanf(buf, "%63s %u %15s %31s", route, &stream, mode, factor) != 4)
+    return TL_RPC_ERROR_INVALID;
+
+  uint8_t routing[TL_PACKET_MAX_ROUTING_SIZE];
+  int routing_size = tl_parse_routing(routing, route);
+  if ((routing_size < 0) || (stream >= 128))
+    return TL_RPC_ERROR_INVALID;
+  memset(key, 0, sizeof(*key));
+  key->route = route_lookup(routing, routing_size);
+  key->stream = stream;
+  key->mode = -1;
+  for (size_t i = 0; i < sizeof(derive_modes) / sizeof(*derive_modes); i++) {
+    if (strcmp(mode, derive_modes[i]) == 0)
+      key->mode = i;
+  }
+  if (key->mode < 0)
+    return TL_RPC_ERROR_INVALID;
+
+  // Only routes the sensors sent packets from, with an id of their own
+  if (key->route == MAX_ROUTES)
+    return TL_RPC_ERROR_NOTFOUND;
+  struct meta_stream *ms = meta_stream(key->route, stream);
+  if (!ms)
+    return TL_RPC_ERROR_NOTFOUND;
+
+  char *end;
+  double val = strtod(factor, &end);
+  if ((val <= 0) || ((*end != '\0') && (strcmp(end, "Hz") != 0)))
+    return TL_RPC_ERROR_INVALID;
+  if (*end != '\0') {
+    // Rate of the input stream, the way tio-logparse works it out
+    struct meta_timebase *tb = meta_timebase(key->route,
+                                             ms->pkt.info.timebase_id);
+    if (!tb || (tb->pkt.info.period_num_us == 0) || (ms->pkt.info.period == 0))
+      return TL_RPC_ERROR_NOTFOUND;
+    double sps = 1e6 * tb->pkt.info.period_denom_us /
+      tb->pkt.info.period_num_us / ms->pkt.info.period;
+    val = sps / val;
+  }
+  key->factor = (val < 1.5) ? 1 : (val > UINT32_MAX) ? UINT32_MAX :
+    (uint32_t) (val + 0.5);
+  return 0;
+}
+
+// Start sending client 'ps' the derived stream described by 'spec'.
+// Returns its stream id, or the negated RPC error code.
+int derived_request(size_t ps, const char *spec, size_t len)
+{
+  struct derived key;
+  int ret = derive_parse(spec, len, &key);
+  if (ret != 0)
+    return -ret;
+
+  size_t k, free_k = MAX_DERIVED;
+  for (k = 0; k < MAX_DERIVED; k++) {
+    struct derived *d = &derived[k];
+    if (d->n_clients == 0) {
+      if (free_k == MAX_DERIVED)
+        free_k = k;
+    } else if ((d->route == key.route) && (d->stream == key.stream) &&
+               (d->mode == key.mode) && (d->factor == key.factor)) {
+      break;
+    }
+  }
+
+  struct client_out *c = &client_out[ps];
+  struct derived *d = &derived[k];
+  if (k == MAX_DERIVED) {
+    if (free_k == MAX_DERIVED)
+      return -TL_RPC_ERROR_BUSY;
+    // New one: pick the highest stream id the route does not use
+    d = &derived[free_k];
+    *d = key;
+    for (int id = 127; id >= 0; id--) {
+      int used = (meta_stream(key.route, id) != NULL);
+      for (size_t j = 0; (j < MAX_DERIVED) && !used; j++) {
+        used = (derived[j].n_clients > 0) && (derived[j].route == key.route) &&
+          (derived[j].id == id);
+      }
+      if (!used) {
+        d->id = id;
+        break;
+      }
+      if (id == 0)
+        return -TL_RPC_ERROR_BUSY;
+    }
+    derived_layout(d);
+    if (d->n_values == 0) {
+      free(d->values);
+      d->values = NULL;
+      return -TL_RPC_ERROR_NOTFOUND;
+    }
+    n_derived++;
+    logmsgverbose("Derived stream %s %u of route %u: %u %s",
+                  derive_modes[d->mode], d->stream, d->route, d->factor,
+                  d->mode == DERIVE_DECIMATE ? "x" : "samples");
+  }
+
+  if (!((c->derived >> (d - derived)) & 1)) {
+    d->n_clients++;
+    pthread_mutex_lock(&c->lock);
+    c->derived |= 1ull << (d - derived);
+    pthread_mutex_unlock(&c->lock);
+  }
+  derived_metadata(d, ps);
+  return d->id;
+}
+
+void derived_release(size_t k)
+{
+  struct derived *d = &derived[k];
+  if (--d->n_clients > 0)
+    return;
+  free(d->values);
+  d->values = NULL;
+  n_derived--;
+}
+
+// Stop sending client 'ps' the derived stream described by 'spec'.
+// Returns 0 or the RPC error code.
+int derived_cancel(size_t ps, const char *spec, size_t len)
+{
+  struct derived key;
+  int ret = derive_parse(spec, len, &key);
+  if (ret != 0)
+    return ret;
+  struct client_out *c = &client_out[ps];
+  for (size_t k = 0; k < MAX_DERIVED; k++) {
+    struct derived *d = &derived[k];
+    if (((c->derived >> k) & 1) && (d->route == key.route) &&
+        (d->stream == key.stream) && (d->mode == key.mode) &&
+        (d->factor == key.factor)) {
+      pthread_mutex_lock(&c->lock);
+      c->derived &= ~(1ull << k);
+      pthread_mutex_unlock(&c->lock);
+      derived_release(k);
+      return 0;
+    }
+  }
+  return TL_RPC_ERROR_NOTFOUND;
+}
+
+// Threaded fan-out (-W). The main thread publishes the sensor packets for
+// clients into the ring, and never waits for the writer threads. Each
+// writer owns the clients whose poll_array index modulo the number of
+// writers is its id, and does all the I/O on them: it writes them the
+// packets from the ring, and passes the packets they send back to the main
+// thread, which keeps sole ownership of the sensors and of the RPC
+// remapping. Without writer threads, the main thread writes to the clients.
+#define QUEUE_SIZE 1024 // messages to and from each writer, power of two
+
+#define WORKER_ATTACH  0 // to writer: take over client
+#define WORKER_DETACH  1 // to writer: close client
+#define WORKER_PACKET  2 // from writer: packet sent by client
+#define WORKER_CLOSED  3 // from writer: client was closed
+
+struct worker_msg {
+  int type;
+  int32_t client; // index in poll_array
+  int fd;
+  tl_packet packet;
+};
+
+// Single producer, single consumer queue of messages
+struct msg_queue {
+  struct worker_msg *msgs;
+  size_t size; // power of two
+  atomic_size_t head;
+  atomic_size_t tail;
+};
+
+struct worker {
+  pthread_t thread;
+  size_t id;
+  int wake_pipe[2];
+  atomic_int sleeping;
+  struct msg_queue control; // from the main thread
+  struct msg_queue inbound; // to the main thread
+  struct event_loop loop; // entry 0 is the wake pipe, then the clients
+  size_t n_fds;
+  int32_t *client; // poll_array index of each entry, -1 once reported closed
+  int32_t *entry; // entry of each poll_array index, or -1
+  uint64_t written; // ring packets already written out
+};
+
+size_t n_workers = 0;
+struct worker *workers = NULL;
+atomic_int workers_stop;
+int main_wake_pipe[2];
+atomic_int main_wake_pending;
+
+int queue_init(struct msg_queue *q, size_t size)
+{
+  q->msgs = calloc(size, sizeof(struct worker_msg));
+  q->size = size;
+  atomic_init(&q->head, 0);
+  atomic_init(&q->tail, 0);
+  return q->msgs ? 0 : -1;
+}
+
+struct worker_msg *queue_reserve(struct msg_queue *q)
+{
+  size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+  if ((head - tail) >= q->size)
+    return NULL;
+  return &q->msgs[head & (q->size - 1)];
+}
+
+void queue_commit(struct msg_queue *q)
+{
+  size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+  atomic_store_explicit(&q->head, head + 1, memory_order_release);
+}
+
+struct worker_msg *queue_peek(struct msg_queue *q)
+{
+  size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+  if (head == tail)
+    return NULL;
+  return &q->msgs[tail & (q->size - 1)];
+}
+
+void queue_pop(struct msg_queue *q)
+{
+  size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+}
+
+void wake_main_thread(void)
+{
+  if (!atomic_exchange(&main_wake_pending, 1)) {
+    if (write(main_wake_pipe[1], "", 1) < 0) {
+      // pipe full: the main thread has plenty of wakeups pending
+    }
+  }
+}
+
+// Close a writer's client. It is reported to the main thread, and the
+// entry removed, by worker_compact()
+void worker_close(struct worker *w, size_t i)
+{
+  int fd = w->loop.fds[i].fd;
+  w->loop.fds[i].fd = -1;
+  event_update(&w->loop, i);
+  client_close(fd);
+  w->entry[w->client[i]] = -1;
+  client_report(w->client[i], fd);
+  logmsgverbose("Disconnected client #%d", fd);
+}
+
+// Report closed clients and remove their entries. Returns the number of
+// clients reported
+int worker_compact(struct worker *w)
+{
+  int reported = 0;
+  for (size_t i = 1; i < w->n_fds;) {
+    if (w->loop.fds[i].fd >= 0) {
+      i++;
+      continue;
+    }
+    if (w->client[i] >= 0) {
+      struct worker_msg *m = queue_reserve(&w->inbound);
+      if (!m) {
+        // main thread busy, try again on the next iteration
+        i++;
+        continue;
+      }
+      m->type = WORKER_CLOSED;
+      m->client = w->client[i];
+      queue_commit(&w->inbound);
+      reported++;
+    }
+    size_t last = --w->n_fds;
+    if (last != i) {
+      event_move(&w->loop, last, i);
+      w->client[i] = w->client[last];
+      if (w->loop.fds[i].fd >= 0)
+        w->entry[w->client[i]] = i;
+    }
+  }
+  return reported;
+}
+
+// Handle messages from the main thread
+void worker_control(struct worker *w)
+{
+  for (struct worker_msg *m; (m = queue_peek(&w->control));
+       queue_pop(&w->control)) {
+    if (m->type == WORKER_ATTACH) {
+      size_t i = w->n_fds++;
+      w->loop.fds[i].fd = m->fd;
+      w->loop.fds[i].events = POLLIN;
+      w->client[i] = m->client;
+      w->entry[m->client] = i;
+      if (event_update(&w->loop, i) != 0) {
+        logmsg("Failed to set up client #%d in writer thread: %s",
+               m->fd, strerror(errno));
+        worker_close(w, i);
+      }
+      w->written = 0; // make sure it gets what is pending
+    } else if (m->type == WORKER_DETACH) {
+      int32_t i = w->entry[m->client];
+      if (i >= 0)
+        worker_close(w, i);
+    }
+  }
+}
+
+// Write to a client, and set it up to wait if needed
+void worker_write(struct worker *w, size_t i)
+{
+  int fd = w->loop.fds[i].fd;
+  int ret = client_write(w->id, w->client[i], fd);
+  if (ret < 0) {
+    if ((errno != EPIPE) && (errno != ECONNRESET) && (errno != ETIMEDOUT))
+      logmsg("Failed to send sensor packet to client #%d [%s]",
+             fd, strerror(errno));
+    worker_close(w, i);
+  } else if (ret > 0) {
+    client_out[w->client[i]].blocked = 1;
+    event_pollout(&w->loop, i, 1);
+  }
+}
+
+// Handle events on a client. Returns 1 if packets were passed to the main
+// thread.
+int worker_io(struct worker *w, size_t i)
+{
+  struct pollfd *pfd = &w->loop.fds[i];
+  int fd = pfd->fd;
+  errno = 0;
+  if (pfd->revents & POLLERR) {
+    worker_close(w, i);
+    return 0;
+  }
+
+  if (pfd->revents & POLLOUT) {
+    event_pollout(&w->loop, i, 0);
+    client_out[w->client[i]].blocked = 0;
+    worker_write(w, i);
+    if (pfd->fd < 0)
+      return 0;
+  }
+
+  int passed = 0;
+  if (pfd->revents & POLLIN) {
+    for (;;) {
+      struct worker_msg *m = queue_reserve(&w->inbound);
+      tl_packet discard;
+      errno = 0;
+      if (client_recv(w->client[i], fd, m ? &m->packet : &discard) < 0) {
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+          break;
+        if (errno == 0)
+          logmsgverbose("Detected client #%d disconnect", fd);
+        worker_close(w, i);
+        break;
+      }
+      if (!m) {
+        stat_add(&writer_stats[w->id].dropped_in, 1);
+        logmsg("Packet dropped from client #%d, main thread busy", fd);
+        continue;
+      }
+      m->type = WORKER_PACKET;
+      m->client = w->client[i];
+      queue_commit(&w->inbound);
+      passed = 1;
+    }
+  }
+  return passed;
+}
+
+void *worker_thread(void *arg)
+{
+  struct worker *w = arg;
+  while (!atomic_load(&workers_stop)) {
+    int passed = worker_compact(w);
+    worker_control(w);
+    uint64_t head = atomic_load_explicit(&ring.flushed, memory_order_acquire);
+    if (head != w->written) {
+      for (size_t i = 1; i < w->n_fds; i++) {
+        if ((w->loop.fds[i].fd >= 0) && !client_out[w->client[i]].blocked)
+          worker_write(w, i);
+      }
+      w->written = head;
+    }
+    if (slow_client_policy == SLOW_DISCONNECT) {
+      for (size_t i = 1; i < w->n_fds; i++) {
+        int fd = w->loop.fds[i].fd;
+        if ((fd >= 0) && client_out[w->client[i]].blocked &&
+            client_lagged_out(w->client[i], fd))
+          worker_close(w, i);
+      }
+    }
+
+    // Sleep, unless something came in since looking. Pairs with
+    // wake_workers().
+    atomic_store(&w->sleeping, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    int timeout = 100;
+    if ((atomic_load(&ring.flushed) != w->written) ||
+        queue_peek(&w->control))
+      timeout = 0;
+    int n_events = event_wait(&w->loop, w->n_fds, timeout, NULL);
+    atomic_store(&w->sleeping, 0);
+
+    for (int k = 0; k < n_events; k++) {
+      size_t i = w->loop.ready[k];
+      if (i == 0) {
+        char buf[64];
+        while (read(w->wake_pipe[0], buf, sizeof(buf)) > 0);
+      } else if (w->loop.fds[i].fd >= 0) {
+        passed |= worker_io(w, i);
+      }
+    }
+    if (passed)
+      wake_main_thread();
+  }
+
+  // Give clients about a second to take what was already sent to them
+  for (int n = 0; n < 20; n++, usleep(50000)) {
+    size_t left = 0;
+    for (size_t i = 1; i < w->n_fds; i++) {
+      int fd = w->loop.fds[i].fd;
+      if (fd < 0)
+        continue;
+      if (client_write(w->id, w->client[i], fd) == 1) {
+        left++;
+      } else {
+        client_close(fd);
+        w->loop.fds[i].fd = -1;
+      }
+    }
+    if (left == 0)
+      break;
+  }
+  return NULL;
+}
+
+int workers_init(size_t max_clients)
+{
+  workers = calloc(n_workers, sizeof(*workers));
+  if (!workers)
+    return -1;
+  atomic_init(&workers_stop, 0);
+
+  for (size_t id = 0; id < n_workers; id++) {
+    struct worker *w = &workers[id];
+    w->id = id;
+    atomic_init(&w->sleeping, 0);
+    if ((pipe(w->wake_pipe) != 0) ||
+        (set_nonblock_cloexec(w->wake_pipe[0]) != 0) ||
+        (set_nonblock_cloexec(w->wake_pipe[1]) != 0))
+      return -1;
+    struct pollfd *fds = calloc(max_clients + 1, sizeof(*fds));
+    w->client = calloc(max_clients + 1, sizeof(*w->client));
+    w->entry = malloc(max_descriptors * sizeof(*w->entry));
+    if ((queue_init(&w->control, QUEUE_SIZE) != 0) ||
+        (queue_init(&w->inbound, QUEUE_SIZE) != 0) || !fds || !w->client ||
+        !w->entry || (event_init(&w->loop, fds, max_clients + 1) != 0))
+      return -1;
+    for (size_t i = 0; i < max_descriptors; i++)
+      w->entry[i] = -1;
+    fds[0].fd = w->wake_pipe[0];
+    fds[0].events = POLLIN;
+    if (event_update(&w->loop, 0) != 0)
+      return -1;
+    w->n_fds = 1;
+  }
+
+  for (size_t id = 0; id < n_workers; id++) {
+    errno = pthread_create(&workers[id].thread, NULL, worker_thread,
+                           &workers[id]);
+    if (errno != 0)
+      return -1;
+  }
+  return 0;
+}
+
+// Queue a message for the writer of client 'ps'
+void worker_message(size_t ps, int type)
+{
+  struct worker *w = &workers[ps % n_workers];
+  struct worker_msg *m;
+  while (!(m = queue_reserve(&w->control)))
+    sched_yield(); // writers never wait on the main thread
+  m->type = type;
+  m->client = ps;
+  m->fd = poll_array[ps].fd;
+  queue_commit(&w->control);
+  ring_published = 1;
+}
+
+// Hand over client 'ps' to its writer thread
+void worker_attach(size_t ps)
+{
+  // Events are only handled by the writer now
+  poll_array[ps].events = 0;
+  event_update(&main_loop, ps);
+  descriptor_flags[ps] |= CLIENT_WORKER;
+  worker_message(ps, WORKER_ATTACH);
+}
+
+// Wake up the writers waiting for packets, once per main loop iteration
+void wake_workers(void)
+{
+  if (!ring_published)
+    return;
+  ring_published = 0;
+  atomic_thread_fence(memory_order_seq_cst);
+  for (size_t id = 0; id < n_workers; id++) {
+    struct worker *w = &workers[id];
+    if (atomic_load(&w->sleeping) && atomic_exchange(&w->sleeping, 0)) {
+      if (write(w->wake_pipe[1], "", 1) < 0) {
+        // pipe full: the writer has plenty of wakeups pending
+      }
+    }
+  }
+}
+
+void workers_finish(void)
+{
+  atomic_store(&workers_stop, 1);
+  for (size_t id = 0; id < n_workers; id++) {
+    if (write(workers[id].wake_pipe[1], "", 1) < 0) {
+      // already awake
+    }
+  }
+  for (size_t id = 0; id < n_workers; id++)
+    pthread_join(workers[id].thread, NULL);
+  for (size_t i = n_sensors + n_listen; i < n_descriptors; i++) {
+    if (descriptor_flags[i] & CLIENT_WORKER)
+      poll_array[i].fd = -1;
+  }
+}
+
+// Sensor ingest threads (-I). Otherwise the main thread reads all the
+// sensors, and sends them heartbeats and tries to reopen them inline, so a
+// reconnection that blocks or a burst of data on one port holds up all the
+// others. With ingest threads, each one owns the sensors whose index
+// modulo the number of threads is its id, and can be pinned to a CPU: it
+// reads their packets into a queue for each sensor, which the main thread
+// merges taking turns between sensors, writes them the packets the main
+// thread queues for them, and does the heartbeats and reconnections. The
+// main thread only keeps the descriptor of a sensor in poll_array to know
+// whether it is connected.
+#define INGEST_QUEUE_SIZE    256 // packets from each sensor, power of two
+#define INGEST_OUT_SIZE       64 // packets to each sensor, power of two
+#define INGEST_BATCH          32 // packets merged from a sensor in turn
+#define HEARTBEAT_INTERVAL   200 // ms
+
+#define INGEST_PACKET  0 // either way: packet from or to the sensor
+#define INGEST_OPENED  1 // from ingest thread: sensor reopened
+#define INGEST_CLOSED  2 // from ingest thread: sensor closed
+#define INGEST_LOST    3 // from ingest thread: sensor gone for good
+
+struct ingest_sensor {
+  struct msg_queue inbound; // to the main thread
+  struct msg_queue outbound; // from the main thread
+  uint64_t give_up_ms; // while closed, time to stop reconnecting
+};
+
+struct ingest {
+  pthread_t thread;
+  int cpu; // pinned to, or -1
+  int wake_pipe[2];
+  atomic_int sleeping;
+  struct event_loop loop; // entry 0 is the wake pipe, then the sensors
+  size_t n_fds;
+  size_t *sensor; // sensor index of each entry
+};
+
+size_t n_ingest = 0;
+int ingest_cpu = -1; // first CPU to pin the threads to, or -1
+struct ingest *ingest = NULL;
+struct ingest_sensor *ingest_sensors = NULL;
+atomic_int ingest_stop;
+
+// Pass a change of state of a sensor to the main thread. Packets are
+// never dropped for those, rather it waits for the main thread.
+void ingest_report(size_t sensor, int type, int fd)
+{
+  struct msg_queue *q = &ingest_sensors[sensor].inbound;
+  struct worker_msg *m;
+  while (!(m = queue_reserve(q))) {
+    if (atomic_load(&ingest_stop))
+      return;
+    wake_main_thread();
+    sched_yield();
+  }
+  m->type = type;
+  m->client = sensor;
+  m->fd = fd;
+  queue_commit(q);
+}
+
+// Like send_packet(), on an ingest thread's sensor
+int ingest_tlsend(struct ingest *g, size_t i, tl_packet *packet)
+{
+  if (tlsend(g->loop.fds[i].fd, packet) == 0)
+    return 0;
+  if ((errno == EOVERFLOW) || (errno == ENOTEMPTY))
+    event_pollout(&g->loop, i, 1);
+  if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == ENOTEMPTY))
+    return 1;
+  if (errno == EOVERFLOW)
+    return 0;
+  return -1;
+}
+
+// Close an ingest thread's sensor after an error, for reconnection unless
+// disabled with -T 0
+void ingest_close(struct ingest *g, size_t i)
+{
+  size_t sensor = g->sensor[i];
+  int fd = g->loop.fds[i].fd;
+  if (sensor_reconnect_timeout == 0) {
+    // Some other error, e.g. the serial port went down. Exit.
+    logmsg("Fatal error in sensor communication [%s]", strerror(errno));
+    ingest_report(sensor, INGEST_LOST, fd);
+  } else {
+    logmsg("Error in sensor %s communication [%s]",
+           sensor_url[sensor], strerror(errno));
+    ingest_report(sensor, INGEST_CLOSED, fd);
+  }
+  g->loop.fds[i].fd = -1;
+  g->loop.fds[i].events = 0;
+  event_update(&g->loop, i);
+  tlclose(fd);
+  ingest_sensors[sensor].give_up_ms =
+    monotonic_ms() + (uint64_t) sensor_reconnect_timeout * 1000;
+}
+
+// Send a heartbeat to a sensor, or try to reopen it. Returns 1 if
+// something was passed to the main thread.
+int ingest_heartbeat(struct ingest *g, size_t i, uint64_t now)
+{
+  size_t sensor = g->sensor[i];
+  if (g->loop.fds[i].fd >= 0) {
+    // Send a NOP packet to switch to binary mode.
+    tl_packet_header heartbeat = { TL_PTYPE_HEARTBEAT, 0, 0 };
+    if (ingest_tlsend(g, i, (tl_packet*) &heartbeat) < 0) {
+      ingest_close(g, i);
+      return 1;
+    }
+    return 0;
+  }
+
+  // Attempt to reconnect, or give up if too much time has passed
+  const char *url = sensor_url[sensor];
+  g->loop.fds[i].fd = tlopen(url, O_NONBLOCK|O_CLOEXEC, &io_log);
+  g->loop.fds[i].events = POLLIN;
+  if ((g->loop.fds[i].fd >= 0) && (event_update(&g->loop, i) != 0)) {
+    tlclose(g->loop.fds[i].fd);
+    g->loop.fds[i].fd = -1;
+  }
+  if (g->loop.fds[i].fd >= 0) {
+    logmsg("Successfully reopened sensor at %s", url);
+    ingest_report(sensor, INGEST_OPENED, g->loop.fds[i].fd);
+    return 1;
+  }
+  if (now > ingest_sensors[sensor].give_up_ms) {
+    logmsg("sensor reconnect timeout");
+    ingest_report(sensor, INGEST_LOST, -1);
+    ingest_sensors[sensor].give_up_ms = UINT64_MAX;
+    return 1;
+  }
+  return 0;
+}
+
+// Write out the packets queued for a sensor, as far as it takes them, or
+// drop them if it is closed. Returns 1 if it had to be closed.
+int ingest_write(struct ingest *g, size_t i)
+{
+  struct msg_queue *q = &ingest_sensors[g->sensor[i]].outbound;
+  for (struct worker_msg *m; (m = queue_peek(q)); queue_pop(q)) {
+    if (g->loop.fds[i].fd < 0)
+      continue;
+    int ret = ingest_tlsend(g, i, &m->packet);
+    if (ret == 1)
+      break;
+    if (ret < 0) {
+      queue_pop(q);
+      ingest_close(g, i);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Handle the events on a sensor. Returns 1 if something was passed to the
+// main thread.
+int ingest_io(struct ingest *g, size_t i)
+{
+  struct pollfd *pfd = &g->loop.fds[i];
+  struct ingest_sensor *s = &ingest_sensors[g->sensor[i]];
+  errno = 0;
+  if (pfd->revents & POLLERR) {
+    ingest_close(g, i);
+    return 1;
+  }
+
+  if (pfd->revents & POLLOUT) {
+    // Sensor was backed up, and we buffered up a partial packet
+    event_pollout(&g->loop, i, 0);
+    if (ingest_tlsend(g, i, NULL) < 0) {
+      ingest_close(g, i);
+      return 1;
+    }
+    if (ingest_write(g, i))
+      return 1;
+  }
+
+  int passed = 0;
+  while ((pfd->fd >= 0) && (pfd->revents & POLLIN)) {
+    // Read straight into the queue, and stop reading while it is full
+    struct worker_msg *m = queue_reserve(&s->inbound);
+    if (!m) {
+      pfd->events &= ~POLLIN;
+      event_update(&g->loop, i);
+      break;
+    }
+    errno = 0;
+    if (tlrecv(pfd->fd, &m->packet, sizeof(m->packet)) < 0) {
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+        break;
+      if (errno == EPROTO) {
+        // Error in the data. could be corrupted serial data,
+        // keep running since there could be valid data after the error.
+        logmsg("Error in sensor communication");
+        continue;
+      }
+      ingest_close(g, i);
+      return 1;
+    }
+    m->type = INGEST_PACKET;
+    m->client = g->sensor[i];
+    queue_commit(&s->inbound);
+    passed = 1;
+  }
+  return passed;
+}
+
+void *ingest_thread(void *arg)
+{
+  struct ingest *g = arg;
+  uint64_t last_heartbeat = 0;
+  while (!atomic_load(&ingest_stop)) {
+    // At most every 200 ms, send out a heartbeat to each sensor, or
+    // attempt to reconnect it
+    int passed = 0;
+    uint64_t now = monotonic_ms();
+    if ((now - last_heartbeat) >= HEARTBEAT_INTERVAL) {
+      last_heartbeat = now;
+      for (size_t i = 1; i < g->n_fds; i++)
+        passed |= ingest_heartbeat(g, i, now);
+    }
+
+    // Write what the main thread queued, and resume reading the sensors
+    // whose queue has room again
+    int timeout = HEARTBEAT_INTERVAL - (now - last_heartbeat);
+    for (size_t i = 1; i < g->n_fds; i++) {
+      struct pollfd *pfd = &g->loop.fds[i];
+      struct ingest_sensor *s = &ingest_sensors[g->sensor[i]];
+      if (!(pfd->events & POLLOUT))
+        passed |= ingest_write(g, i);
+      if ((pfd->fd >= 0) && !(pfd->events & POLLIN)) {
+        if (queue_reserve(&s->inbound)) {
+          pfd->events |= POLLIN;
+          event_update(&g->loop, i);
+        } else {
+          timeout = 1;
+        }
+      }
+    }
+    if (passed)
+      wake_main_thread();
+
+    // Sleep, unless something was queued since looking. Pairs with
+    // ingest_send().
+    atomic_store(&g->sleeping, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    for (size_t i = 1; i < g->n_fds; i++) {
+      if ((g->loop.fds[i].fd >= 0) && !(g->loop.fds[i].events & POLLOUT) &&
+          queue_peek(&ingest_sensors[g->sensor[i]].outbound))
+        timeout = 0;
+    }
+    int n_events = event_wait(&g->loop, g->n_fds, timeout, NULL);
+    atomic_store(&g->sleeping, 0);
+
+    passed = 0;
+    for (int k = 0; k < n_events; k++) {
+      size_t i = g->loop.ready[k];
+      if (i == 0) {
+        char buf[64];
+        while (read(g->wake_pipe[0], buf, sizeof(buf)) > 0);
+      } else if (g->loop.fds[i].fd >= 0) {
+        passed |= ingest_io(g, i);
+      }
+    }
+    if (passed)
+      wake_main_thread();
+  }
+
+  // Give the sensors about a second to take what was already sent to them
+  for (int n = 0; n < 20; n++, usleep(50000)) {
+    size_t left = 0;
+    for (size_t i = 1; i < g->n_fds; i++) {
+      int fd = g->loop.fds[i].fd;
+      if (fd < 0)
+        continue;
+      if ((tlsend(fd, NULL) != 0) && (errno == EOVERFLOW)) {
+        left++;
+      } else {
+        tlclose(fd);
+        g->loop.fds[i].fd = -1;
+      }
+    }
+    if (left == 0)
+      break;
+  }
+  return NULL;
+}
+
+// Hand over the sensors, open already, to the ingest threads and start
+// them
+int ingest_init(void)
+{
+  if (n_ingest > n_sensors)
+    n_ingest = n_sensors;
+  ingest = calloc(n_ingest, sizeof(*ingest));
+  ingest_sensors = calloc(n_sensors, sizeof(*ingest_sensors));
+  if (!ingest || !ingest_sensors)
+    return -1;
+  atomic_init(&ingest_stop, 0);
+
+  for (size_t sensor = 0; sensor < n_sensors; sensor++) {
+    struct ingest_sensor *s = &ingest_sensors[sensor];
+    if ((queue_init(&s->inbound, INGEST_QUEUE_SIZE) != 0) ||
+        (queue_init(&s->outbound, INGEST_OUT_SIZE) != 0))
+      return -1;
+  }
+
+  for (size_t id = 0; id < n_ingest; id++) {
+    struct ingest *g = &ingest[id];
+    size_t max_fds = (n_sensors + n_ingest - 1 - id) / n_ingest + 1;
+    g->cpu = (ingest_cpu >= 0) ? (int) (ingest_cpu + id) : -1;
+    atomic_init(&g->sleeping, 0);
+    if ((pipe(g->wake_pipe) != 0) ||
+        (set_nonblock_cloexec(g->wake_pipe[0]) != 0) ||
+        (set_nonblock_cloexec(g->wake_pipe[1]) != 0))
+      return -1;
+    struct pollfd *fds = calloc(max_fds, sizeof(*fds));
+    g->sensor = calloc(max_fds, sizeof(*g->sensor));
+    if (!fds || !g->sensor || (event_init(&g->loop, fds, max_fds) != 0))
+      return -1;
+    fds[0].fd = g->wake_pipe[0];
+    fds[0].events = POLLIN;
+    g->n_fds = 1;
+    for (size_t sensor = id; sensor < n_sensors; sensor += n_ingest) {
+      size_t i = g->n_fds++;
+      g->sensor[i] = sensor;
+      fds[i].fd = poll_array[sensor].fd;
+      fds[i].events = POLLIN;
+    }
+    for (size_t i = 0; i < g->n_fds; i++) {
+      if (event_update(&g->loop, i) != 0)
+        return -1;
+    }
+  }
+
+  // The main thread no longer waits on the sensors, and ignores the
+  // hangups ppoll reports for them
+  for (size_t sensor = 0; sensor < n_sensors; sensor++) {
+    poll_array[sensor].events = 0;
+    event_update(&main_loop, sensor);
+  }
+
+  for (size_t id = 0; id < n_ingest; id++) {
+    struct ingest *g = &ingest[id];
+    errno = pthread_create(&g->thread, NULL, ingest_thread, g);
+    if (errno != 0)
+      return -1;
+#if defined(__linux__)
+    if (g->cpu >= 0) {
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      CPU_SET(g->cpu, &cpus);
+      if (pthread_setaffinity_np(g->thread, sizeof(cpus), &cpus) != 0)
+        logmsg("Warning: could not pin ingest thread %zd to CPU %d",
+               id, g->cpu);
+    }
+#endif
+  }
+  return 0;
+}
+
+// Queue a packet for a sensor owned by an ingest thread. Returns 1 if
+// there is no room for it, like send_packet() when out of buffer space.
+int ingest_send(size_t sensor, tl_packet *packet)
+{
+  struct msg_queue *q = &ingest_sensors[sensor].outbound;
+  struct worker_msg *m = queue_reserve(q);
+  if (!m)
+    return 1;
+  m->type = INGEST_PACKET;
+  m->client = sensor;
+  memcpy(&m->packet, packet, tl_packet_total_size(&packet->hdr));
+  queue_commit(q);
+
+  atomic_thread_fence(memory_order_seq_cst);
+  struct ingest *g = &ingest[sensor % n_ingest];
+  if (atomic_load(&g->sleeping) && atomic_exchange(&g->sleeping, 0)) {
+    if (write(g->wake_pipe[1], "", 1) < 0) {
+      // pipe full: the thread has plenty of wakeups pending
+    }
+  }
+  return 0;
+}
+
+void ingest_finish(void)
+{
+  atomic_store(&ingest_stop, 1);
+  for (size_t id = 0; id < n_ingest; id++) {
+    if (write(ingest[id].wake_pipe[1], "", 1) < 0) {
+      // already awake
+    }
+  }
+  for (size_t id = 0; id < n_ingest; id++)
+    pthread_join(ingest[id].thread, NULL);
+  for (size_t sensor = 0; sensor < n_sensors; sensor++)
+    poll_array[sensor].fd = -1;
+}
+
+// Send a packet to a sensor, from the main thread
+int sensor_send(size_t sensor, tl_packet *packet)
+{
+  if (n_ingest > 0)
+    return ingest_send(sensor, packet);
+  return send_packet(sensor, packet);
+}
+
+#define SUCCESS          0
+#define ERROR_LOCAL     -1
+#define ERROR_CRITICAL  -2
+
+// Closes a sensor and sets things up for automatic reconnection
+void close_sensor(int sensor)
+{
+  int fd = poll_array[sensor].fd;
+  poll_array[sensor].fd = -1;
+  event_update(&main_loop, sensor);
+  tlclose(fd);
+  meta_forget(sensor);
+  if (sensor_reconnect_timeout > 0) {
+    clock_gettime(CLOCK_REALTIME, &last_reconnect_attempt);
+    last_reconnect_attempt.tv_sec += sensor_reconnect_timeout;
+  }
+}
+
+// Forward a packet from client 'ps' to the right sensor. In direct mode,
+// there is only one of them at offset zero. In hub mode, need to get
+// address from routing.
+int forward_packet(size_t ps, tl_packet *packet)
+{
+  size_t dest = 0;
+  if (sensor_mode == SENSOR_MODE_HUB) {
+    size_t routing_size = tl_packet_routing_size(&packet->hdr);
+    dest = tl_packet_routing_data(&packet->hdr)[--routing_size];
+    tl_packet_set_routing_size(&packet->hdr, routing_size);
+  }
+
+  if (dest >= n_sensors) {
+    // client is trying to reach an invalid sensor, just ignore packet
+    // just like if the sensor was "valid" but not plugged in. RPC remap
+    // will timeout if any
+    logmsg("Client #%d attempted to access invalid sensor %zd",
+           poll_array[ps].fd, dest);
+    return SUCCESS;
+  }
+
+  int ret = 1;
+  size_t size = tl_packet_total_size(&packet->hdr);
+  if (poll_array[dest].fd >= 0) {
+    ret = sensor_send(dest, packet);
+    if (ret < 0) {
+      logmsg("Error writing to sensor %zd: %s", dest, strerror(errno));
+      if (sensor_reconnect_timeout == 0)
+        return ERROR_CRITICAL;
+      close_sensor(dest);
+    }
+  }
+  if (ret != 0) {
+    stat_add(&sensor_stats[dest].dropped_out, 1);
+    logmsg("Packet dropped from client #%d to sensor %zd",
+           poll_array[ps].fd, dest);
+  } else {
+    stat_add(&sensor_stats[dest].packets_out, 1);
+    stat_add(&sensor_stats[dest].bytes_out, size);
+  }
+
+  return SUCCESS;
+}
+
+// RPC remapping in shared mode. The RPCs of the clients go to the sensors
+// with ids of the proxy, so that they do not conflict: remap_array[id] is
+// the call with id 'id', so replies are matched in constant time. Free
+// ids are reused in the order they were freed, which makes it unlikely
+// for a late reply to be taken for the next call with the same id. Each
+// call in flight is in a timer wheel with millisecond slots, for its
+// timeout, which can be set for each method. A route only gets so many
+// calls at once, and a client only a share of the ids: calls past these
+// limits wait in the client's queue, and the queues are served in turn,
+// one call at a time, so that one client flooding the proxy with RPCs
+// does not hold up the others.
+//
+// Calls by name without an argument are taken to be queries: a query
+// identical to one in flight, to the same route, waits for the same
+// reply instead of going to the sensor again, and the replies to the
+// methods given with -C are kept for a while and answered from there.
+// A call with an argument to a route drops the replies kept for it,
+// since it may well change them, and the replies to the queries sent
+// before it are neither kept nor shared with the queries that come after.
+#define RPC_WHEEL_SIZE 4096 // ms, power of two
+#define RPC_SHARED_SIZE 1024 // hash table of the queries, power of two
+#define RPC_CACHE_SIZE 256 // replies kept, power of two
+#define RPC_METHOD_MAX 64 // longest method name of a query
+#define RPC_ROUTES (MAX_ROUTES + ROUTE_HASH_SIZE) // see rpc_route()
+
+// A list node, in circular lists with a sentinel
+struct rpc_link {
+  struct rpc_link *next, *prev;
+};
+
+// Another client waiting for the reply to a query
+struct rpc_waiter {
+  struct rpc_waiter *next;
+  int client_desc;
+  uint16_t orig_id;
+};
+
+struct rpc_remap {
+  struct rpc_link link; // in the free list, or a slot of the timer wheel
+  uint64_t deadline; // in ms, see monotonic_ms()
+  int client_desc; // index of client in poll_array, or -1 if gone
+  int in_flight;
+  uint16_t id;
+  uint16_t orig_id;
+  uint16_t route; // see rpc_route()
+  int routing_size; // keep routing to send out timeout messages
+  uint8_t routing[TL_PACKET_MAX_ROUTING_SIZE];
+  struct rpc_waiter *waiters;
+  struct rpc_remap *shared_next; // in rpc_shared, if a query
+  unsigned sensor_opens; // of its sensor when sent
+  unsigned route_writes; // of its route when sent
+  uint64_t sent_us; // see monotonic_us()
+  size_t method_size; // 0 if not a query
+  char method[RPC_METHOD_MAX];
+};
+typedef struct rpc_remap rpc_remap;
+
+// A reply kept for the queries to come
+struct rpc_cached {
+  uint64_t expires; // in ms, 0 if the entry is free
+  int routing_size;
+  uint8_t routing[TL_PACKET_MAX_ROUTING_SIZE];
+  size_t method_size;
+  char method[RPC_METHOD_MAX];
+  size_t size;
+  uint8_t reply[TL_RPC_REPLY_MAX_PAYLOAD_SIZE];
+};
+
+// A call waiting to be sent
+struct rpc_queued {
+  struct rpc_queued *next;
+  uint16_t route; // see rpc_route()
+  tl_packet packet;
+};
+
+struct rpc_client {
+  size_t in_flight;
+  size_t n_queued;
+  struct rpc_queued *head, *tail;
+};
+
+// A time for a method, given on the command line
+struct rpc_method_ms {
+  const char *method;
+  size_t len;
+  unsigned ms;
+};
+
+size_t max_rpcs_in_flight = MAX_RPCS_DEFAULT;
+size_t max_route_rpcs = MAX_ROUTE_RPCS_DEFAULT; // 0 for no limit
+size_t max_client_rpcs; // share of the ids a client can use
+size_t max_client_queued;
+unsigned rpc_timeout_ms = RPC_TIMEOUT_DEFAULT;
+struct rpc_method_ms *rpc_timeouts = NULL; // for specific methods
+size_t n_rpc_timeouts = 0;
+struct rpc_method_ms *rpc_cache_ttls = NULL; // methods to keep replies of
+size_t n_rpc_cache_ttls = 0;
+
+rpc_remap *remap_array;
+struct rpc_link rpc_free; // ids not in use, oldest first
+struct rpc_link rpc_wheel[RPC_WHEEL_SIZE];
+uint64_t rpc_wheel_time; // all the slots up to this were expired
+struct rpc_client *rpc_clients; // by poll_array index
+struct rpc_queued *rpc_queue_pool;
+struct rpc_queued *rpc_queue_free;
+size_t n_rpcs_queued = 0;
+size_t rpc_next_client = 0; // first client to serve in the next round
+size_t route_rpcs[RPC_ROUTES]; // in flight to each route
+unsigned route_writes[RPC_ROUTES]; // calls with an argument sent to each
+struct rpc_waiter *rpc_waiter_pool;
+struct rpc_waiter *rpc_waiter_free;
+rpc_remap *rpc_shared[RPC_SHARED_SIZE]; // queries in flight
+struct rpc_cached rpc_cache[RPC_CACHE_SIZE];
+
+void rpc_link_init(struct rpc_link *list)
+{
+  list->next = list->prev = list;
+}
+
+void rpc_link_append(struct rpc_link *list, struct rpc_link *node)
+{
+  node->prev = list->prev;
+  node->next = list;
+  list->prev->next = node;
+  list->prev = node;
+}
+
+void rpc_link_remove(struct rpc_link *node)
+{
+  node->prev->next = node->next;
+  node->next->prev = node->prev;
+  node->next = node->prev = node;
+}
+
+// State dump for debugging
+void dump_state(void)
+{
+  printf("** BEGIN STATE DUMP **\n");
+  printf("Remap array:\n");
+  for (size_t i = 0; i < max_rpcs_in_flight; i++) {
+    rpc_remap *remap = &remap_array[i];
+    if (remap->in_flight)
+      printf("%zd: %llu %d %d %d %d\n", i,
+             (unsigned long long) remap->deadline, remap->client_desc,
+             remap->id, remap->orig_id, remap->route);
+  }
+  printf("Client queues:\n");
+  for (size_t i = 0; i < max_descriptors; i++) {
+    if (rpc_clients[i].in_flight || rpc_clients[i].n_queued)
+      printf("%zd: %zd in flight, %zd queued\n", i, rpc_clients[i].in_flight,
+             rpc_clients[i].n_queued);
+  }
+  printf("** END STATE DUMP **\n");
+}
+
+void init_rpc_remap()
+{
+  max_client_rpcs = max_rpcs_in_flight / 4;
+  if (max_client_rpcs == 0)
+    max_client_rpcs = 1;
+  max_client_queued = max_rpcs_in_flight;
+  size_t pool_size = max_rpcs_in_flight * 4;
+
+  remap_array = calloc(max_rpcs_in_flight, sizeof(rpc_remap));
+  rpc_clients = calloc(max_descriptors, sizeof(*rpc_clients));
+  rpc_queue_pool = calloc(pool_size, sizeof(*rpc_queue_pool));
+  rpc_waiter_pool = calloc(pool_size, sizeof(*rpc_waiter_pool));
+  if (!remap_array || !rpc_clients || !rpc_queue_pool || !rpc_waiter_pool)
+    exit(error("No memory for rpc translation lists"));
+
+  rpc_link_init(&rpc_free);
+  for (size_t i = 0; i < max_rpcs_in_flight; i++) {
+    remap_array[i].id = i;
+    remap_array[i].client_desc = -1;
+    rpc_link_append(&rpc_free, &remap_array[i].link);
+  }
+  for (size_t i = 0; i < RPC_WHEEL_SIZE; i++)
+    rpc_link_init(&rpc_wheel[i]);
+  rpc_wheel_time = monotonic_ms();
+  for (size_t i = 0; i < pool_size; i++)
+    rpc_queue_pool[i].next = (i + 1 < pool_size) ? &rpc_queue_pool[i + 1] :
+      NULL;
+  rpc_queue_free = rpc_queue_pool;
+  for (size_t i = 0; i < pool_size; i++)
+    rpc_waiter_pool[i].next = (i + 1 < pool_size) ? &rpc_waiter_pool[i + 1] :
+      NULL;
+  rpc_waiter_free = rpc_waiter_pool;
+}
+
+// Time given for a method in 'list', or 'other' if not there
+unsigned rpc_method_ms(const struct rpc_method_ms *list, size_t n,
+                       const char *method, size_t method_size, unsigned other)
+{
+  for (size_t i = 0; i < n; i++) {
+    if ((list[i].len == method_size) &&
+        (memcmp(list[i].method, method, method_size) == 0))
+      return list[i].ms;
+  }
+  return other;
+}
+
+// Timeout of a call, in ms
+unsigned rpc_timeout(tl_rpc_request_packet *req)
+{
+  return rpc_method_ms(rpc_timeouts, n_rpc_timeouts,
+                       (const char*) req->payload,
+                       tl_rpc_request_method_size(req), rpc_timeout_ms);
+}
+
+// Size of the method name of a query, or 0 if the call is not one
+size_t rpc_query_method_size(tl_rpc_request_packet *req)
+{
+  size_t method_size = tl_rpc_request_method_size(req);
+  if ((method_size == 0) || (method_size > RPC_METHOD_MAX) ||
+      (req->hdr.payload_size != (sizeof(req->req) + method_size)))
+    return 0;
+  return method_size;
+}
+
+uint32_t rpc_query_hash(const uint8_t *routing, size_t routing_size,
+                        const char *method, size_t size)
+{
+  uint32_t hash = routing_hash(routing, routing_size);
+  for (size_t i = 0; i < size; i++)
+    hash = (hash ^ (uint8_t) method[i]) * 16777619u;
+  return hash;
+}
+
+// The route of a call without an id, see rpc_route()
+uint16_t rpc_unknown_route(const uint8_t *routing, size_t size)
+{
+  return MAX_ROUTES + (routing_hash(routing, size) & (ROUTE_HASH_SIZE - 1));
+}
+
+// The route of a call, for the limit of calls in flight to each route:
+// its id, or for a route without one, MAX_ROUTES plus a hash of its
+// routing. The routing of a call is chosen by the client, so it never
+// goes into the route table, and the calls to devices that have not sent
+// anything yet do not all share one limit.
+uint16_t rpc_route(tl_rpc_request_packet *req)
+{
+  const uint8_t *routing = tl_packet_routing_data(&req->hdr);
+  size_t size = tl_packet_routing_size(&req->hdr);
+  uint16_t id = route_lookup(routing, size);
+  return (id != MAX_ROUTES) ? id : rpc_unknown_route(routing, size);
+}
+
+// Answer a query from a reply kept, if there is one. Returns whether it
+// did.
+int rpc_cached_reply(size_t ps, tl_rpc_request_packet *req)
+{
+  size_t method_size = rpc_query_method_size(req);
+  if ((method_size == 0) || (n_rpc_cache_ttls == 0))
+    return 0;
+  const char *method = (const char*) req->payload;
+  uint8_t routing_size, routing[TL_PACKET_MAX_ROUTING_SIZE];
+  routing_size = tl_packet_routing_size(&req->hdr);
+  memcpy(routing, tl_packet_routing_data(&req->hdr), routing_size);
+  struct rpc_cached *cached =
+    &rpc_cache[rpc_query_hash(routing, routing_size, method, method_size) &
+               (RPC_CACHE_SIZE - 1)];
+  if ((cached->expires <= monotonic_ms()) ||
+      (cached->routing_size != routing_size) ||
+      (memcmp(cached->routing, routing, routing_size) != 0) ||
+      (cached->method_size != method_size) ||
+      (memcmp(cached->method, method, method_size) != 0))
+    return 0;
+
+  tl_rpc_reply_packet *rep = tl_rpc_make_reply(req);
+  memcpy(rep->payload, cached->reply, cached->size);
+  rep->hdr.payload_size += cached->size;
+  memcpy(tl_packet_routing_data(&rep->hdr), routing, routing_size);
+  tl_packet_set_routing_size(&rep->hdr, routing_size);
+  ring_publish(ps, (tl_packet*) rep);
+  stat_add(&stats.rpc_cached, 1);
+  return 1;
+}
+
+// Keep the reply to a query, if its method is to be kept and no call
+// with an argument went to its route after it
+void rpc_cache_reply(rpc_remap *remap, tl_rpc_reply_packet *rep)
+{
+  unsigned ttl = rpc_method_ms(rpc_cache_ttls, n_rpc_cache_ttls,
+                               remap->method, remap->method_size, 0);
+  size_t size = tl_rpc_reply_payload_size(rep);
+  if ((ttl == 0) || (rep->hdr.type != TL_PTYPE_RPC_REP) ||
+      (size > sizeof(rpc_cache[0].reply)) ||
+      (remap->route_writes != route_writes[remap->route]))
+    return;
+  struct rpc_cached *cached =
+    &rpc_cache[rpc_query_hash(remap->routing, remap->routing_size,
+                              remap->method, remap->method_size) &
+               (RPC_CACHE_SIZE - 1)];
+  cached->expires = monotonic_ms() + ttl;
+  cached->routing_size = remap->routing_size;
+  memcpy(cached->routing, remap->routing, remap->routing_size);
+  cached->method_size = remap->method_size;
+  memcpy(cached->method, remap->method, remap->method_size);
+  cached->size = size;
+  memcpy(cached->reply, rep->payload, size);
+}
+
+// A call with an argument to route 'route' comes in, or goes out: drop
+// the replies kept for it, and the ones to the queries in flight. A
+// route gets an id once its device sends something, so the queries sent
+// to it before then, see rpc_route(), are dropped too.
+void rpc_cache_forget(uint16_t route, const uint8_t *routing, int size)
+{
+  route_writes[route]++;
+  if (route < MAX_ROUTES)
+    route_writes[rpc_unknown_route(routing, size)]++;
+  for (size_t i = 0; i < RPC_CACHE_SIZE; i++) {
+    if ((rpc_cache[i].routing_size == size) &&
+        (memcmp(rpc_cache[i].routing, routing, size) == 0))
+      rpc_cache[i].expires = 0;
+  }
+}
+
+// Index of the sensor a call went to
+size_t rpc_sensor(rpc_remap *remap)
+{
+  if ((sensor_mode == SENSOR_MODE_HUB) && (remap->routing_size > 0))
+    return remap->routing[remap->routing_size - 1];
+  return 0;
+}
+
+// Have client 'ps' wait for the reply to the same query in flight, if
+// there is one. Returns whether it does.
+int rpc_share(size_t ps, tl_rpc_request_packet *req)
+{
+  size_t method_size = rpc_query_method_size(req);
+  if ((method_size == 0) || !rpc_waiter_free)
+    return 0;
+  const char *method = (const char*) req->payload;
+  const uint8_t *routing = tl_packet_routing_data(&req->hdr);
+  int routing_size = tl_packet_routing_size(&req->hdr);
+  rpc_remap *remap =
+    rpc_shared[rpc_query_hash(routing, routing_size, method, method_size) &
+               (RPC_SHARED_SIZE - 1)];
+  for (; remap; remap = remap->shared_next) {
+    if ((remap->routing_size == routing_size) &&
+        (memcmp(remap->routing, routing, routing_size) == 0) &&
+        (remap->method_size == method_size) &&
+        (memcmp(remap->method, method, method_size) == 0))
+      break;
+  }
+  if (!remap)
+    return 0;
+  // A call sent before its sensor was reopened is not getting a reply,
+  // and one sent before a call with an argument may be out of date
+  if ((remap->sensor_opens != sensor_opens[rpc_sensor(remap)]) ||
+      (remap->route_writes != route_writes[remap->route]))
+    return 0;
+  struct rpc_waiter *w = rpc_waiter_free;
+  rpc_waiter_free = w->next;
+  w->client_desc = ps;
+  w->orig_id = req->req.id;
+  w->next = remap->waiters;
+  remap->waiters = w;
+  stat_add(&stats.rpc_shared, 1);
+  logmsgverbose("Client #%d rpc %u shares rpc %u", poll_array[ps].fd,
+                req->req.id, remap->id);
+  return 1;
+}
+
+// Whether a call of client 'ps' to route 'route' can go out now
+int rpc_can_send(size_t ps, uint16_t route)
+{
+  return (rpc_free.next != &rpc_free) &&
+    (rpc_clients[ps].in_flight < max_client_rpcs) &&
+    ((max_route_rpcs == 0) || (route_rpcs[route] < max_route_rpcs));
+}
+
+// Remap a call of client 'ps' and send it to the sensor
+int rpc_send(size_t ps, tl_rpc_request_packet *req, uint16_t route)
+{
+  rpc_remap *remap = (rpc_remap*) rpc_free.next;
+  rpc_link_remove(&remap->link);
+  logmsgverbose("Remapping client #%d rpc %u to %u",
+                poll_array[ps].fd, req->req.id, remap->id);
+  remap->orig_id = req->req.id;
+  req->req.id = remap->id;
+  remap->client_desc = ps;
+  remap->in_flight = 1;
+  remap->route = route;
+  remap->routing_size = tl_packet_routing_size(&req->hdr);
+  memcpy(remap->routing, tl_packet_routing_data(&req->hdr),
+         remap->routing_size);
+  remap->sent_us = monotonic_us();
+  remap->deadline = remap->sent_us / 1000 + rpc_timeout(req);
+  rpc_link_append(&rpc_wheel[remap->deadline & (RPC_WHEEL_SIZE - 1)],
+                  &remap->link);
+  remap->waiters = NULL;
+  remap->method_size = rpc_query_method_size(req);
+  remap->sensor_opens = sensor_opens[rpc_sensor(remap)];
+  if (remap->method_size == 0)
+    rpc_cache_forget(route, remap->routing, remap->routing_size);
+  remap->route_writes = route_writes[route];
+  if (remap->method_size > 0) {
+    memcpy(remap->method, req->payload, remap->method_size);
+    rpc_remap **bucket =
+      &rpc_shared[rpc_query_hash(remap->routing, remap->routing_size,
+                                 remap->method, remap->method_size) &
+                  (RPC_SHARED_SIZE - 1)];
+    remap->shared_next = *bucket;
+    *bucket = remap;
+  }
+  rpc_clients[ps].in_flight++;
+  route_rpcs[route]++;
+  return forward_packet(ps, (tl_packet*) req);
+}
+
+// Done with a call: free its id. Its waiters are to be taken care of
+void rpc_release(rpc_remap *remap)
+{
+  if (remap->method_size > 0) {
+    rpc_remap **p =
+      &rpc_shared[rpc_query_hash(remap->routing, remap->routing_size,
+                                 remap->method, remap->method_size) &
+                  (RPC_SHARED_SIZE - 1)];
+    while (*p != remap)
+      p = &(*p)->shared_next;
+    *p = remap->shared_next;
+    remap->method_size = 0;
+  }
+  rpc_link_remove(&remap->link);
+  if (remap->client_desc >= 0)
+    rpc_clients[remap->client_desc].in_flight--;
+  route_rpcs[remap->route]--;
+  remap->in_flight = 0;
+  remap->client_desc = -1;
+  rpc_link_append(&rpc_free, &remap->link);
+}
+
+// Send out the queued calls that can go, taking one from each client in
+// turn
+int rpc_dispatch(void)
+{
+  for (int progress = 1; progress && (n_rpcs_queued > 0);) {
+    progress = 0;
+    for (size_t n = 0; n < max_descriptors; n++) {
+      size_t ps = (rpc_next_client + n) % max_descriptors;
+      struct rpc_client *rc = &rpc_clients[ps];
+      struct rpc_queued *q = rc->head;
+      if (!q)
+        continue;
+      tl_rpc_request_packet *req = (tl_rpc_request_packet*) &q->packet;
+      int shared = rpc_share(ps, req);
+      if (!shared && !rpc_can_send(ps, q->route))
+        continue;
+      rc->head = q->next;
+      if (!rc->head)
+        rc->tail = NULL;
+      rc->n_queued--;
+      n_rpcs_queued--;
+      int ret = shared ? SUCCESS : rpc_send(ps, req, q->route);
+      q->next = rpc_queue_free;
+      rpc_queue_free = q;
+      if (ret != SUCCESS)
+        return ret;
+      progress = 1;
+    }
+    rpc_next_client = (rpc_next_client + 1) % max_descriptors;
+  }
+  return SUCCESS;
+}
+
+// Process an RPC request from client 'ps': send it to the sensor now, or
+// queue it up if over the limits
+int rpc_request(size_t ps, tl_rpc_request_packet *req)
+{
+  struct rpc_client *rc = &rpc_clients[ps];
+  uint16_t route = rpc_route(req);
+  if (rpc_query_method_size(req) == 0)
+    rpc_cache_forget(route, tl_packet_routing_data(&req->hdr),
+                     tl_packet_routing_size(&req->hdr));
+  // Behind the client's calls queued up, in the order they came
+  if (!rc->head) {
+    if (rpc_cached_reply(ps, req) || rpc_share(ps, req))
+      return SUCCESS;
+    if (rpc_can_send(ps, route))
+      return rpc_send(ps, req, route);
+  }
+
+  if (!rpc_queue_free || (rc->n_queued >= max_client_queued)) {
+    logmsg("Could not remap rpc %u from client #%d, out of buffers",
+           req->req.id, poll_array[ps].fd);
+    // courtesy reply, send an error to the caller
+    uint8_t routing_size, routing[TL_PACKET_MAX_ROUTING_SIZE];
+    routing_size = tl_packet_routing_size(&req->hdr);
+    memcpy(routing, tl_packet_routing_data(&req->hdr), routing_size);
+    tl_rpc_make_error(req, TL_RPC_ERROR_BUSY);
+    memcpy(tl_packet_routing_data(&req->hdr), routing, routing_size);
+    tl_packet_set_routing_size(&req->hdr, routing_size);
+    ring_publish(ps, (tl_packet*) req);
+    stat_add(&stats.rpc_refused, 1);
+    return SUCCESS; // of sorts :)
+  }
+
+  struct rpc_queued *q = rpc_queue_free;
+  rpc_queue_free = q->next;
+  q->next = NULL;
+  q->route = route;
+  memcpy(&q->packet, req, tl_packet_total_size(&req->hdr));
+  if (rc->tail)
+    rc->tail->next = q;
+  else
+    rc->head = q;
+  rc->tail = q;
+  rc->n_queued++;
+  n_rpcs_queued++;
+  return SUCCESS;
+}
+
+// Process a reply or error from a sensor, to the call with the proxy's id
+// 'id'. Returns the client to send it to, -1 for all of them if the
+// caller is gone, or -2 to drop it. The other clients waiting for it are
+// returned in 'waiters', for rpc_fan_out().
+int rpc_reply(uint16_t id, tl_rpc_reply_packet *rep,
+              struct rpc_waiter **waiters)
+{
+  *waiters = NULL;
+  if (id >= max_rpcs_in_flight) {
+    // don't want to crash if there is a misbehaving sensor
+    logmsg("Unexpected returned rpc id, cannot remap");
+    return -2;
+  }
+  rpc_remap *remap = &remap_array[id];
+  if (!remap->in_flight) {
+    logmsg("Cannot find remapping information for rpc %u, late reply?", id);
+    return -2;
+  }
+  histogram_add(&stats.rpc_us, monotonic_us() - remap->sent_us);
+  if (remap->method_size > 0)
+    rpc_cache_reply(remap, rep);
+  int dest = remap->client_desc;
+  struct rpc_waiter *w = remap->waiters;
+  if (dest >= 0) {
+    rep->rep.req_id = remap->orig_id;
+  } else if (w) {
+    // the caller is gone, but not everybody waiting for the reply
+    dest = w->client_desc;
+    rep->rep.req_id = w->orig_id;
+    remap->waiters = w->next;
+    w->next = rpc_waiter_free;
+    rpc_waiter_free = w;
+  }
+  *waiters = remap->waiters;
+  remap->waiters = NULL;
+  rpc_release(remap);
+  return dest;
+}
+
+// Send a copy of a reply to each of 'waiters', and free them
+void rpc_fan_out(struct rpc_waiter *waiters, tl_packet *packet)
+{
+  while (waiters) {
+    struct rpc_waiter *w = waiters;
+    tl_packet copy;
+    memcpy(&copy, packet, tl_packet_total_size(&packet->hdr));
+    ((tl_rpc_reply_packet*) &copy)->rep.req_id = w->orig_id;
+    ring_publish(w->client_desc, &copy);
+    waiters = w->next;
+    w->next = rpc_waiter_free;
+    rpc_waiter_free = w;
+  }
+}
+
+// Send client 'client' a timeout error for its call 'orig_id', if it is
+// still connected
+void rpc_timeout_error(rpc_remap *remap, int client, uint16_t orig_id)
+{
+  int client_fd = -1;
+  if (client >= 0)
+    client_fd = poll_array[client].fd;
+  if (client_fd >= 0) {
+    tl_rpc_request_packet req;
+    req.req.id = orig_id;
+    tl_rpc_error_packet *err = tl_rpc_make_error(&req, TL_RPC_ERROR_TIMEOUT);
+    memcpy(tl_packet_routing_data(&err->hdr), remap->routing,
+           remap->routing_size);
+    tl_packet_set_routing_size(&err->hdr, remap->routing_size);
+    ring_publish(client, (tl_packet*)err);
+  }
+  logmsg("RPC remap timeout: client #%d RPC #%d", client_fd, orig_id);
+}
+
+// Time out the calls past their deadline, sending an error back to their
+// clients, and send the calls that can go instead
+int rpc_expire(void)
+{
+  uint64_t now = monotonic_ms();
+  uint64_t t = rpc_wheel_time;
+  if ((now - t) > RPC_WHEEL_SIZE)
+    t = now - RPC_WHEEL_SIZE;
+  for (; t < now; t++) {
+    struct rpc_link *slot = &rpc_wheel[(t + 1) & (RPC_WHEEL_SIZE - 1)];
+    for (struct rpc_link *l = slot->next, *next; l != slot; l = next) {
+      next = l->next;
+      rpc_remap *remap = (rpc_remap*) l;
+      if (remap->deadline > now)
+        continue; // a later turn of the wheel
+      rpc_timeout_error(remap, remap->client_desc, remap->orig_id);
+      stat_add(&stats.rpc_timeouts, 1);
+      while (remap->waiters) {
+        struct rpc_waiter *w = remap->waiters;
+        rpc_timeout_error(remap, w->client_desc, w->orig_id);
+        remap->waiters = w->next;
+        w->next = rpc_waiter_free;
+        rpc_waiter_free = w;
+      }
+      rpc_release(remap);
+    }
+  }
+  rpc_wheel_time = now;
+  return rpc_dispatch();
+}
+
+// How long to wait for events at most, to expire the next calls in time
+int rpc_wait_ms(int max_ms)
+{
+  for (int ms = 1; ms < max_ms; ms++) {
+    struct rpc_link *slot =
+      &rpc_wheel[(rpc_wheel_time + ms) & (RPC_WHEEL_SIZE - 1)];
+    if (slot->next != slot)
+      return ms;
+  }
+  return max_ms;
+}
+
+// Forget the calls of client 'ps', which is going away: drop its queue,
+// and have the replies to the calls in flight ignored
+void rpc_client_release(size_t ps)
+{
+  struct rpc_client *rc = &rpc_clients[ps];
+  for (size_t i = 0; i < max_rpcs_in_flight; i++) {
+    rpc_remap *remap = &remap_array[i];
+    if (!remap->in_flight)
+      continue;
+    if (remap->client_desc == (int) ps) {
+      remap->client_desc = -1;
+      rc->in_flight--;
+    }
+    for (struct rpc_waiter **p = &remap->waiters; *p;) {
+      struct rpc_waiter *w = *p;
+      if (w->client_desc != (int) ps) {
+        p = &w->next;
+        continue;
+      }
+      *p = w->next;
+      w->next = rpc_waiter_free;
+      rpc_waiter_free = w;
+    }
+  }
+  while (rc->head) {
+    struct rpc_queued *q = rc->head;
+    rc->head = q->next;
+    q->next = rpc_queue_free;
+    rpc_queue_free = q;
+    n_rpcs_queued--;
+  }
+  rc->tail = NULL;
+  rc->n_queued = 0;
+}
+
+// Parse a time in ms for all the methods, or for a method if preceded by
+// its name and =, as given to -R and -C. The time for all the methods
+// goes to 'all', or is invalid if NULL.
+int parse_method_ms(const char *arg, struct rpc_method_ms **list, size_t *n,
+                    unsigned *all)
+{
+  const char *eq = strchr(arg, '=');
+  const char *num = eq ? eq + 1 : arg;
+  char *end;
+  unsigned long ms = strtoul(num, &end, 0);
+  if ((end == num) || (*end != '\0') || (ms == 0) || (ms > 3600000))
+    return -1;
+  if (!eq) {
+    if (!all)
+      return -1;
+    *all = ms;
+    return 0;
+  }
+  struct rpc_method_ms *grown = realloc(*list, (*n + 1) * sizeof(**list));
+  if (!grown)
+    return -1;
+  *list = grown;
+  grown[*n].method = arg;
+  grown[*n].len = eq - arg;
+  grown[*n].ms = ms;
+  (*n)++;
+  return 0;
+}
+
+// Forget about a client whose descriptor is closed
+void release_client(size_t ps)
+{
+  poll_array[ps].fd = -1;
+  descriptor_flags[ps] = 0;
+  free(client_out[ps].sub);
+  client_out[ps].sub = NULL;
+  for (size_t id = 0; id < MAX_DERIVED; id++) {
+    if ((client_out[ps].derived >> id) & 1)
+      derived_release(id);
+  }
+  client_out[ps].derived = 0;
+  free(client_out[ps].stats_reply);
+  client_out[ps].stats_reply = NULL;
+  client_out[ps].stats_newline = 0;
+#if WEBSOCKETS
+  ws_free(client_out[ps].ws);
+  client_out[ps].ws = NULL;
+#endif
+  // invalidate all of the client's RPCs in shared mode
+  if (client_mode == CLIENT_MODE_SHARED)
+    rpc_client_release(ps);
+  // and release the entry once done with this iteration's events
+  closed_slots[n_closed_slots++] = ps;
+}
+
+void disconnect_client(size_t ps)
+{
+  if (descriptor_flags[ps] & CLIENT_WORKER) {
+    // The writer closes it, and tells us when done
+    worker_message(ps, WORKER_DETACH);
+    return;
+  }
+  // close the descriptor
+  int fd = poll_array[ps].fd;
+  poll_array[ps].fd = -1;
+  event_update(&main_loop, ps);
+  client_close(fd);
+  if (!(descriptor_flags[ps] & (WEBSOCKET_HANDSHAKE | STATS_CLIENT)))
+    client_report(ps, fd);
+  logmsgverbose("Disconnected client #%d", fd);
+  release_client(ps);
+}
+
+// Start sending the packets published from now on to client 'ps', after
+// the metadata known so far
+void client_start(size_t ps)
+{
+  struct client_out *c = &client_out[ps];
+  c->seq = atomic_load_explicit(&ring.head, memory_order_relaxed);
+  c->pos = ring.bytes;
+  c->drop_until = 0;
+  c->lag_start = 0;
+  c->lagging = 0;
+  c->sent_packets = c->sent_bytes = c->dropped = c->dropped_bytes = 0;
+  c->queued_bytes = c->peak_queued_bytes = 0;
+  client_stats_publish(c);
+  stat_set(&c->stats.packets_in, 0);
+  stat_set(&c->stats.bytes_in, 0);
+  c->blocked = 0;
+  c->partial_size = c->partial_sent = 0;
+  c->replaying = 0;
+  atomic_store(&c->replay_requested, 0);
+  c->start_seq = c->seq;
+  meta_replay(ps, -1);
+  if (n_workers > 0)
+    worker_attach(ps);
+}
+
+// Write to a client from the main thread, and set it up to wait if needed.
+// Returns like client_write()
+int main_client_write(size_t ps)
+{
+  int ret = client_write(n_workers, ps, poll_array[ps].fd);
+  if (ret > 0) {
+    client_out[ps].blocked = 1;
+    event_pollout(&main_loop, ps, 1);
+  }
+  return ret;
+}
+
+// Without writer threads, write out what was published to the clients
+// that are not waiting to be writeable, and disconnect the ones waiting
+// for too long
+void write_clients(void)
+{
+  static uint64_t written = 0;
+  uint64_t head = atomic_load_explicit(&ring.flushed, memory_order_relaxed);
+  int expire = (slow_client_policy == SLOW_DISCONNECT);
+  if ((head == written) && !expire)
+    return;
+  written = head;
+  for (size_t ps = n_sensors + n_listen; ps < n_descriptors; ps++) {
+    if ((poll_array[ps].fd < 0) ||
+        (descriptor_flags[ps] & (WEBSOCKET_HANDSHAKE | STATS_CLIENT)))
+      continue;
+    if (client_out[ps].blocked) {
+      if (expire && client_lagged_out(ps, poll_array[ps].fd))
+        disconnect_client(ps);
+      continue;
+    }
+    errno = 0;
+    if (main_client_write(ps) < 0) {
+      if ((errno != EPIPE) && (errno != ECONNRESET) &&
+          (errno != ETIMEDOUT))
+        logmsg("Failed to send sensor packet to client #%d [%s]",
+               poll_array[ps].fd, strerror(errno));
+      disconnect_client(ps);
+    }
+  }
+}
+
+// Send a packet to a client from the main thread
+void send_client(size_t ps, tl_packet *packet)
+{
+  ring_publish(ps, packet);
+}
+
+// Text being formatted, grown as needed
+struct stats_text {
+  char *buf;
+  size_t size;
+  size_t alloc;
+};
+
+void stats_printf(struct stats_text *t, const char *fmt, ...)
+{
+  for (;;) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(t->buf ? t->buf + t->size : NULL,
+                      t->alloc - t->size, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+      return;
+    if ((t->size + n) < t->alloc) {
+      t->size += n;
+      return;
+    }
+    size_t alloc = t->alloc ? t->alloc : 4096;
+    while (alloc <= (t->size + n))
+      alloc *= 2;
+    char *grown = realloc(t->buf, alloc);
+    if (!grown)
+      return; // the text is cut short
+    t->buf = grown;
+    t->alloc = alloc;
+  }
+}
+
+void stats_header(struct stats_text *t, const char *name, const char *type,
+                  const char *help)
+{
+  stats_printf(t, "# HELP tio_proxy_%s %s\n# TYPE tio_proxy_%s %s\n",
+               name, help, name, type);
+}
+
+void stats_value(struct stats_text *t, const char *name, const char *type,
+                 const char *help, uint64_t val)
+{
+  stats_header(t, name, type, help);
+  stats_printf(t, "tio_proxy_%s %llu\n", name, (unsigned long long) val);
 }
 
-void init_rpc_remap()
+// Format the sum of 'n' histograms
+void stats_histogram(struct stats_text *t, const char *name,
+                     const char *help, struct histogram *h, size_t n,
+                     size_t stride)
 {
-  remap_array = calloc(max_rpcs_in_flight + 1, sizeof(rpc_remap));
-  if (!remap_array)
-    exit(error("No memory for rpc translation lists"));
-  for (size_t i = 0; i < (max_rpcs_in_flight + 1); i++) {
-    init_remap_struct(&remap_array[i], i ?  &remap_array[i-1] : NULL,
-                      (i < max_rpcs_in_flight) ?  &remap_array[i+1] : NULL);
-    if (i > 0)
-      remap_array[i].id = i-1;
+  uint64_t count[HISTOGRAM_BUCKETS] = { 0 };
+  uint64_t sum = 0;
+  size_t last = 0;
+  for (size_t j = 0; j < n; j++) {
+    struct histogram *hj = (struct histogram*) ((char*) h + j * stride);
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+      count[i] += stat_get(&hj->count[i]);
+      if (count[i] && (i > last))
+        last = i;
+    }
+    sum += stat_get(&hj->sum);
+  }
+  stats_header(t, name, "histogram", help);
+  uint64_t total = 0;
+  for (size_t i = 0; i < HISTOGRAM_BUCKETS - 1; i++) {
+    total += count[i];
+    if (i <= last)
+      stats_printf(t, "tio_proxy_%s_bucket{le=\"%llu\"} %llu\n", name,
+                   1ull << i, (unsigned long long) total);
   }
+  total += count[HISTOGRAM_BUCKETS - 1];
+  stats_printf(t, "tio_proxy_%s_bucket{le=\"+Inf\"} %llu\n", name,
+               (unsigned long long) total);
+  stats_printf(t, "tio_proxy_%s_sum %llu\n", name, (unsigned long long) sum);
+  stats_printf(t, "tio_proxy_%s_count %llu\n", name,
+               (unsigned long long) total);
+}
 
-  client_list = calloc(max_descriptors, sizeof(rpc_remap));
-  if (!client_list)
-    exit(error("No memory for rpc translation lists"));
-  for (size_t i = 0; i < max_descriptors; i++)
-    init_remap_struct(&client_list[i], NULL, NULL);
+struct stats_field {
+  const char *name;
+  const char *type;
+  const char *help;
+  size_t offset;
+};
 
-  init_remap_struct(&orphan_list, NULL, NULL);
-  init_remap_struct(&timeout_list, NULL, NULL);
-  timeout_list.to_next = &timeout_list;
-  timeout_list.to_prev = &timeout_list;
-}
+const struct stats_field sensor_fields[] = {
+  { "sensor_packets_in_total", "counter", "Packets read from the sensor",
+    offsetof(struct sensor_stats, packets_in) },
+  { "sensor_bytes_in_total", "counter", "Bytes read from the sensor",
+    offsetof(struct sensor_stats, bytes_in) },
+  { "sensor_packets_out_total", "counter", "Packets sent to the sensor",
+    offsetof(struct sensor_stats, packets_out) },
+  { "sensor_bytes_out_total", "counter", "Bytes sent to the sensor",
+    offsetof(struct sensor_stats, bytes_out) },
+  { "sensor_dropped_out_total", "counter",
+    "Packets from clients that could not be sent to the sensor",
+    offsetof(struct sensor_stats, dropped_out) },
+};
+
+const struct stats_field client_fields[] = {
+  { "client_packets_in_total", "counter", "Packets read from the client",
+    offsetof(struct client_stats, packets_in) },
+  { "client_bytes_in_total", "counter", "Bytes read from the client",
+    offsetof(struct client_stats, bytes_in) },
+  { "client_packets_out_total", "counter", "Packets sent to the client",
+    offsetof(struct client_stats, packets_out) },
+  { "client_bytes_out_total", "counter",
+    "Bytes sent to the client, with any framing",
+    offsetof(struct client_stats, bytes_out) },
+  { "client_dropped_total", "counter", "Packets dropped for the client",
+    offsetof(struct client_stats, dropped) },
+  { "client_dropped_bytes_total", "counter", "Bytes dropped for the client",
+    offsetof(struct client_stats, dropped_bytes) },
+  { "client_queued_bytes", "gauge", "Bytes queued for the client",
+    offsetof(struct client_stats, queued_bytes) },
+  { "client_peak_queued_bytes", "gauge",
+    "Most bytes ever queued for the client",
+    offsetof(struct client_stats, peak_queued_bytes) },
+};
 
-void insert_after(rpc_remap *list_element, rpc_remap *to_insert)
+// Whether 'ps' is a client getting packets
+int stats_client(size_t ps)
 {
-  to_insert->prev = list_element;
-  to_insert->next = list_element->next;
-  list_element->next = to_insert;
-  if (to_insert->next)
-    to_insert->next->prev = to_insert;
+  return (poll_array[ps].fd >= 0) &&
+    !(descriptor_flags[ps] & (WEBSOCKET_HANDSHAKE | STATS_CLIENT));
 }
 
-// also removes from timeout list
-rpc_remap *remove_next(rpc_remap *list_element, int remove_timeout)
+// Format the statistics, in the Prometheus text format. The metrics
+// without labels come first.
+void stats_format(struct stats_text *t)
 {
-  if (!list_element || !list_element->next)
-    return NULL;
+  size_t n_clients = 0;
+  for (size_t ps = n_sensors + n_listen; ps < n_descriptors; ps++)
+    n_clients += stats_client(ps);
+  uint64_t dropped_in = 0;
+  for (size_t id = 0; id <= n_workers; id++)
+    dropped_in += stat_get(&writer_stats[id].dropped_in);
+
+  stats_value(t, "clients", "gauge", "Clients connected", n_clients);
+  stats_value(t, "ring_packets_total", "counter",
+              "Packets published to the clients",
+              atomic_load_explicit(&ring.head, memory_order_relaxed));
+  stats_value(t, "ring_bytes_total", "counter",
+              "Bytes published to the clients", ring.bytes);
+  stats_value(t, "client_dropped_in_total", "counter",
+              "Packets from clients dropped, main thread busy", dropped_in);
+  stats_value(t, "loop_iterations_total", "counter",
+              "Iterations of the main loop",
+              stat_get(&stats.loop_iterations));
+  if (client_mode == CLIENT_MODE_SHARED) {
+    size_t in_flight = 0;
+    for (size_t route = 0; route < RPC_ROUTES; route++)
+      in_flight += route_rpcs[route];
+    stats_value(t, "rpc_in_flight", "gauge", "RPCs waiting for a reply",
+                in_flight);
+    stats_value(t, "rpc_queued", "gauge", "RPCs waiting to be sent",
+                n_rpcs_queued);
+    stats_value(t, "rpc_timeouts_total", "counter", "RPCs timed out",
+                stat_get(&stats.rpc_timeouts));
+    stats_value(t, "rpc_cached_total", "counter",
+                "RPCs answered from the reply cache",
+                stat_get(&stats.rpc_cached));
+    stats_value(t, "rpc_shared_total", "counter",
+                "RPCs answered with the reply to the same query",
+                stat_get(&stats.rpc_shared));
+    stats_value(t, "rpc_refused_total", "counter",
+                "RPCs refused, out of buffers",
+                stat_get(&stats.rpc_refused));
+  }
 
-  rpc_remap *ret = list_element->next;
-  list_element->next = ret->next;
-  if (list_element->next)
-    list_element->next->prev = list_element;
-  ret->prev = ret->next = NULL;
+  stats_histogram(t, "loop_busy_microseconds",
+                  "Time handling events in each iteration of the main loop",
+                  &stats.loop_us, 1, 0);
+  if (client_mode == CLIENT_MODE_SHARED)
+    stats_histogram(t, "rpc_latency_microseconds",
+                    "Time from sending an RPC to the sensor to its reply",
+                    &stats.rpc_us, 1, 0);
+  stats_histogram(t, "client_queue_bytes",
+                  "Bytes queued for a client, at each write",
+                  &writer_stats[0].queued_bytes, n_workers + 1,
+                  sizeof(*writer_stats));
 
-  if (remove_timeout && ret->to_prev) {
-    ret->to_prev->to_next = ret->to_next;
-    ret->to_next->to_prev = ret->to_prev;
-    ret->to_next = ret->to_prev = NULL;
+  for (size_t f = 0; f < sizeof(sensor_fields) / sizeof(*sensor_fields);
+       f++) {
+    const struct stats_field *field = &sensor_fields[f];
+    stats_header(t, field->name, field->type, field->help);
+    for (size_t i = 0; i < n_sensors; i++)
+      stats_printf(t, "tio_proxy_%s{sensor=\"%zu\",url=\"%s\"} %llu\n",
+                   field->name, i, sensor_url[i], (unsigned long long)
+                   stat_get((stat_counter*) ((char*) &sensor_stats[i] +
+                                             field->offset)));
+  }
+  for (size_t f = 0; f < sizeof(client_fields) / sizeof(*client_fields);
+       f++) {
+    const struct stats_field *field = &client_fields[f];
+    stats_header(t, field->name, field->type, field->help);
+    for (size_t ps = n_sensors + n_listen; ps < n_descriptors; ps++) {
+      if (!stats_client(ps))
+        continue;
+      stats_printf(t, "tio_proxy_%s{client=\"%d\"} %llu\n", field->name,
+                   poll_array[ps].fd, (unsigned long long)
+                   stat_get((stat_counter*) ((char*) &client_out[ps].stats +
+                                             field->offset)));
+    }
   }
-  return ret;
 }
 
-void append_timeout(rpc_remap *remap, time_t send_time)
+// Reply to proxy.stats: the lines of the statistics without labels, or
+// with an argument the ones whose metric name starts with it, as many as
+// fit, without the tio_proxy_ prefix. Returns the size of the reply.
+size_t stats_reply(const char *arg, size_t arg_size, uint8_t *reply)
 {
-  if (remap->to_prev) {
-    // should never happen.
-    logmsg("Critical error: remapping already in timeout list");
-    exit(1);
+  struct stats_text t = { NULL, 0, 0 };
+  stats_format(&t);
+  const char *prefix = "tio_proxy_";
+  size_t prefix_size = strlen(prefix);
+  size_t size = 0;
+  for (size_t pos = 0; pos < t.size; ) {
+    const char *line = t.buf + pos;
+    const char *eol = memchr(line, '\n', t.size - pos);
+    size_t len = (eol ? (size_t) (eol - line) : (t.size - pos)) + 1;
+    pos += len;
+    if ((line[0] == '#') || (strncmp(line, prefix, prefix_size) != 0))
+      continue;
+    line += prefix_size;
+    len -= prefix_size;
+    size_t name_size = strcspn(line, "{ ");
+    if (arg_size ? ((arg_size > name_size) ||
+                    (memcmp(line, arg, arg_size) != 0)) :
+        (line[name_size] == '{'))
+      continue;
+    if ((size + len) > TL_RPC_REPLY_MAX_PAYLOAD_SIZE)
+      break;
+    memcpy(reply + size, line, len);
+    size += len;
   }
-  remap->to_prev = timeout_list.to_prev;
-  remap->to_next = &timeout_list;
-  remap->to_prev->to_next = remap;
-  remap->to_next->to_prev = remap;
-  remap->send_time = send_time;
+  free(t.buf);
+  return size;
 }
 
-rpc_remap *get_timedout(time_t t)
+// A client of the stats port (-S): read its HTTP request, whatever it is,
+// up to the blank line ending it, then reply with the statistics and
+// close the connection
+int handle_stats(size_t ps)
 {
-  if (timeout_list.to_next == &timeout_list)
-    return NULL;
-
-  rpc_remap *ret = timeout_list.to_next;
-  if ((ret->send_time + 5) >= t)
-    return NULL;
+  struct client_out *c = &client_out[ps];
+  int fd = poll_array[ps].fd;
+  errno = 0;
+  if (poll_array[ps].revents & POLLERR)
+    return ERROR_LOCAL;
 
-  ret->to_prev->to_next = ret->to_next;
-  ret->to_next->to_prev = ret->to_prev;
-  ret->to_next = ret->to_prev = NULL;
+  int complete = 0;
+  for (;;) {
+    char buf[1024];
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n < 0) {
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+        break;
+      return ERROR_LOCAL;
+    }
+    if (n == 0)
+      return ERROR_LOCAL;
+    for (ssize_t i = 0; (i < n) && !c->stats_reply && !complete; i++) {
+      if (buf[i] == '\n') {
+        complete = c->stats_newline;
+        c->stats_newline = 1;
+      } else if (buf[i] != '\r') {
+        c->stats_newline = 0;
+      }
+    }
+  }
 
-  return ret;
-}
+  if (complete) {
+    struct stats_text t = { NULL, 0, 0 };
+    stats_format(&t);
+    char header[256];
+    int len = snprintf(header, sizeof(header),
+                       "HTTP/1.1 200 OK\r\n"
+                       "Content-Type: text/plain; version=0.0.4\r\n"
+                       "Content-Length: %zu\r\n"
+                       "Connection: close\r\n\r\n", t.size);
+    c->stats_reply = malloc(len + t.size);
+    if (!c->stats_reply) {
+      free(t.buf);
+      return ERROR_LOCAL;
+    }
+    memcpy(c->stats_reply, header, len);
+    if (t.size > 0)
+      memcpy(c->stats_reply + len, t.buf, t.size);
+    c->stats_reply_size = len + t.size;
+    c->stats_reply_sent = 0;
+    free(t.buf);
+  }
+  if (!c->stats_reply)
+    return SUCCESS;
 
-void disconnect_client(size_t ps)
-{
-  // close the descriptor
-  tlclose(poll_array[ps].fd);
-  logmsgverbose("Disconnected client #%d", poll_array[ps].fd);
-  poll_array[ps].fd = -1;
-  // invalidate all of the client's RPCs in shared mode
-  if (client_mode == CLIENT_MODE_SHARED) {
-    for (rpc_remap *rpc = NULL; (rpc = remove_next(&client_list[ps], 0));) {
-      rpc->client_desc = -1;
-      insert_after(&orphan_list, rpc);
+  while (c->stats_reply_sent < c->stats_reply_size) {
+    ssize_t n = send(fd, c->stats_reply + c->stats_reply_sent,
+                     c->stats_reply_size - c->stats_reply_sent, MSG_NOSIGNAL);
+    if (n < 0) {
+      if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+        return ERROR_LOCAL;
+      event_pollout(&main_loop, ps, 1);
+      return SUCCESS;
     }
+    c->stats_reply_sent += n;
   }
-  // and flag that a client was disconnected, to compactify the poll array
-  disconnected_clients_flag = 1;
+  disconnect_client(ps);
+  return SUCCESS;
 }
 
-int set_nonblock_cloexec(int fd)
+#define PROXY_RPC_PREFIX "proxy."
+
+// process an RPC to the proxy itself, sent by client 'ps'
+int proxy_rpc(size_t ps, tl_rpc_request_packet *req)
 {
-  if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1)
-    return -1;
-  int flags = fcntl(fd, F_GETFL);
-  if (flags == -1)
-    return -1;
-  return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+  size_t method_size = tl_rpc_request_method_size(req);
+  const char *arg = (const char*) req->payload + method_size;
+  size_t arg_size = req->hdr.payload_size - sizeof(req->req) - method_size;
+#define METHOD(x)                                                       \
+  ((strlen(x) == method_size) && (memcmp(x, req->payload, method_size) == 0))
+  if ((sizeof(req->req) + method_size) > req->hdr.payload_size) {
+    tl_rpc_make_error(req, TL_RPC_ERROR_MALFORMED);
+  } else if (METHOD("proxy.subscribe")) {
+    if (client_subscribe(ps, arg, arg_size) == 0)
+      tl_rpc_make_reply(req);
+    else
+      tl_rpc_make_error(req, TL_RPC_ERROR_INVALID);
+  } else if (METHOD("proxy.derive")) {
+    int id = derived_request(ps, arg, arg_size);
+    if (id >= 0) {
+      tl_rpc_reply_packet *rep = tl_rpc_make_reply(req);
+      rep->payload[0] = id;
+      rep->hdr.payload_size += 1;
+    } else {
+      tl_rpc_make_error(req, -id);
+    }
+  } else if (METHOD("proxy.underive")) {
+    int ret = derived_cancel(ps, arg, arg_size);
+    if (ret == 0)
+      tl_rpc_make_reply(req);
+    else
+      tl_rpc_make_error(req, ret);
+  } else if (METHOD("proxy.replay")) {
+    int ret = client_replay(ps, arg, arg_size);
+    if (ret == 0)
+      tl_rpc_make_reply(req);
+    else
+      tl_rpc_make_error(req, ret);
+  } else if (METHOD("proxy.stats")) {
+    uint8_t reply[TL_RPC_REPLY_MAX_PAYLOAD_SIZE];
+    size_t size = stats_reply(arg, arg_size, reply);
+    tl_rpc_reply_packet *rep = tl_rpc_make_reply(req);
+    memcpy(rep->payload, reply, size);
+    rep->hdr.payload_size += size;
+  } else {
+#undef METHOD
+    tl_rpc_make_error(req, TL_RPC_ERROR_NOTFOUND);
+  }
+  send_client(ps, (tl_packet*) req);
+  return SUCCESS;
 }
 
-// sends a packet to an entity, setting up writeable notifications if needed.
-// return -1 on error that would require closing the connection, 0 on success,
-// 1 if the packet was not sent because we were out of buffer space.
-int send_packet(size_t ps, tl_packet *packet)
+// Answer a data.send_all RPC from client 'ps' with the cached metadata,
+// if all of it is there for the route. Returns whether it did.
+int cached_send_all(size_t ps, tl_rpc_request_packet *req)
 {
-  int ret = tlsend(poll_array[ps].fd, packet);
-  if (ret == 0)
+  const char *method = "data.send_all";
+  size_t method_size = tl_rpc_request_method_size(req);
+  if ((method_size != strlen(method)) ||
+      (memcmp(req->payload, method, method_size) != 0))
     return 0;
-
-  if ((errno == EOVERFLOW) || (errno == ENOTEMPTY))
-    poll_array[ps]. events |= POLLOUT;
-  if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == ENOTEMPTY))
-    return 1;
-  if (errno == EOVERFLOW)
+  uint8_t routing_size, routing[TL_PACKET_MAX_ROUTING_SIZE];
+  routing_size = tl_packet_routing_size(&req->hdr);
+  memcpy(routing, tl_packet_routing_data(&req->hdr), routing_size);
+  uint16_t route = route_lookup(routing, routing_size);
+  if ((route == MAX_ROUTES) || !meta_complete(route))
     return 0;
-  return -1;
-}
 
-#define SUCCESS          0
-#define ERROR_LOCAL     -1
-#define ERROR_CRITICAL  -2
+  tl_rpc_make_reply(req);
+  memcpy(tl_packet_routing_data(&req->hdr), routing, routing_size);
+  tl_packet_set_routing_size(&req->hdr, routing_size);
+  send_client(ps, (tl_packet*) req);
+  meta_replay(ps, route);
+  logmsgverbose("Answered data.send_all from client #%d from the cache",
+                poll_array[ps].fd);
+  return 1;
+}
 
 // process a packet sent by client 'ps' to the proxy in hub mode
 int hub_packet(size_t ps, tl_packet *packet)
@@ -396,8 +5143,7 @@ int hub_packet(size_t ps, tl_packet *packet)
 #undef METHOD
       tl_rpc_make_error(req, TL_RPC_ERROR_NOTFOUND);
     }
-    if (send_packet(ps, packet) < 0)
-      return ERROR_LOCAL;
+    send_client(ps, packet);
   } else {
     logmsg("Ignoring packet of type %u sent to hub by client#%d",
            packet->hdr.type, poll_array[ps].fd);
@@ -408,31 +5154,22 @@ int hub_packet(size_t ps, tl_packet *packet)
 // process data incoming from sensor 'ps'
 int sensor_data(size_t ps, tl_packet *packet)
 {
-  size_t client_start = n_sensors + n_listen;
-  size_t client_end = n_descriptors;
+  int32_t dest = -1; // all clients
+  struct rpc_waiter *waiters = NULL; // of the same RPC reply
+  stat_add(&sensor_stats[ps].packets_in, 1);
+  stat_add(&sensor_stats[ps].bytes_in, tl_packet_total_size(&packet->hdr));
 
   if (((packet->hdr.type == TL_PTYPE_RPC_REP) ||
        (packet->hdr.type == TL_PTYPE_RPC_ERROR)) &&
       (client_mode == CLIENT_MODE_SHARED)) {
     // Remap RPC to original one. either packet type is fine to access the id
     tl_rpc_reply_packet *rep = (tl_rpc_reply_packet*) packet;
-    if (rep->rep.req_id >= max_rpcs_in_flight) {
-      // don't want to crash if there is a misbehaving sensor
-      logmsg("Unexpected returned rpc id, cannot remap");
+    dest = rpc_reply(rep->rep.req_id, rep, &waiters);
+    if (dest < -1)
       return SUCCESS;
-    }
-    rpc_remap *remap = remove_next(remap_array[rep->rep.req_id + 1].prev, 1);
-    if (!remap) {
-      logmsg("Cannot find remapping information for rpc %u", rep->rep.req_id);
-      return ERROR_CRITICAL;
-    }
-    if (remap->client_desc >= 0) {
-      // the client that placed the RPC is still connected
-      rep->rep.req_id = remap->orig_id;
-      client_start = remap->client_desc;
-      client_end = client_start + 1;
-    }
-    insert_after(&remap_array[0], remap);
+    int ret = rpc_dispatch();
+    if (ret != SUCCESS)
+      return ret;
   }
 
   // If in hub mode, add back routing
@@ -450,6 +5187,12 @@ int sensor_data(size_t ps, tl_packet *packet)
     tl_packet_set_routing_size(&packet->hdr, routing_size);
   }
 
+  uint16_t route = MAX_ROUTES;
+  if ((packet->hdr.type != TL_PTYPE_RPC_REP) &&
+      (packet->hdr.type != TL_PTYPE_RPC_ERROR))
+    route = route_id(tl_packet_routing_data(&packet->hdr),
+                     tl_packet_routing_size(&packet->hdr));
+
   if (packet->hdr.type == TL_PTYPE_LOG) {
     tl_log_packet *logp = (tl_log_packet*) packet;
     char path[TL_ROUTING_FMT_BUF_SIZE];
@@ -466,7 +5209,21 @@ int sensor_data(size_t ps, tl_packet *packet)
      case TL_LOG_INFO: type = "INFO"; break;
      case TL_LOG_DEBUG: type = "DEBUG"; break;
     }
-    logmsg("%s %s: %.*s", path, type, len, logp->message);
+    // Warnings and worse always go out, the rest is limited for each
+    // sensor and level
+    uint64_t key = 0;
+    char label[LOG_LABEL_MAX] = "";
+    if (logp->log.level > TL_LOG_WARNING) {
+      uint8_t id[TL_PACKET_MAX_ROUTING_SIZE + 2];
+      size_t n_hops = tl_packet_routing_size(&packet->hdr);
+      id[0] = logp->log.level;
+      id[1] = n_hops;
+      memcpy(id + 2, tl_packet_routing_data(&packet->hdr), n_hops);
+      key = log_key(id, n_hops + 2);
+      snprintf(label, sizeof(label), "from %s at %s", path, type);
+    }
+    logmsg_keyed(key, label, "%s %s: %.*s", path, type, (int) len,
+                 logp->message);
   }
 
   if (packet->hdr.type == TL_PTYPE_TEXT) {
@@ -474,114 +5231,118 @@ int sensor_data(size_t ps, tl_packet *packet)
 	   packet->hdr.payload_size, (const char*)packet->payload);
     // automatically send out heartbeat to switch to binary mode
     tl_packet_header heartbeat = { TL_PTYPE_HEARTBEAT, 0, 0 };
-    send_packet(ps, (struct tl_packet*) &heartbeat);
+    sensor_send(ps, (struct tl_packet*) &heartbeat);
   }
 
-  for (size_t i = client_start; i < client_end; i++) {
-    if (poll_array[i].fd < 0) continue;
-    errno = 0;
-    if (send_packet(i, packet) < 0) {
-      if ((errno != EPIPE) && (errno != ECONNRESET))
-        logmsg("Failed to send sensor packet to client #%d [%s]",
-               poll_array[i].fd, strerror(errno));
-      disconnect_client(i);
-    }
-  }
+  if ((packet->hdr.type == TL_PTYPE_TIMEBASE) ||
+      (packet->hdr.type == TL_PTYPE_SOURCE) ||
+      (packet->hdr.type == TL_PTYPE_STREAM))
+    meta_update(packet);
 
-  return SUCCESS;
-}
+  // Queue it up for the clients
+  ring_publish(dest, packet);
+  rpc_fan_out(waiters, packet);
+  if (history.arena && (dest < 0) && (packet->hdr.type >= TL_PTYPE_STREAM0))
+    history_append(packet);
 
-// Closes a sensor and sets things up for automatic reconnection
-void close_sensor(int sensor)
-{
-  tlclose(poll_array[sensor].fd);
-  poll_array[sensor].fd = -1;
-  if (sensor_reconnect_timeout > 0) {
-    clock_gettime(CLOCK_REALTIME, &last_reconnect_attempt);
-    last_reconnect_attempt.tv_sec += sensor_reconnect_timeout;
-  }
+  if ((n_derived > 0) && (packet->hdr.type >= TL_PTYPE_STREAM0))
+    derived_data(route, packet);
+
+  return SUCCESS;
 }
 
 // Process packets from clients
 int client_data(size_t ps, tl_packet *packet)
 {
+  stat_add(&client_out[ps].stats.packets_in, 1);
+  stat_add(&client_out[ps].stats.bytes_in, tl_packet_total_size(&packet->hdr));
+  if ((packet->hdr.type == TL_PTYPE_RPC_REQ) &&
+      (tl_packet_routing_size(&packet->hdr) == 0)) {
+    tl_rpc_request_packet *req = (tl_rpc_request_packet*) packet;
+    size_t prefix_size = strlen(PROXY_RPC_PREFIX);
+    if ((tl_rpc_request_method_size(req) > prefix_size) &&
+        (memcmp(req->payload, PROXY_RPC_PREFIX, prefix_size) == 0))
+      return proxy_rpc(ps, req);
+  }
+
   if ((sensor_mode == SENSOR_MODE_HUB) &&
       (tl_packet_routing_size(&packet->hdr) == 0)) {
     // This packet is for the proxy. handle and reply
     return hub_packet(ps, packet);
   }
 
+  if ((packet->hdr.type == TL_PTYPE_RPC_REQ) &&
+      cached_send_all(ps, (tl_rpc_request_packet*) packet))
+    return SUCCESS;
+
+  // In shared mode, translate RPC request IDs to avoid conflicts
   if ((client_mode == CLIENT_MODE_SHARED) &&
-      (packet->hdr.type == TL_PTYPE_RPC_REQ)) {
-    // translate RPC request IDs to avoid conflicts, and set up to collect
-    // the remapping if the call times out.
-    tl_rpc_request_packet *req = (tl_rpc_request_packet*) packet;
-    rpc_remap *remap = remove_next(&remap_array[0], 0);
-    if (!remap) {
-      logmsg("Could not remap rpc %u from client #%d, out of buffers",
-             req->req.id, poll_array[ps].fd);
-      // courtesy reply, send an error to the caller
-      uint8_t routing_size, routing[TL_PACKET_MAX_ROUTING_SIZE];
-      routing_size = tl_packet_routing_size(&req->hdr);
-      memcpy(routing, tl_packet_routing_data(&req->hdr), routing_size);
-      tl_rpc_make_error(req, TL_RPC_ERROR_BUSY);
-      memcpy(tl_packet_routing_data(&req->hdr), routing, routing_size);
-      tl_packet_set_routing_size(&req->hdr, routing_size);
-      if (send_packet(ps, packet) < 0) {
-        logmsg("Failed to send back error of too many rpcs in flight");
-        return ERROR_LOCAL;
+      (packet->hdr.type == TL_PTYPE_RPC_REQ))
+    return rpc_request(ps, (tl_rpc_request_packet*) packet);
+
+  return forward_packet(ps, packet);
+}
+
+// Merge the packets read by the ingest threads, taking turns between the
+// sensors so that a burst on one does not hold up the others. Whatever is
+// left over after a turn on each is for the next loop iteration.
+int ingest_merge(void)
+{
+  int left = 0;
+  for (size_t sensor = 0; sensor < n_sensors; sensor++) {
+    struct msg_queue *q = &ingest_sensors[sensor].inbound;
+    struct worker_msg *m;
+    for (size_t n = 0; (n < INGEST_BATCH) && (m = queue_peek(q)); n++) {
+      int ret = SUCCESS;
+      if (m->type == INGEST_PACKET) {
+        ret = sensor_data(sensor, &m->packet);
+      } else if (m->type == INGEST_OPENED) {
+        poll_array[sensor].fd = m->fd;
+        sensor_opens[sensor]++;
+      } else if (m->type == INGEST_CLOSED) {
+        poll_array[sensor].fd = -1;
+        meta_forget(sensor);
       } else {
-        return SUCCESS; // of sorts :)
+        ret = ERROR_CRITICAL;
       }
+      queue_pop(q);
+      if (ret != SUCCESS)
+        return ret;
     }
-
-    logmsgverbose("Remapping client #%d rpc %u to %u",
-           poll_array[ps].fd, req->req.id, remap->id);
-    remap->orig_id = req->req.id;
-    req->req.id = remap->id;
-    remap->client_desc = ps;
-    remap->routing_size = tl_packet_routing_size(&req->hdr);
-    memcpy(remap->routing, tl_packet_routing_data(&req->hdr),
-           remap->routing_size);
-    insert_after(&client_list[ps], remap);
-    append_timeout(remap, time(NULL));
-  }
-
-  // Forward packet to the right sensor. In direct mode, there is only
-  // one of them at offset zero. In hub mode, need to get address from
-  // routing.
-  size_t dest = 0;
-  if (sensor_mode == SENSOR_MODE_HUB) {
-    size_t routing_size = tl_packet_routing_size(&packet->hdr);
-    dest = tl_packet_routing_data(&packet->hdr)[--routing_size];
-    tl_packet_set_routing_size(&packet->hdr, routing_size);
+    if (queue_peek(q))
+      left = 1;
   }
+  if (left)
+    wake_main_thread();
+  return SUCCESS;
+}
 
-  if (dest >= n_sensors) {
-    // client is trying to reach an invalid sensor, just ignore packet
-    // just like if the sensor was "valid" but not plugged in. RPC remap
-    // will timeout if any
-    logmsg("Client #%d attempted to access invalid sensor %zd",
-           poll_array[dest].fd, dest);
-    return SUCCESS;
-  }
+// Handle the messages from the writer and ingest threads
+int handle_workers(size_t ps)
+{
+  char buf[64];
+  while (read(poll_array[ps].fd, buf, sizeof(buf)) > 0);
+  atomic_store(&main_wake_pending, 0);
 
-  int ret = 1;
-  if (poll_array[dest].fd >= 0) {
-    ret = send_packet(dest, packet);
-    if (ret < 0) {
-      logmsg("Error writing to sensor %zd: %s", dest, strerror(errno));
-      if (sensor_reconnect_timeout == 0)
-        return ERROR_CRITICAL;
-      close_sensor(dest);
+  for (size_t id = 0; id < n_workers; id++) {
+    struct msg_queue *q = &workers[id].inbound;
+    for (struct worker_msg *m; (m = queue_peek(q)); queue_pop(q)) {
+      if (m->type == WORKER_CLOSED) {
+        release_client(m->client);
+        continue;
+      }
+      if (poll_array[m->client].fd < 0)
+        continue;
+      int ret = client_data(m->client, &m->packet);
+      if (ret == ERROR_CRITICAL) {
+        queue_pop(q);
+        return ret;
+      } else if (ret != SUCCESS) {
+        disconnect_client(m->client);
+      }
     }
   }
-  if (ret != 0) {
-    logmsg("Packet dropped from client #%d to sensor %zd",
-           poll_array[dest].fd, dest);
-  }
-
-  return SUCCESS;
+  return (n_ingest > 0) ? ingest_merge() : SUCCESS;
 }
 
 // Return 0 on success, -1 on error
@@ -594,9 +5355,15 @@ int handle_tlio(size_t ps)
   if (poll_array[ps].revents & POLLOUT) {
     // Sensor or client was backed up, and we buffered up a partial packet.
     // Now we can write again, so try to send it out.
-    poll_array[ps].events &= ~POLLOUT;
-    if (send_packet(poll_array[ps].fd, NULL) < 0)
-      return ERROR_LOCAL;
+    event_pollout(&main_loop, ps, 0);
+    if (ps < n_sensors) {
+      if (send_packet(ps, NULL) < 0)
+        return ERROR_LOCAL;
+    } else {
+      client_out[ps].blocked = 0;
+      if (main_client_write(ps) < 0)
+        return ERROR_LOCAL;
+    }
   }
 
   if (poll_array[ps].revents & POLLIN) {
@@ -604,7 +5371,9 @@ int handle_tlio(size_t ps)
     for (;;) {
       tl_packet packet;
       errno = 0;
-      int ret = tlrecv(poll_array[ps].fd, &packet, sizeof(packet));
+      int ret = (ps < n_sensors) ?
+        tlrecv(poll_array[ps].fd, &packet, sizeof(packet)) :
+        client_recv(ps, poll_array[ps].fd, &packet);
       if (ret < 0) {
         if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
           break;
@@ -624,70 +5393,51 @@ int handle_tlio(size_t ps)
 }
 
 #if WEBSOCKETS
+// Read the HTTP upgrade request of a WebSocket client as it comes in, and
+// start the client once it is complete
 int handle_websock(size_t ps)
 {
   errno = 0;
   if (poll_array[ps].revents & POLLERR)
     return ERROR_LOCAL;
 
-  // HACK: Right now assume the request comes in a single packet, or fast
-  // enough that we can read it all in one go.
-  char buf[2048+1];
-  int ret = read(poll_array[ps].fd, buf, sizeof(buf)-1);
-  if (ret <= 0)
-    return ERROR_LOCAL;
-
-  buf[ret] = '\0';
-  const char *key = NULL;
-  int status = 0;
-  const char *line = buf;
-
+  int fd = poll_array[ps].fd;
+  struct websocket *ws = client_out[ps].ws;
   for (;;) {
-    char *end = strstr(line, "\r\n");
-    if (!end) {
-      status = -1;
+    if (ws->in_size == WS_IN_SIZE)
       break;
+    ssize_t n = read(fd, ws->in + ws->in_size, WS_IN_SIZE - ws->in_size);
+    if (n < 0) {
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+        break;
+      return ERROR_LOCAL;
     }
-    *end = '\0';
-    if ((end-line) == 0)
-      break;
-    if (strcmp(line, "Upgrade: websocket") == 0)
-      status = 1;
-    if (strncmp(line, "Sec-WebSocket-Key:", 18) == 0)
-      key = line + 19;
-    line = end + 2;
+    if (n == 0)
+      return ERROR_LOCAL;
+    ws->in_size += n;
   }
 
-  if ((status != 1) || !key) {
-    close(poll_array[ps].fd);
-    return ERROR_LOCAL;
+  int ret = ws_parse_request(ws);
+  if (ret == 0)
+    return SUCCESS;
+  if (ret > 0) {
+    ret = ws_accept(ws);
+  } else {
+    ws_refuse(ws, "400 Bad Request");
   }
 
-  SHA_CTX shactx;
-  unsigned char sha_hash[SHA_DIGEST_LENGTH];
-  SHA1_Init(&shactx);
-  SHA1_Update(&shactx, key, strlen(key));
-  SHA1_Update(&shactx, "258EAFA5-E914-47DA-95CA-C5AB0DC85B11", 36);
-  SHA1_Final(sha_hash, &shactx);
-
-  unsigned char hash64[(sizeof(sha_hash)+2)/3*4+1];
-  EVP_EncodeBlock(hash64, sha_hash, sizeof(sha_hash));
-
-  snprintf(buf, sizeof(buf),
-           "HTTP/1.1 101 Switching Protocols\r\n"
-           "Upgrade: websocket\r\n"
-           "Connection: Upgrade\r\n"
-           "Sec-WebSocket-Accept: %s\r\n\r\n",
-           hash64);
-
-  if (write(poll_array[ps].fd, buf, strlen(buf)) != (ssize_t) strlen(buf)) {
-    close(poll_array[ps].fd);
+  size_t taken;
+  uint64_t sent = 0;
+  if ((ws_send(ws, fd, NULL, 0, &taken, &sent) < 0) || (ret != 0)) {
+    logmsgverbose("Client #%d: not a WebSocket request", fd);
     return ERROR_LOCAL;
   }
-
-  tlfdopen(poll_array[ps].fd, "ws", NULL, &io_log);
+  logmsgverbose("Client #%d: WebSocket%s%s", fd,
+                ws->batch ? ", batched" : "",
+                ws->deflate ? ", permessage-deflate" : "");
 
   descriptor_flags[ps] &= ~WEBSOCKET_HANDSHAKE;
+  client_start(ps);
 
   return SUCCESS;
 }
@@ -726,7 +5476,12 @@ int client_connection(size_t ps)
     }
 
     // Make sure we have enough space for this client
-    if (n_descriptors >= max_descriptors) {
+    size_t slot = n_descriptors;
+    if (n_free_slots > 0)
+      slot = free_slots[--n_free_slots];
+    else if (n_descriptors < max_descriptors)
+      n_descriptors++;
+    else {
       logmsg("Accepting client (%s:%s) will exceed maximum number of clients",
              host, port);
       close(client_fd);
@@ -734,29 +5489,144 @@ int client_connection(size_t ps)
     }
 
     int tlfd = client_fd;
-    if (!(descriptor_flags[ps] & WEBSOCKET_PORT)) {
+    if (!(descriptor_flags[ps] & (WEBSOCKET_PORT | STATS_PORT)))
       tlfd = tlfdopen(client_fd, "tcp", NULL, &io_log);
-      if (tlfd < 0) {
-        logmsg("Failed to open new client (%s:%s) in libtio: %s",
-               host, port, strerror(errno));
+
+    poll_array[slot].fd = tlfd;
+    poll_array[slot].events = POLLIN;
+    if ((tlfd < 0) || (event_update(&main_loop, slot) != 0)) {
+      logmsg("Failed to set up new client (%s:%s): %s",
+             host, port, strerror(errno));
+      poll_array[slot].fd = -1;
+      event_update(&main_loop, slot);
+      if (tlfd < 0)
+        close(client_fd);
+      else if (tlclose(tlfd) != 0)
+        close(tlfd);
+      free_slots[n_free_slots++] = slot;
+      continue;
+    }
+    descriptor_flags[slot] = 0;
+    if (descriptor_flags[ps] & STATS_PORT) {
+      descriptor_flags[slot] |= STATS_CLIENT;
+    } else if (descriptor_flags[ps] & WEBSOCKET_PORT) {
+#if WEBSOCKETS
+      client_out[slot].ws = ws_new();
+      if (!client_out[slot].ws) {
+        logmsg("Failed to set up new client (%s:%s): out of memory",
+               host, port);
+        poll_array[slot].fd = -1;
+        event_update(&main_loop, slot);
         close(client_fd);
+        free_slots[n_free_slots++] = slot;
         continue;
       }
+#endif
+      descriptor_flags[slot] |= WEBSOCKET_HANDSHAKE;
+    } else {
+      client_start(slot);
     }
 
-    poll_array[n_descriptors].fd = tlfd;
-    poll_array[n_descriptors].events = POLLIN;
-    descriptor_flags[n_descriptors] = 0;
-    if (client_list)
-      init_remap_struct(&client_list[n_descriptors], NULL, NULL);
-    if (descriptor_flags[ps] & WEBSOCKET_PORT)
-      descriptor_flags[n_descriptors] |= WEBSOCKET_HANDSHAKE;
-    n_descriptors++;
-
     logmsgverbose("Accepted client #%d: %s:%s", tlfd, host, port);
   }
 }
 
+// Parse -b: a policy name, optionally followed by :argument
+int parse_slow_client_policy(const char *arg)
+{
+  const char *colon = strchr(arg, ':');
+  size_t len = colon ? (size_t) (colon - arg) : strlen(arg);
+  unsigned val = 0;
+  if (colon) {
+    char *end;
+    val = strtoul(colon + 1, &end, 0);
+    if ((*end != '\0') || (val == 0))
+      return -1;
+  }
+#define POLICY(x) ((strlen(x) == len) && (strncmp(x, arg, len) == 0))
+  if (POLICY("drop") && !colon) {
+    slow_client_policy = SLOW_DROP;
+  } else if (POLICY("latest") && !colon) {
+    slow_client_policy = SLOW_LATEST;
+  } else if (POLICY("decimate")) {
+    slow_client_policy = SLOW_DECIMATE;
+    slow_client_arg = colon ? val : DECIMATE_DEFAULT;
+  } else if (POLICY("disconnect")) {
+    slow_client_policy = SLOW_DISCONNECT;
+    slow_client_arg = colon ? val : LAG_TIMEOUT_DEFAULT;
+  } else {
+    return -1;
+  }
+#undef POLICY
+  return 0;
+}
+
+// Parse -H: a number of seconds followed by s, a size in bytes with an
+// optional k, M or G suffix, or both separated by a comma
+int parse_history(const char *arg)
+{
+  history.size = 0;
+  history.max_age_ms = 0;
+  const char *p = arg;
+  for (;;) {
+    char *end;
+    double val = strtod(p, &end);
+    if ((end == p) || (val <= 0))
+      return -1;
+    if (*end == 's') {
+      history.max_age_ms = val * 1000;
+      end++;
+    } else {
+      int shift = 0;
+      if ((*end == 'k') || (*end == 'K'))
+        shift = 10;
+      else if (*end == 'M')
+        shift = 20;
+      else if (*end == 'G')
+        shift = 30;
+      if (shift) {
+        end++;
+        if (*end == 'B')
+          end++;
+      }
+      history.size = val * (1ull << shift);
+    }
+    p = end;
+    if (*p != ',')
+      break;
+    p++;
+  }
+  if (*p != '\0')
+    return -1;
+  if (history.size == 0)
+    history.size = HISTORY_SIZE_DEFAULT;
+  return (history.size < 65536) ? -1 : 0;
+}
+
+// Parse the -F argument: ms[,size]
+int parse_flush(const char *arg)
+{
+  char *end;
+  double ms = strtod(arg, &end);
+  if ((end == arg) || (ms <= 0))
+    return -1;
+  flush_us = ms * 1000;
+  if (*end == ',') {
+    const char *p = end + 1;
+    flush_bytes = strtoull(p, &end, 0);
+    if ((end == p) || (flush_bytes == 0))
+      return -1;
+    if ((*end == 'k') || (*end == 'K')) {
+      flush_bytes <<= 10;
+      end++;
+    } else if (*end == 'M') {
+      flush_bytes <<= 20;
+      end++;
+    }
+  }
+  return ((*end != '\0') || (flush_us == 0)) ? -1 : 0;
+}
+
 int setup_listening_sock(struct addrinfo *i)
 {
   int sock = socket(i->ai_family, i->ai_socktype, i->ai_protocol);
@@ -765,11 +5635,13 @@ int setup_listening_sock(struct addrinfo *i)
   int on = 1;
   setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
   bind(sock, i->ai_addr, i->ai_addrlen);
-  listen(sock, 32);
+  listen(sock, SOMAXCONN);
   if (set_nonblock_cloexec(sock) != 0)
     return error("Failed to set listening socket flags");
   poll_array[n_descriptors].fd = sock;
   poll_array[n_descriptors].events = POLLIN;
+  if (event_update(&main_loop, n_descriptors) != 0)
+    return error("Failed to add listening socket to the event loop");
   return 0;
 }
 
@@ -781,8 +5653,8 @@ int main(int argc, char *argv[])
   memset(&ai, 0, sizeof(ai));
   ai.ai_family = AF_UNSPEC;
 
-  for (int opt = -1; (opt = getopt(argc, argv,
-                                   "fhv4up:w:c:r:i:t:T:")) != -1; ) {
+  const char *options = "fhv4up:w:z:S:c:r:i:t:T:W:I:b:q:F:H:L:R:C:";
+  for (int opt = -1; (opt = getopt(argc, argv, options)) != -1; ) {
     if (opt == 'f') {
       client_mode = CLIENT_MODE_FORWARD;
     } else if (opt == 'h') {
@@ -792,7 +5664,15 @@ int main(int argc, char *argv[])
 #if WEBSOCKETS
     } else if (opt == 'w') {
       websock_port = optarg;
+    } else if (opt == 'z') {
+      char *end;
+      long level = strtol(optarg, &end, 10);
+      if ((*end != '\0') || (level < 0) || (level > 9))
+        return usage(stderr, argv[0], "Invalid compression level");
+      ws_deflate_level = level;
 #endif
+    } else if (opt == 'S') {
+      stats_port = optarg;
     } else if (opt == 'c') {
       max_clients = strtoul(optarg, NULL, 0);
       if (max_clients == 0)
@@ -814,6 +5694,43 @@ int main(int argc, char *argv[])
       timestamp_us = 1;
     } else if (opt == 'T') {
       sensor_reconnect_timeout = atoi(optarg);
+    } else if (opt == 'W') {
+      n_workers = strtoul(optarg, NULL, 0);
+    } else if (opt == 'I') {
+      char *end;
+      n_ingest = strtoul(optarg, &end, 0);
+      if (*end == ',')
+        ingest_cpu = strtoul(end + 1, &end, 0);
+      if ((*end != '\0') || (n_ingest == 0))
+        return usage(stderr, argv[0], "Invalid ingest threads");
+    } else if (opt == 'b') {
+      if (parse_slow_client_policy(optarg) != 0)
+        return usage(stderr, argv[0], "Invalid slow client policy");
+    } else if (opt == 'q') {
+      char *end;
+      client_queue_limit = strtoull(optarg, &end, 0);
+      if ((*end == 'k') || (*end == 'K'))
+        client_queue_limit <<= 10;
+      else if (*end == 'M')
+        client_queue_limit <<= 20;
+      else if (*end != '\0')
+        return usage(stderr, argv[0], "Invalid client queue size");
+    } else if (opt == 'L') {
+      max_route_rpcs = strtoul(optarg, NULL, 0);
+    } else if (opt == 'R') {
+      if (parse_method_ms(optarg, &rpc_timeouts, &n_rpc_timeouts,
+                          &rpc_timeout_ms) != 0)
+        return usage(stderr, argv[0], "Invalid RPC timeout");
+    } else if (opt == 'C') {
+      if (parse_method_ms(optarg, &rpc_cache_ttls, &n_rpc_cache_ttls,
+                          NULL) != 0)
+        return usage(stderr, argv[0], "Invalid RPC cache time");
+    } else if (opt == 'F') {
+      if (parse_flush(optarg) != 0)
+        return usage(stderr, argv[0], "Invalid flush budget");
+    } else if (opt == 'H') {
+      if (parse_history(optarg) != 0)
+        return usage(stderr, argv[0], "Invalid history size");
     } else {
       return usage(stderr, argv[0], "Invalid command line option");
     }
@@ -867,8 +5784,20 @@ int main(int argc, char *argv[])
     n_listen++;
 #endif
 
+  struct addrinfo *result_stats = NULL;
+  if (stats_port) {
+    // Only local clients get the statistics
+    if (getaddrinfo("localhost", stats_port, &ai, &result_stats) != 0)
+      return error("Failed to get stats listening address info");
+    for (struct addrinfo *i = result_stats; i; i = i->ai_next)
+      n_listen++;
+  }
+
   if (n_listen == 0)
     return error("No listening sockets configurations available");
+  size_t n_sockets = n_listen;
+  if ((n_workers > 0) || (n_ingest > 0))
+    n_listen++; // for the pipe the writer and ingest threads wake us up with
 
   max_descriptors = n_sensors + n_listen + max_clients;
   poll_array = calloc(max_descriptors, sizeof(struct pollfd));
@@ -877,6 +5806,23 @@ int main(int argc, char *argv[])
   descriptor_flags = calloc(max_descriptors, sizeof(*descriptor_flags));
   if (!descriptor_flags)
     return error("Failed to allocate descriptor flags");
+  free_slots = calloc(max_clients, sizeof(*free_slots));
+  closed_slots = calloc(max_clients, sizeof(*closed_slots));
+  if (!free_slots || !closed_slots)
+    return error("Failed to allocate client slots");
+  if (event_init(&main_loop, poll_array, max_descriptors) != 0)
+    return error("Failed to initialize event loop");
+  if (ring_init(n_workers + 1) != 0)
+    return error("Failed to allocate packet ring");
+  sensor_stats = calloc(n_sensors, sizeof(*sensor_stats));
+  writer_stats = calloc(n_workers + 1, sizeof(*writer_stats));
+  if (!sensor_stats || !writer_stats)
+    return error("Failed to allocate statistics");
+  if ((history.size > 0) && (history_init(n_workers + 1) != 0))
+    return error("Failed to allocate the history");
+  // Besides the descriptors in the poll array, leave some room for the
+  // ones used by name resolution, libtio, etc.
+  raise_descriptor_limit(max_descriptors + 32);
 
   // Connect to all sensors
   for (n_descriptors = 0; n_descriptors < n_sensors; n_descriptors++) {
@@ -885,6 +5831,8 @@ int main(int argc, char *argv[])
     poll_array[n_descriptors].events = POLLIN;
     if (poll_array[n_descriptors].fd < 0)
       return error("Failed to open sensor '%s'", url);
+    if (event_update(&main_loop, n_descriptors) != 0)
+      return error("Failed to add sensor '%s' to the event loop", url);
   }
 
   // Set up listening sockets
@@ -903,15 +5851,36 @@ int main(int argc, char *argv[])
   freeaddrinfo(result_ws);
 #endif
 
+  for (struct addrinfo *i = result_stats; i; i = i->ai_next, n_descriptors++) {
+    int ret = setup_listening_sock(i);
+    if (ret) return ret;
+    descriptor_flags[n_descriptors] = STATS_PORT;
+  }
+  if (result_stats)
+    freeaddrinfo(result_stats);
+
 
   if (client_mode == CLIENT_MODE_SHARED)
     init_rpc_remap();
 
+  if ((n_workers > 0) || (n_ingest > 0)) {
+    atomic_init(&main_wake_pending, 0);
+    if ((pipe(main_wake_pipe) != 0) ||
+        (set_nonblock_cloexec(main_wake_pipe[0]) != 0) ||
+        (set_nonblock_cloexec(main_wake_pipe[1]) != 0))
+      return error("Failed to create writer thread pipe");
+    poll_array[n_descriptors].fd = main_wake_pipe[0];
+    poll_array[n_descriptors].events = POLLIN;
+    descriptor_flags[n_descriptors] = WORKER_PIPE;
+    if (event_update(&main_loop, n_descriptors++) != 0)
+      return error("Failed to add writer thread pipe to the event loop");
+  }
+
   logmsg("Initialized. %zd sockets listening, %zd sensors, %zd max clients",
-         n_listen, n_sensors, max_clients);
+         n_sockets, n_sensors, max_clients);
 
   // Set up signal handling. SIGINT is used to quit, and is only delivered
-  // when waiting in ppoll
+  // when waiting for events
   sigset_t sigmask;
   sigemptyset(&sigmask);
   sigaddset(&sigmask, SIGINT);
@@ -925,40 +5894,29 @@ int main(int argc, char *argv[])
     sigemptyset(&sa.sa_mask);
     if (sigaction(SIGINT, &sa, NULL) == -1)
       return error("Failed to install SIGINT handler");
+    // Closed client connections are found out from write errors
+    sa.sa_handler = SIG_IGN;
+    if (sigaction(SIGPIPE, &sa, NULL) == -1)
+      return error("Failed to ignore SIGPIPE");
   }
 
   sigemptyset(&sigmask);
 
+  // Start the logger and writer threads, with SIGINT blocked
+  if (log_init() != 0)
+    return error("Failed to start logger thread");
+  if ((n_workers > 0) && (workers_init(max_clients) != 0))
+    return error("Failed to start writer threads");
+  if ((n_ingest > 0) && (ingest_init() != 0))
+    return error("Failed to start ingest threads");
+
   // Main loop
   int ret = 0;
+  uint64_t woke_us = 0; // when the last wait for events returned
   while (keep_running) {
-    if (disconnected_clients_flag) {
-      // At leat one client was disconnected during the last iteration.
-      // Re-compact poll_array.
-      disconnected_clients_flag = 0;
-      size_t old_n = n_descriptors;
-      n_descriptors = n_sensors + n_listen;
-      for (size_t i = n_descriptors; i < old_n; i++) {
-        if (poll_array[i].fd >= 0) {
-          if (i != n_descriptors) {
-            poll_array[n_descriptors] = poll_array[i];
-            descriptor_flags[n_descriptors] = descriptor_flags[i];
-            if (client_list) {
-              client_list[n_descriptors] = client_list[i];
-              rpc_remap *r = client_list[n_descriptors].next;
-              if (r) {
-                r->prev = &client_list[n_descriptors];
-                do {
-                  r->client_desc = n_descriptors;
-                  r = r->next;
-                } while (r);
-              }
-            }
-          }
-          n_descriptors++;
-        }
-      }
-    }
+    // Clients disconnected during the last iteration can now be reused
+    while (n_closed_slots > 0)
+      free_slots[n_free_slots++] = closed_slots[--n_closed_slots];
 
     // At most every 200 ms, send out a heartbeat to each sensor.
     // If a sensor was disconnected, attempt to reconnect.
@@ -971,7 +5929,7 @@ int main(int argc, char *argv[])
       nsec += 1000000000;
       sec -= 1;
     }
-    if ((sec != 0) || (nsec > 200000000)) {
+    if ((n_ingest == 0) && ((sec != 0) || (nsec > 200000000))) {
       tl_packet_header heartbeat = { TL_PTYPE_HEARTBEAT, 0, 0 };
       memcpy(&last_heartbeat, &cur_time, sizeof(struct timespec));
       for (size_t i = 0; i < n_sensors; i++) {
@@ -982,8 +5940,15 @@ int main(int argc, char *argv[])
           // Attempt to reconnect, or exit if too much time has passed
           const char *url = sensor_url[i];
           poll_array[i].fd = tlopen(url, O_NONBLOCK|O_CLOEXEC, &io_log);
+          poll_array[i].events = POLLIN;
+          if ((poll_array[i].fd >= 0) &&
+              (event_update(&main_loop, i) != 0)) {
+            tlclose(poll_array[i].fd);
+            poll_array[i].fd = -1;
+          }
           if (poll_array[i].fd >= 0) {
             logmsg("Successfully reopened sensor at %s", url);
+            sensor_opens[i]++;
           } else if (sensor_reconnect_timeout > 0) {
             if ((cur_time.tv_sec > last_reconnect_attempt.tv_sec) ||
                 ((cur_time.tv_sec == last_reconnect_attempt.tv_sec) &&
@@ -999,8 +5964,18 @@ int main(int argc, char *argv[])
         continue;
     }
 
-    struct timespec timeout = { .tv_sec = 0, .tv_nsec = 100000000 };
-    int n_events = ppoll(poll_array, n_descriptors, &timeout, &sigmask);
+    ring_flush(0);
+    if (n_workers > 0)
+      wake_workers();
+    else
+      write_clients();
+    int wait_ms = (client_mode == CLIENT_MODE_SHARED) ? rpc_wait_ms(100) : 100;
+    wait_ms = ring_flush_wait_ms(wait_ms);
+    if (woke_us > 0)
+      histogram_add(&stats.loop_us, monotonic_us() - woke_us);
+    int n_events = event_wait(&main_loop, n_descriptors, wait_ms, &sigmask);
+    woke_us = monotonic_us();
+    stat_add(&stats.loop_iterations, 1);
     if (n_events < 0) {
       if (errno != EINTR) {
         keep_running = 0;
@@ -1011,43 +5986,23 @@ int main(int argc, char *argv[])
 
     // See if there are remapped RPCs that have had no reply for a while,
     // and free up the spots for new RPCs.
-    if (client_mode == CLIENT_MODE_SHARED) {
-      for (rpc_remap *remap = NULL; (remap = get_timedout(time(NULL)));) {
-        int client_fd = -1;
-        if (remap->client_desc >= 0) {
-          // The client is still connected. Send a timeout error back.
-          client_fd = poll_array[remap->client_desc].fd;
-          if (client_fd >= 0) {
-            tl_rpc_request_packet req;
-            req.req.id = remap->orig_id;
-            tl_rpc_error_packet *err =
-              tl_rpc_make_error(&req, TL_RPC_ERROR_TIMEOUT);
-            memcpy(tl_packet_routing_data(&err->hdr), remap->routing,
-                   remap->routing_size);
-            tl_packet_set_routing_size(&err->hdr, remap->routing_size);
-            if (send_packet(remap->client_desc, (tl_packet*)err) < 0) {
-              logmsg("Failed to send synthetic RPC timeout error");
-              disconnect_client(remap->client_desc);
-            }
-          }
-        }
-        logmsg("RPC remap timeout: client #%d RPC #%d", client_fd,
-               remap->orig_id);
-        insert_after(&remap_array[0], remove_next(remap->prev, 1));
-      }
+    if ((client_mode == CLIENT_MODE_SHARED) && (rpc_expire() != SUCCESS)) {
+      keep_running = 0;
+      ret = 1;
+      continue;
     }
 
     if (n_events < 1)
       continue;
 
-    for (size_t ps = 0; (n_events > 0) && (ps < n_descriptors); ps++) {
-      if (poll_array[ps].revents != 0)
-        n_events--;
-      else
-        continue;
-
+    for (int i = 0; i < n_events; i++) {
+      size_t ps = main_loop.ready[i];
       if (ps < n_sensors) {
-        // Event on sensor's descriptor
+        // Event on sensor's descriptor. Skip it if an ingest thread reads
+        // the sensor (ppoll still reports hangups for those): the thread
+        // closes the descriptor itself.
+        if (n_ingest > 0)
+          continue;
         while (poll_array[ps].fd >= 0) {
           if (handle_tlio(ps) == SUCCESS)
             break;
@@ -1071,6 +6026,13 @@ int main(int argc, char *argv[])
         }
         if (!keep_running)
           break;
+      } else if (descriptor_flags[ps] & WORKER_PIPE) {
+        // Packets or closed clients from the writer threads
+        if (handle_workers(ps) != SUCCESS) {
+          keep_running = 0;
+          ret = 1;
+          break;
+        }
       } else if (ps < (n_sensors + n_listen)) {
         // Event on listening sockets
         if (client_connection(ps) != SUCCESS) {
@@ -1081,11 +6043,15 @@ int main(int argc, char *argv[])
         }
       } else {
         // Client interaction. Skip if we closed the client handling an
-        // event in this same poll iteration. If something goes wrong,
-        // simply close the client unless it's a critical error
-        if (poll_array[ps].fd >= 0) {
+        // event in this same poll iteration, or if it belongs to a writer
+        // thread (ppoll still reports hangups for those). If something goes
+        // wrong, simply close the client unless it's a critical error
+        if ((poll_array[ps].fd >= 0) &&
+            !(descriptor_flags[ps] & CLIENT_WORKER)) {
           int ret;
-          if (descriptor_flags[ps] & WEBSOCKET_HANDSHAKE) {
+          if (descriptor_flags[ps] & STATS_CLIENT) {
+            ret = handle_stats(ps);
+          } else if (descriptor_flags[ps] & WEBSOCKET_HANDSHAKE) {
 #if WEBSOCKETS
             ret = handle_websock(ps);
 #else
@@ -1109,25 +6075,38 @@ int main(int argc, char *argv[])
 
   logmsgverbose("Attempting clean termination of I/O descriptors");
 
+  ring_flush(1);
+  if (n_workers > 0)
+    workers_finish();
+  if (n_ingest > 0)
+    ingest_finish();
+  log_finish();
+
   // Give it about a second.
   for (int n = 0; n < 20; n++, usleep(50000)) {
     size_t left = 0;
     for (size_t i = 0; i < n_descriptors; i++) {
-      if (poll_array[i].fd >= 0) {
-        if ((i >= n_sensors) && (i < (n_sensors + n_listen))) {
-          // this was a listening socket, just close it.
-          close(poll_array[i].fd);
-          poll_array[i].fd = -1;
-        }
+      int fd = poll_array[i].fd;
+      if (fd < 0)
+        continue;
+      if ((i >= n_sensors) && (i < (n_sensors + n_listen))) {
+        // this was a listening socket, just close it.
+        close(fd);
+        poll_array[i].fd = -1;
+        continue;
+      }
+      // this was a TLIO descriptor. try to flush any remaining data
+      int pending;
+      if ((i < n_sensors) ||
+          (descriptor_flags[i] & (WEBSOCKET_HANDSHAKE | STATS_CLIENT)))
+        pending = (tlsend(fd, NULL) != 0) && (errno == EOVERFLOW);
+      else
+        pending = (client_write(n_workers, i, fd) == 1);
+      if (pending) {
+        left++;
       } else {
-        // this was a TLIO descriptor. try to flush any remaining data
-        if ((tlsend(poll_array[i].fd, NULL) == 0) || (errno != EOVERFLOW)) {
-          if (tlclose(poll_array[i].fd) != 0)
-            close(poll_array[i].fd);
-          poll_array[i].fd = -1;
-        } else {
-          left++;
-        }
+        client_close(fd);
+        poll_array[i].fd = -1;
       }
     }
     if (left == 0) {